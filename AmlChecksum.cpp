@@ -0,0 +1,351 @@
+#include <string.h>
+#include "AmlChecksum.h"
+#include "defs.h"
+#include "pozix.h"
+
+#if defined(_M_X64) || defined(__x86_64__) || defined(_M_IX86) || defined(__i386__)
+#define AML_CHECKSUM_X86
+#include <emmintrin.h>
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define AML_TARGET_AVX2
+#else
+#define AML_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#elif defined(__aarch64__) || defined(_M_ARM64) || defined(__ARM_NEON)
+#define AML_CHECKSUM_NEON
+#include <arm_neon.h>
+#endif
+
+// Scalar kernels are the reference: every vector kernel sums its aligned body and hands the
+// remaining bytes (an even / multiple of 4 offset) to these, so the results are bit-exact.
+
+static unsigned int sum16_scalar (const void *buf, int len) {
+    const unsigned char *p = (const unsigned char *)buf;
+    unsigned int sum = 0;
+    for (; len > 1; len -= 2, p += 2) {
+        sum += (unsigned int)p[0] | (unsigned int)p[1] << 8;
+    }
+    if (len) {
+        sum += *p;
+    }
+    return sum;
+}
+
+static unsigned int sum32_scalar (const void *buf, int len) {
+    const unsigned char *p = (const unsigned char *)buf;
+    unsigned int sum = 0;
+    for (; len > 3; len -= 4, p += 4) {
+        sum += (unsigned int)p[0] | (unsigned int)p[1] << 8 | (unsigned int)p[2] << 16 |
+            (unsigned int)p[3] << 24;
+    }
+    switch (len) {
+    case 3:
+        sum += (unsigned int)p[2] << 16;
+        // fall through
+    case 2:
+        sum += (unsigned int)p[1] << 8;
+        // fall through
+    case 1:
+        sum += p[0];
+        break;
+    default:
+        break;
+    }
+    return sum;
+}
+
+static bool supported_always (void) {
+    return true;
+}
+
+#ifdef AML_CHECKSUM_X86
+
+static unsigned int hsum_sse2 (__m128i v) {
+    v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2)));
+    v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(2, 3, 0, 1)));
+    return (unsigned int)_mm_cvtsi128_si32(v);
+}
+
+static unsigned int sum16_sse2 (const void *buf, int len) {
+    const char *p = (const char *)buf;
+    const __m128i low = _mm_set1_epi32(0xFFFF);
+    __m128i acc = _mm_setzero_si128();
+    int n = len & ~15;
+    for (int i = 0; i < n; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+        acc = _mm_add_epi32(acc, _mm_add_epi32(_mm_and_si128(v, low), _mm_srli_epi32(v, 16)));
+    }
+    return hsum_sse2(acc) + sum16_scalar(p + n, len - n);
+}
+
+static unsigned int sum32_sse2 (const void *buf, int len) {
+    const char *p = (const char *)buf;
+    __m128i acc0 = _mm_setzero_si128();
+    __m128i acc1 = _mm_setzero_si128();
+    int n = len & ~31;
+    for (int i = 0; i < n; i += 32) {
+        acc0 = _mm_add_epi32(acc0, _mm_loadu_si128((const __m128i *)(p + i)));
+        acc1 = _mm_add_epi32(acc1, _mm_loadu_si128((const __m128i *)(p + i + 16)));
+    }
+    return hsum_sse2(_mm_add_epi32(acc0, acc1)) + sum32_scalar(p + n, len - n);
+}
+
+static bool supported_sse2 (void) {
+#if defined(_M_X64) || defined(__x86_64__)
+    return true; // part of x86-64 baseline
+#elif defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 1);
+    return (info[3] & (1 << 26)) != 0;
+#else
+    return __builtin_cpu_supports("sse2");
+#endif
+}
+
+AML_TARGET_AVX2 static unsigned int hsum_avx2 (__m256i v) {
+    __m128i s = _mm_add_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+    s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(1, 0, 3, 2)));
+    s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(2, 3, 0, 1)));
+    return (unsigned int)_mm_cvtsi128_si32(s);
+}
+
+AML_TARGET_AVX2 static unsigned int sum16_avx2 (const void *buf, int len) {
+    const char *p = (const char *)buf;
+    const __m256i low = _mm256_set1_epi32(0xFFFF);
+    __m256i acc0 = _mm256_setzero_si256();
+    __m256i acc1 = _mm256_setzero_si256();
+    int n = len & ~63;
+    for (int i = 0; i < n; i += 64) {
+        __m256i v0 = _mm256_loadu_si256((const __m256i *)(p + i));
+        __m256i v1 = _mm256_loadu_si256((const __m256i *)(p + i + 32));
+        acc0 = _mm256_add_epi32(acc0, _mm256_add_epi32(_mm256_and_si256(v0, low),
+            _mm256_srli_epi32(v0, 16)));
+        acc1 = _mm256_add_epi32(acc1, _mm256_add_epi32(_mm256_and_si256(v1, low),
+            _mm256_srli_epi32(v1, 16)));
+    }
+    return hsum_avx2(_mm256_add_epi32(acc0, acc1)) + sum16_scalar(p + n, len - n);
+}
+
+AML_TARGET_AVX2 static unsigned int sum32_avx2 (const void *buf, int len) {
+    const char *p = (const char *)buf;
+    __m256i acc0 = _mm256_setzero_si256();
+    __m256i acc1 = _mm256_setzero_si256();
+    int n = len & ~63;
+    for (int i = 0; i < n; i += 64) {
+        acc0 = _mm256_add_epi32(acc0, _mm256_loadu_si256((const __m256i *)(p + i)));
+        acc1 = _mm256_add_epi32(acc1, _mm256_loadu_si256((const __m256i *)(p + i + 32)));
+    }
+    return hsum_avx2(_mm256_add_epi32(acc0, acc1)) + sum32_scalar(p + n, len - n);
+}
+
+static bool supported_avx2 (void) {
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7) {
+        return false;
+    }
+    __cpuid(info, 1);
+    bool osxsave = (info[2] & (1 << 27)) != 0 && (info[2] & (1 << 28)) != 0; // OSXSAVE, AVX
+    if (!osxsave || (_xgetbv(0) & 6) != 6) {
+        return false; // OS does not save YMM state
+    }
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) != 0;
+#else
+    return __builtin_cpu_supports("avx2");
+#endif
+}
+
+#endif // AML_CHECKSUM_X86
+
+#ifdef AML_CHECKSUM_NEON
+
+static unsigned int sum16_neon (const void *buf, int len) {
+    const unsigned char *p = (const unsigned char *)buf;
+    uint32x4_t acc0 = vdupq_n_u32(0);
+    uint32x4_t acc1 = vdupq_n_u32(0);
+    int n = len & ~31;
+    for (int i = 0; i < n; i += 32) {
+        acc0 = vpadalq_u16(acc0, vreinterpretq_u16_u8(vld1q_u8(p + i)));
+        acc1 = vpadalq_u16(acc1, vreinterpretq_u16_u8(vld1q_u8(p + i + 16)));
+    }
+    uint32x4_t acc = vaddq_u32(acc0, acc1);
+    unsigned int sum = vgetq_lane_u32(acc, 0) + vgetq_lane_u32(acc, 1) +
+        vgetq_lane_u32(acc, 2) + vgetq_lane_u32(acc, 3);
+    return sum + sum16_scalar(p + n, len - n);
+}
+
+static unsigned int sum32_neon (const void *buf, int len) {
+    const unsigned char *p = (const unsigned char *)buf;
+    uint32x4_t acc0 = vdupq_n_u32(0);
+    uint32x4_t acc1 = vdupq_n_u32(0);
+    int n = len & ~31;
+    for (int i = 0; i < n; i += 32) {
+        acc0 = vaddq_u32(acc0, vreinterpretq_u32_u8(vld1q_u8(p + i)));
+        acc1 = vaddq_u32(acc1, vreinterpretq_u32_u8(vld1q_u8(p + i + 16)));
+    }
+    uint32x4_t acc = vaddq_u32(acc0, acc1);
+    unsigned int sum = vgetq_lane_u32(acc, 0) + vgetq_lane_u32(acc, 1) +
+        vgetq_lane_u32(acc, 2) + vgetq_lane_u32(acc, 3);
+    return sum + sum32_scalar(p + n, len - n);
+}
+
+#endif // AML_CHECKSUM_NEON
+
+static const AmlChecksumKernel kernels[] = {
+    { "scalar", supported_always, sum16_scalar, sum32_scalar },
+#ifdef AML_CHECKSUM_X86
+    { "sse2", supported_sse2, sum16_sse2, sum32_sse2 },
+    { "avx2", supported_avx2, sum16_avx2, sum32_avx2 },
+#endif
+#ifdef AML_CHECKSUM_NEON
+    { "neon", supported_always, sum16_neon, sum32_neon },
+#endif
+};
+
+enum { AML_CHECKSUM_KERNELS = sizeof(kernels) / sizeof(kernels[0]) };
+
+static const AmlChecksumKernel *selected = &kernels[0];
+
+static_init(aml_checksum) { // the last supported kernel is the fastest one
+    for (int i = 0; i < (int)AML_CHECKSUM_KERNELS; i++) {
+        if (kernels[i].supported()) {
+            selected = &kernels[i];
+        }
+    }
+}
+
+int AmlChecksumKernels (const AmlChecksumKernel **list) {
+    *list = kernels;
+    return AML_CHECKSUM_KERNELS;
+}
+
+const AmlChecksumKernel *AmlChecksumCurrent (void) {
+    return selected;
+}
+
+bool AmlChecksumSelect (const char *name) {
+    for (int i = 0; i < (int)AML_CHECKSUM_KERNELS; i++) {
+        if (!strcmp(kernels[i].name, name) && kernels[i].supported()) {
+            selected = &kernels[i];
+            return true;
+        }
+    }
+    return false;
+}
+
+unsigned short checksum_add (unsigned short *buf, int len, int noFlip) {
+    unsigned int checksum = selected->sum16(buf, len);
+    checksum = (checksum >> 16) + (unsigned short)checksum;
+    checksum = (checksum >> 16) + (unsigned short)checksum;
+    if (!noFlip) {
+        checksum = ~checksum;
+    }
+    return (unsigned short)checksum;
+}
+
+unsigned int checksum_64K (void *buf, int len) {
+    return selected->sum32(buf, len);
+}
+
+#ifdef AML_CHECKSUM_SMOKE_TEST // change to #ifndef to run
+
+#include <stdio.h>
+#include <stdlib.h>
+
+// checksum_64K as it was before the kernels: the word loop ran (len >> 2) + 1 times, i.e. it
+// read the word at the tail (or just past the end) and then added the tail on top of that.
+// Fed with zero padded buffers it matches the intended result, which is what is compared.
+static unsigned int checksum_64K_legacy (void *buf, int len) {
+    unsigned int checksum = 0;
+    for (int div = len >> 2; div >= 0; div--) {
+        checksum += le32toh(*(unsigned int *)buf);
+        buf = (char *)buf + 4;
+    }
+    switch (len & 3) {
+    case 1:
+        checksum += *(unsigned char *)buf;
+        break;
+    case 2:
+        checksum += le16toh(*(unsigned short *)buf);
+        break;
+    case 3:
+        checksum += le32toh(*(unsigned int *)buf) & 0xFFFFFF;
+        break;
+    default:
+        break;
+    }
+    return checksum;
+}
+
+static unsigned int checksum_add_legacy (unsigned short *buf, int len) {
+    unsigned int checksum = 0;
+    for (; len > 1; len -= 2) {
+        checksum += le16toh(*buf);
+        ++buf;
+    }
+    if (len) {
+        checksum += *(unsigned char *)buf;
+    }
+    return checksum;
+}
+
+static_init(aml_checksum_smoke_test) {
+    enum { SIZE = 0x10000, PAD = 64 };
+    unsigned char *data = (unsigned char *)malloc(SIZE + PAD * 2);
+    unsigned char *padded = (unsigned char *)calloc(SIZE + PAD * 2, 1);
+    for (int i = 0; i < SIZE + PAD * 2; i++) {
+        data[i] = (unsigned char)rand();
+    }
+    memset(data + 1000, 0xFF, 3000); // long 0xFF run exercises the carries
+    int failures = 0;
+    const AmlChecksumKernel *list = nullptr;
+    int n = AmlChecksumKernels(&list);
+    for (int k = 0; k < n; k++) {
+        if (!list[k].supported()) {
+            printf("%-6s not supported by this CPU\n", list[k].name);
+            continue;
+        }
+        for (int offset = 0; offset < 8; offset++) {
+            for (int len = 0; len <= SIZE; len = len < 300 ? len + 1 : len * 2 + 3) {
+                len = min(len, (int)SIZE);
+                memcpy(padded + offset, data + offset, len); // zero tail for the legacy loop
+                memset(padded + offset + len, 0, PAD);
+                unsigned int s16 = list[k].sum16(data + offset, len);
+                unsigned int s32 = list[k].sum32(data + offset, len);
+                if (s16 != checksum_add_legacy((unsigned short *)(padded + offset), len) ||
+                    s32 != checksum_64K_legacy(padded + offset, len) ||
+                    s32 != sum32_scalar(data + offset, len)) {
+                    printf("%s mismatch offset=%d len=%d\n", list[k].name, offset, len);
+                    failures++;
+                }
+                if (len == SIZE) {
+                    break;
+                }
+            }
+        }
+        enum { ROUNDS = 8192 }; // 512MB
+        double time = time_in_milliseconds();
+        unsigned int sink = 0;
+        for (int i = 0; i < ROUNDS; i++) {
+            sink += list[k].sum16(data, SIZE);
+        }
+        double gbs16 = (double)SIZE * ROUNDS / ((time_in_milliseconds() - time) * 1e6);
+        time = time_in_milliseconds();
+        for (int i = 0; i < ROUNDS; i++) {
+            sink += list[k].sum32(data, SIZE);
+        }
+        double gbs32 = (double)SIZE * ROUNDS / ((time_in_milliseconds() - time) * 1e6);
+        printf("%-6s checksum_add %6.2f GB/s  checksum_64K %6.2f GB/s  (%08X)\n", list[k].name,
+            gbs16, gbs32, sink);
+    }
+    printf("selected: %s, %d mismatches\n", AmlChecksumCurrent()->name, failures);
+    free(padded);
+    free(data);
+    exit(failures == 0 ? 0 : 1);
+}
+
+#endif
@@ -0,0 +1,20 @@
+#pragma once
+
+// Checksums of everything sent to the ROM / u-boot:
+//   checksum_add: 16-bit one's-complement sum of little endian halfwords (odd byte added as is)
+//   checksum_64K: 32-bit sum of little endian words (1..3 tail bytes added as a zero padded word)
+// Both are computed by the fastest kernel the CPU supports (selected once at startup).
+
+unsigned short checksum_add (unsigned short *buf, int len, int noFlip);
+unsigned int checksum_64K (void *buf, int len);
+
+struct AmlChecksumKernel {
+    const char *name;
+    bool (*supported)(void);
+    unsigned int (*sum16)(const void *buf, int len); // sum of halfwords modulo 2^32, not folded
+    unsigned int (*sum32)(const void *buf, int len); // checksum_64K
+};
+
+int AmlChecksumKernels(const AmlChecksumKernel **kernels); // returns number of kernels, [0] is scalar
+const AmlChecksumKernel *AmlChecksumCurrent(void);         // currently selected
+bool AmlChecksumSelect(const char *name);                  // false if unknown or not supported by CPU
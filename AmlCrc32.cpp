@@ -0,0 +1,127 @@
+#include "AmlCrc32.h"
+#include "pozix.h"
+
+enum { CRC32_POLY = 0xEDB88320u }; // reflected 0x04C11DB7
+
+// slicing-by-8 tables: table[k][b] is the crc of byte b followed by k zero bytes
+static unsigned int table[8][256];
+// x2n[n] = x^(2^n) modulo the polynomial, for AmlCrc32Combine
+static unsigned int x2n[32];
+
+// a * b modulo the polynomial (reflected bit order)
+static unsigned int MultModP (unsigned int a, unsigned int b) {
+    unsigned int m = 1u << 31;
+    unsigned int p = 0;
+    for (;;) {
+        if (a & m) {
+            p ^= b;
+            if ((a & (m - 1)) == 0) {
+                break;
+            }
+        }
+        m >>= 1;
+        b = b & 1 ? (b >> 1) ^ CRC32_POLY : b >> 1;
+    }
+    return p;
+}
+
+// x^(n * 2^k) modulo the polynomial
+static unsigned int X2nModP (unsigned long long n, unsigned int k) {
+    unsigned int p = 1u << 31; // x^0
+    while (n) {
+        if (n & 1) {
+            p = MultModP(x2n[k & 31], p);
+        }
+        n >>= 1;
+        k++;
+    }
+    return p;
+}
+
+static_init(aml_crc32) {
+    for (unsigned int i = 0; i < 256; i++) {
+        unsigned int c = i;
+        for (int k = 0; k < 8; k++) {
+            c = c & 1 ? (c >> 1) ^ CRC32_POLY : c >> 1;
+        }
+        table[0][i] = c;
+    }
+    for (unsigned int i = 0; i < 256; i++) {
+        for (int k = 1; k < 8; k++) {
+            table[k][i] = (table[k - 1][i] >> 8) ^ table[0][table[k - 1][i] & 0xFF];
+        }
+    }
+    unsigned int p = 1u << 30; // x^1
+    x2n[0] = p;
+    for (int n = 1; n < 32; n++) {
+        x2n[n] = p = MultModP(p, p);
+    }
+}
+
+unsigned int AmlCrc32 (unsigned int crc, const void *data, size_t len) {
+    const unsigned char *p = (const unsigned char *)data;
+    crc = ~crc;
+    for (; len > 0 && ((uintptr_t)p & 7) != 0; len--) {
+        crc = (crc >> 8) ^ table[0][(crc ^ *p++) & 0xFF];
+    }
+    for (; len >= 8; len -= 8, p += 8) {
+        unsigned int lo = crc ^ ((unsigned int)p[0] | (unsigned int)p[1] << 8 |
+            (unsigned int)p[2] << 16 | (unsigned int)p[3] << 24);
+        crc = table[7][lo & 0xFF] ^ table[6][(lo >> 8) & 0xFF] ^ table[5][(lo >> 16) & 0xFF] ^
+            table[4][lo >> 24] ^ table[3][p[4]] ^ table[2][p[5]] ^ table[1][p[6]] ^ table[0][p[7]];
+    }
+    for (; len > 0; len--) {
+        crc = (crc >> 8) ^ table[0][(crc ^ *p++) & 0xFF];
+    }
+    return ~crc;
+}
+
+unsigned int AmlCrc32Combine (unsigned int crc1, unsigned int crc2, long long len2) {
+    return MultModP(X2nModP((unsigned long long)len2, 3), crc1) ^ crc2;
+}
+
+unsigned int AmlCrc32Repeat (const void *pattern, size_t len, long long count) {
+    unsigned int crc = 0;
+    unsigned int power = AmlCrc32(0, pattern, len); // crc of 2^i copies
+    long long powerLen = (long long)len;
+    for (; count > 0; count >>= 1) {
+        if (count & 1) {
+            crc = AmlCrc32Combine(crc, power, powerLen);
+        }
+        power = AmlCrc32Combine(power, power, powerLen);
+        powerLen *= 2;
+    }
+    return crc;
+}
+
+#ifdef AML_CRC32_SMOKE_TEST // change to #ifndef to run
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static_init(aml_crc32_smoke_test) {
+    int failures = AmlCrc32(0, "123456789", 9) != 0xCBF43926u;
+    enum { SIZE = 1 << 20 };
+    unsigned char *data = (unsigned char *)malloc(SIZE);
+    for (int i = 0; i < SIZE; i++) {
+        data[i] = (unsigned char)rand();
+    }
+    unsigned int whole = AmlCrc32(0, data, SIZE);
+    for (int split = 0; split <= SIZE; split += SIZE / 7) {
+        unsigned int a = AmlCrc32(0, data, split);
+        unsigned int b = AmlCrc32(0, data + split, SIZE - split);
+        failures += AmlCrc32Combine(a, b, SIZE - split) != whole;
+    }
+    memset(data, 0x5A, SIZE);
+    failures += AmlCrc32Repeat(data, 4096, SIZE / 4096) != AmlCrc32(0, data, SIZE);
+    double start = time_in_milliseconds();
+    for (int i = 0; i < 64; i++) {
+        whole = AmlCrc32(whole, data, SIZE);
+    }
+    double ms = time_in_milliseconds() - start;
+    printf("crc32 %d failures, %.0f MB/s (%08x)\n", failures, ms > 0 ? 64 * 1000.0 / ms : 0.0, whole);
+    free(data);
+}
+
+#endif
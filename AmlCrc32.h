@@ -0,0 +1,12 @@
+#pragma once
+
+#include <stddef.h>
+
+// CRC-32 (IEEE 802.3, zlib compatible: AmlCrc32(0, data, len) == crc32(0, data, len)).
+// AmlCrc32Combine lets ranges be checksummed independently (e.g. on several cores) and joined
+// afterwards: crc(A + B) == AmlCrc32Combine(crc(A), crc(B), length(B)).
+
+unsigned int AmlCrc32(unsigned int crc, const void *data, size_t len);
+unsigned int AmlCrc32Combine(unsigned int crc1, unsigned int crc2, long long len2);
+// crc of `count` back to back copies of pattern[0..len) in O(log count)
+unsigned int AmlCrc32Repeat(const void *pattern, size_t len, long long count);
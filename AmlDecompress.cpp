@@ -0,0 +1,278 @@
+#include <stdio.h>
+#include <string.h>
+#include "AmlDecompress.h"
+#include "AmlTime.h"
+#include "Amldbglog.h"
+#include "defs.h"
+#include "pozix.h"
+#ifndef WINDOWS
+#include <sys/wait.h>
+#endif
+
+#ifdef _MSC_VER
+#define fseeko64(fp, ofs, origin) _fseeki64(fp, ofs, origin)
+#define ftello(fp) _ftelli64(fp)
+#define popen _popen
+#define pclose _pclose
+#endif
+
+#ifdef WINDOWS
+static const char *PipeMode = "rb";
+#else
+static const char *PipeMode = "r";
+#endif
+
+enum {
+    ZSTD_MAGIC = 0xFD2FB528,
+    LZ4_MAGIC = 0x184D2204,
+    SKIPPABLE_MAGIC = 0x184D2A50, // zstd and lz4, low 4 bits are free
+    SKIPPABLE_MASK = 0xFFFFFFF0,
+};
+
+static const char *Tools[] = {
+    nullptr,
+    "gzip -dc",
+    "xz -dc -T0", // multi-threaded where the xz build supports it, ignored otherwise
+    "zstd -dcq",
+    "lz4 -dcq",
+};
+
+static const char *Names[] = { "none", "gzip", "xz", "zstd", "lz4" };
+
+int AmlCompressionDetect (const char *filename) {
+    unsigned char magic[6] = {};
+    FILE *fp = fopen(filename, "rb");
+    if (fp == nullptr) {
+        return AML_COMPRESSION_NONE;
+    }
+    size_t n = fread(magic, 1, sizeof(magic), fp);
+    fclose(fp);
+    if (n >= 2 && magic[0] == 0x1F && magic[1] == 0x8B) {
+        return AML_COMPRESSION_GZIP;
+    }
+    if (n >= 6 && !memcmp(magic, "\xFD" "7zXZ\0", 6)) {
+        return AML_COMPRESSION_XZ;
+    }
+    if (n >= 4 && le32toh(INT_AT(magic, 0)) == ZSTD_MAGIC) {
+        return AML_COMPRESSION_ZSTD;
+    }
+    if (n >= 4 && le32toh(INT_AT(magic, 0)) == LZ4_MAGIC) {
+        return AML_COMPRESSION_LZ4;
+    }
+    return AML_COMPRESSION_NONE;
+}
+
+const char *AmlCompressionName (int compression) {
+    return compression >= 0 && compression <= AML_COMPRESSION_LZ4 ? Names[compression] : "?";
+}
+
+// `tool filename` with filename quoted as one shell word, false if it does not fit
+static bool FormatCommand (char *command, size_t size, const char *tool, const char *filename) {
+    size_t n = (size_t)snprintf(command, size, "%s ", tool);
+#ifdef WINDOWS
+    if (strchr(filename, '"') != nullptr) {
+        return false;
+    }
+    n += (size_t)snprintf(command + n, n < size ? size - n : 0, "\"%s\"", filename);
+#else
+    // '...' with every ' written as '\''
+    n += (size_t)snprintf(command + n, n < size ? size - n : 0, "'");
+    for (const char *p = filename; *p && n < size; p++) {
+        if (*p == '\'') {
+            n += (size_t)snprintf(command + n, size - n, "'\\''");
+        } else {
+            command[n++] = *p;
+        }
+    }
+    n += (size_t)snprintf(command + n, n < size ? size - n : 0, "'");
+#endif
+    return n < size;
+}
+
+FILE *AmlDecompressOpen (const char *filename, int compression) {
+    char command[1024];
+    if (compression <= AML_COMPRESSION_NONE || compression > AML_COMPRESSION_LZ4 ||
+        !FormatCommand(command, sizeof(command), Tools[compression], filename)) {
+        return nullptr;
+    }
+    FILE *pipe = popen(command, PipeMode);
+    if (pipe == nullptr) {
+        aml_printf("[AmlDecompress]can not run %s\n", command);
+    }
+    return pipe;
+}
+
+int AmlDecompressClose (FILE *pipe) {
+    int status = pclose(pipe);
+#ifndef WINDOWS
+    if (status != -1 && WIFEXITED(status)) {
+        status = WEXITSTATUS(status);
+    }
+#endif
+    return status;
+}
+
+static bool ReadAt (FILE *fp, long long offset, void *to, size_t len) {
+    return fseeko64(fp, offset, 0) == 0 && fread(to, 1, len, fp) == len;
+}
+
+// Sum of the frame content sizes of a zstd file, -1 if a frame does not record it
+static long long ZstdContentSize (FILE *fp, long long fileSize) {
+    long long size = 0;
+    long long at = 0;
+    unsigned char header[18];
+    while (at < fileSize) {
+        if (!ReadAt(fp, at, header, 8)) {
+            return -1;
+        }
+        unsigned int magic = le32toh(INT_AT(header, 0));
+        if ((magic & SKIPPABLE_MASK) == SKIPPABLE_MAGIC) {
+            at += 8 + (long long)le32toh(INT_AT(header, 4));
+            continue;
+        }
+        if (magic != ZSTD_MAGIC) {
+            return -1;
+        }
+        unsigned char descriptor = header[4];
+        bool singleSegment = (descriptor >> 5) & 1;
+        bool checksum = (descriptor >> 2) & 1;
+        static const int didSizes[] = { 0, 1, 2, 4 };
+        static const int fcsSizes[] = { 0, 2, 4, 8 };
+        int didSize = didSizes[descriptor & 3];
+        int fcsSize = (descriptor >> 6) == 0 ? (singleSegment ? 1 : 0) : fcsSizes[descriptor >> 6];
+        if (fcsSize == 0) {
+            return -1; // streamed, size not recorded
+        }
+        int headerSize = 5 + (singleSegment ? 0 : 1) + didSize + fcsSize;
+        if (!ReadAt(fp, at, header, (size_t)headerSize)) {
+            return -1;
+        }
+        const unsigned char *fcs = header + headerSize - fcsSize;
+        unsigned long long contentSize = 0;
+        for (int i = fcsSize - 1; i >= 0; i--) {
+            contentSize = contentSize << 8 | fcs[i];
+        }
+        size += (long long)contentSize + (fcsSize == 2 ? 256 : 0);
+        at += headerSize;
+        for (bool last = false; !last;) {
+            unsigned char block[3];
+            if (!ReadAt(fp, at, block, 3)) {
+                return -1;
+            }
+            unsigned int blockHeader = block[0] | block[1] << 8 | block[2] << 16;
+            last = blockHeader & 1;
+            unsigned int type = (blockHeader >> 1) & 3;
+            if (type == 3) {
+                return -1;
+            }
+            at += 3 + (type == 1 ? 1 : blockHeader >> 3); // RLE blocks store a single byte
+        }
+        at += checksum ? 4 : 0;
+    }
+    return at == fileSize ? size : -1;
+}
+
+// Same for lz4 frames, whose content size field is optional (lz4 --content-size)
+static long long Lz4ContentSize (FILE *fp, long long fileSize) {
+    long long size = 0;
+    long long at = 0;
+    unsigned char header[19];
+    while (at < fileSize) {
+        if (!ReadAt(fp, at, header, 8)) {
+            return -1;
+        }
+        unsigned int magic = le32toh(INT_AT(header, 0));
+        if ((magic & SKIPPABLE_MASK) == SKIPPABLE_MAGIC) {
+            at += 8 + (long long)le32toh(INT_AT(header, 4));
+            continue;
+        }
+        unsigned char flags = header[4];
+        if (magic != LZ4_MAGIC || (flags >> 6) != 1 || !(flags & 0x08)) {
+            return -1; // legacy frame or no content size
+        }
+        int headerSize = 4 + 2 + 8 + ((flags & 0x01) ? 4 : 0) + 1;
+        if (!ReadAt(fp, at, header, (size_t)headerSize)) {
+            return -1;
+        }
+        size += (long long)(le32toh(INT_AT(header, 6)) | (unsigned long long)le32toh(INT_AT(header, 10)) << 32);
+        at += headerSize;
+        for (;;) {
+            unsigned char block[4];
+            if (!ReadAt(fp, at, block, 4)) {
+                return -1;
+            }
+            unsigned int blockSize = le32toh(INT_AT(block, 0)) & 0x7FFFFFFF;
+            at += 4;
+            if (blockSize == 0) {
+                break; // end mark
+            }
+            at += blockSize + ((flags & 0x10) ? 4 : 0);
+        }
+        at += (flags & 0x04) ? 4 : 0;
+    }
+    return at == fileSize ? size : -1;
+}
+
+// xz keeps an index of every block: `xz --robot --list` reads it without decompressing
+static long long XzContentSize (const char *filename) {
+    char command[1024];
+    FILE *pipe = FormatCommand(command, sizeof(command), "xz --robot --list", filename) ?
+        popen(command, PipeMode) : nullptr;
+    if (pipe == nullptr) {
+        return -1;
+    }
+    long long size = -1;
+    char line[512];
+    while (fgets(line, sizeof(line), pipe)) {
+        long long totals = 0;
+        if (sscanf(line, "totals\t%*s\t%*s\t%*s\t%lld", &totals) == 1) {
+            size = totals;
+        }
+    }
+    return AmlDecompressClose(pipe) == 0 ? size : -1;
+}
+
+static long long PreScan (const char *filename, int compression) {
+    FILE *pipe = AmlDecompressOpen(filename, compression);
+    if (pipe == nullptr) {
+        return -1;
+    }
+    enum { SLICE = 1 << 20 };
+    char *buffer = (char *)malloc(SLICE);
+    long long size = 0;
+    for (size_t n; buffer != nullptr && (n = fread(buffer, 1, SLICE, pipe)) > 0;) {
+        size += (long long)n;
+    }
+    free(buffer);
+    return AmlDecompressClose(pipe) == 0 && buffer != nullptr ? size : -1;
+}
+
+long long AmlDecompressedSize (const char *filename, int compression) {
+    long long size = -1;
+    if (compression == AML_COMPRESSION_XZ) {
+        size = XzContentSize(filename);
+    } else if (compression == AML_COMPRESSION_ZSTD || compression == AML_COMPRESSION_LZ4) {
+        FILE *fp = fopen(filename, "rb");
+        if (fp != nullptr && fseeko64(fp, 0, 2) == 0) {
+            long long fileSize = ftello(fp);
+            size = compression == AML_COMPRESSION_ZSTD ? ZstdContentSize(fp, fileSize)
+                : Lz4ContentSize(fp, fileSize);
+        }
+        if (fp != nullptr) {
+            fclose(fp);
+        }
+    }
+    if (size >= 0) {
+        return size;
+    }
+    time_t start = timeGetTime();
+    size = PreScan(filename, compression);
+    if (size < 0) {
+        aml_printf("[AmlDecompress]%s -d failed on %s (corrupt, or the tool is not on PATH)\n",
+            AmlCompressionName(compression), filename);
+    } else {
+        aml_printf("[AmlDecompress]%s does not record its size, pre-scan found 0x%llx bytes in %dms\n",
+            filename, size, (int)(timeGetTime() - start));
+    }
+    return size;
+}
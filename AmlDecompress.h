@@ -0,0 +1,24 @@
+#pragma once
+
+#include <stdio.h>
+
+// Compressed partition images (gzip, xz, zstd, lz4) are decompressed by the standard command line
+// tool of each format, which must be on PATH, reading its stdout through a pipe. The tool runs as
+// its own process (its own core) ahead of the reader thread that feeds the USB writer, so nothing
+// is ever unpacked to disk.
+
+enum {
+    AML_COMPRESSION_NONE,
+    AML_COMPRESSION_GZIP,
+    AML_COMPRESSION_XZ,
+    AML_COMPRESSION_ZSTD,
+    AML_COMPRESSION_LZ4,
+};
+
+int AmlCompressionDetect(const char *filename); // AML_COMPRESSION_* from the magic number
+const char *AmlCompressionName(int compression);
+FILE *AmlDecompressOpen(const char *filename, int compression); // decompressed stream, nullptr on failure
+int AmlDecompressClose(FILE *pipe);                              // 0 if the tool succeeded
+// From the container metadata (xz index, zstd/lz4 frame headers) when it has it, else by
+// decompressing once and counting (gzip only stores the size modulo 4GB). -1 on failure.
+long long AmlDecompressedSize(const char *filename, int compression);
@@ -0,0 +1,308 @@
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include "AmlImage.h"
+#include "AmlSparse.h"
+#include "AmlDecompress.h"
+#include "Amldbglog.h"
+#include "pozix.h"
+#ifndef WINDOWS
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#ifdef _MSC_VER
+#define fseeko64(fp, ofs, origin) _fseeki64(fp, ofs, origin)
+#define ftello(fp) _ftelli64(fp)
+#endif
+
+// WILLNEED window kept ahead of the reader, re-issued after every ReadAheadStep bytes
+static long long ReadAhead = 8ll << 20;
+static long long ReadAheadStep = 1ll << 20;
+
+struct AmlImage {
+    const char *map;      // whole file, nullptr when buffered
+    FILE *fp;             // buffered fallback
+    AmlSparseEncoder *sparse; // encoded on the fly from a raw image
+    int compression;      // fp is the decompressor's output
+    char *filename;       // to restart the decompressor on a backward seek
+    long long size;       // compressed: -2 until first asked for
+    long long offset;
+    long long advised;    // WILLNEED was requested up to here
+};
+
+#ifdef WINDOWS
+
+typedef struct { void *VirtualAddress; size_t NumberOfBytes; } AmlMemoryRangeEntry;
+typedef BOOL (WINAPI *PrefetchVirtualMemoryProc)(HANDLE, ULONG_PTR, AmlMemoryRangeEntry *, ULONG);
+
+static const char *MapImage (const char *filename, long long *size) {
+    HANDLE file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr,
+        OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    if (file == INVALID_HANDLE_VALUE) {
+        return nullptr;
+    }
+    const char *map = nullptr;
+    LARGE_INTEGER length = {};
+    if (GetFileType(file) == FILE_TYPE_DISK && GetFileSizeEx(file, &length) &&
+        length.QuadPart > 0 && (unsigned long long)length.QuadPart <= (size_t)-1 / 2) {
+        HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (mapping != nullptr) {
+            map = (const char *)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+            CloseHandle(mapping); // the view keeps the mapping alive
+        }
+    }
+    CloseHandle(file);
+    *size = length.QuadPart;
+    return map;
+}
+
+static void AdviseWillNeed (const char *address, long long len) {
+    // Windows 8+, looked up at run time so the tool still starts on older systems
+    static PrefetchVirtualMemoryProc prefetch = (PrefetchVirtualMemoryProc)GetProcAddress(
+        GetModuleHandleA("kernel32.dll"), "PrefetchVirtualMemory");
+    if (prefetch != nullptr) {
+        AmlMemoryRangeEntry range = { (void *)address, (size_t)len };
+        prefetch(GetCurrentProcess(), 1, &range, 0);
+    }
+}
+
+static void UnmapImage (const char *map, long long size) {
+    (void)size;
+    UnmapViewOfFile(map);
+}
+
+#else
+
+static const char *MapImage (const char *filename, long long *size) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        return nullptr;
+    }
+    const char *map = nullptr;
+    struct stat st = {};
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0 &&
+        (unsigned long long)st.st_size <= (size_t)-1 / 2) {
+        void *address = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (address != MAP_FAILED) {
+            map = (const char *)address;
+            madvise(address, (size_t)st.st_size, MADV_SEQUENTIAL);
+        }
+    }
+    close(fd); // the mapping keeps the file referenced
+    *size = st.st_size;
+    return map;
+}
+
+static void AdviseWillNeed (const char *address, long long len) {
+    // madvise wants a page aligned start
+    uintptr_t page = (uintptr_t)mem_page_size();
+    uintptr_t start = (uintptr_t)address & ~(page - 1);
+    madvise((void *)start, (size_t)(len + ((uintptr_t)address - start)), MADV_WILLNEED);
+}
+
+static void UnmapImage (const char *map, long long size) {
+    munmap((void *)map, (size_t)size);
+}
+
+#endif
+
+AmlImage *AmlImageOpen (const char *filename) {
+    long long size = 0;
+    const char *map = MapImage(filename, &size);
+    FILE *fp = nullptr;
+    if (map == nullptr) {
+        fp = fopen(filename, "rb");
+        if (fp == nullptr) {
+            aml_printf("Open file %s failed\n", filename);
+            return nullptr;
+        }
+        // pipes can not seek: size stays unknown
+        size = fseeko64(fp, 0, 2) == 0 ? ftello(fp) : -1;
+        if (size >= 0 && fseeko64(fp, 0, 0) != 0) {
+            size = -1;
+        }
+    }
+    AmlImage *image = new AmlImage();
+    image->map = map;
+    image->fp = fp;
+    image->size = size;
+    return image;
+}
+
+AmlImage *AmlImageOpenSparse (const char *filename, bool skipZero, AmlSparseStats *stats) {
+    AmlImage *raw = AmlImageOpenDecompressed(filename);
+    if (!raw) {
+        return nullptr;
+    }
+    AmlSparseEncoder *sparse = AmlSparseEncoderOpen(raw, skipZero, stats);
+    if (!sparse) {
+        return nullptr;
+    }
+    AmlImage *image = new AmlImage();
+    image->sparse = sparse;
+    image->size = AmlSparseEncodedSize(sparse);
+    return image;
+}
+
+AmlImage *AmlImageOpenDecompressed (const char *filename) {
+    int compression = AmlCompressionDetect(filename);
+    if (compression == AML_COMPRESSION_NONE) {
+        return AmlImageOpen(filename);
+    }
+    FILE *pipe = AmlDecompressOpen(filename, compression);
+    if (pipe == nullptr) {
+        return nullptr;
+    }
+    aml_printf("[AmlImage]%s is %s compressed, decompressing while it is sent\n", filename,
+        AmlCompressionName(compression));
+    AmlImage *image = new AmlImage();
+    image->fp = pipe;
+    image->compression = compression;
+    image->filename = strdup(filename);
+    image->size = -2;
+    return image;
+}
+
+// Discards decompressed bytes up to offset; going back starts the decompressor over
+static int SeekDecompressed (AmlImage *image, long long offset) {
+    if (offset < image->offset) {
+        AmlDecompressClose(image->fp);
+        image->fp = AmlDecompressOpen(image->filename, image->compression);
+        image->offset = 0;
+        if (image->fp == nullptr) {
+            return -1;
+        }
+    }
+    char discard[4096];
+    while (image->offset < offset) {
+        size_t n = fread(discard, 1, (size_t)min(offset - image->offset, (long long)sizeof(discard)),
+            image->fp);
+        if (n == 0) {
+            return -1;
+        }
+        image->offset += (long long)n;
+    }
+    return 0;
+}
+
+bool AmlImageMapped (AmlImage *image) {
+    return image->map != nullptr;
+}
+
+long long AmlImageSize (AmlImage *image) {
+    if (image->size == -2) {
+        image->size = AmlDecompressedSize(image->filename, image->compression);
+    }
+    return image->size;
+}
+
+long long AmlImageOffset (AmlImage *image) {
+    return image->offset;
+}
+
+int AmlImageRead (AmlImage *image, char *buffer, int len, const char **data) {
+    if (image->sparse != nullptr) {
+        int n = AmlSparseEncoderRead(image->sparse, buffer, len);
+        if (n > 0) {
+            image->offset += n;
+        }
+        *data = buffer;
+        return n;
+    }
+    if (image->map == nullptr) {
+        if (image->fp == nullptr) {
+            return -1; // decompressor could not be restarted
+        }
+        size_t n = fread(buffer, 1, (size_t)len, image->fp);
+        if (n < (size_t)len && ferror(image->fp)) {
+            return -1;
+        }
+        image->offset += (long long)n;
+        *data = buffer;
+        return (int)n;
+    }
+    long long n = min((long long)len, image->size - image->offset);
+    *data = image->map + image->offset;
+    image->offset += n;
+    if (image->advised - image->offset < ReadAhead - ReadAheadStep &&
+        image->advised < image->size) {
+        long long from = max(image->advised, image->offset);
+        long long to = min(image->offset + ReadAhead, image->size);
+        AdviseWillNeed(image->map + from, to - from);
+        image->advised = to;
+    }
+    return (int)n;
+}
+
+int AmlImageSeek (AmlImage *image, long long offset) {
+    if (image->sparse != nullptr) {
+        if (offset < image->offset && AmlSparseEncoderRewind(image->sparse) != 0) {
+            return -1;
+        }
+        image->offset = offset < image->offset ? 0 : image->offset;
+        char discard[4096]; // forward: the encoded stream is produced and dropped
+        while (image->offset < offset) {
+            int n = AmlSparseEncoderRead(image->sparse, discard,
+                (int)min(offset - image->offset, (long long)sizeof(discard)));
+            if (n <= 0) {
+                return -1;
+            }
+            image->offset += n;
+        }
+    } else if (image->compression != AML_COMPRESSION_NONE) {
+        if (image->fp == nullptr || offset < 0 || SeekDecompressed(image, offset) != 0) {
+            return -1;
+        }
+    } else if (image->map == nullptr) {
+        if (fseeko64(image->fp, offset, 0) != 0) {
+            return -1;
+        }
+    } else if (offset < 0 || offset > image->size) {
+        return -1;
+    }
+    image->offset = offset;
+    image->advised = offset;
+    return 0;
+}
+
+int AmlImageReadAt (AmlImage *image, long long offset, char *buffer, int len, const char **data) {
+    if (image->sparse != nullptr || image->compression != AML_COMPRESSION_NONE || offset < 0 ||
+        (image->size >= 0 && offset > image->size)) {
+        return -1;
+    }
+    if (image->map != nullptr) {
+        *data = image->map + offset;
+        return (int)min((long long)len, image->size - offset);
+    }
+    long long position = image->offset;
+    if (fseeko64(image->fp, offset, 0) != 0) {
+        return -1;
+    }
+    size_t n = fread(buffer, 1, (size_t)len, image->fp);
+    *data = buffer;
+    if (fseeko64(image->fp, position, 0) != 0 || (n < (size_t)len && ferror(image->fp))) {
+        return -1;
+    }
+    return (int)n;
+}
+
+void AmlImageClose (AmlImage *image) {
+    if (image == nullptr) {
+        return;
+    }
+    if (image->map != nullptr) {
+        UnmapImage(image->map, image->size);
+    }
+    if (image->fp != nullptr && image->compression != AML_COMPRESSION_NONE) {
+        AmlDecompressClose(image->fp);
+    } else if (image->fp != nullptr) {
+        fclose(image->fp);
+    }
+    free(image->filename);
+    AmlSparseEncoderClose(image->sparse);
+    delete image;
+}
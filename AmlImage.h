@@ -0,0 +1,32 @@
+#pragma once
+
+// Sequential image source for everything that streams a file to the device.
+// Regular files are memory mapped (read only, whole file) and read slices point straight into
+// the mapping, so the bulk write is fed without a staging copy. The kernel is told the access is
+// sequential and a few MB ahead of the reader are requested (WILLNEED) as it goes.
+// Files that can not be mapped (pipes, character devices, empty files, no address space on 32-bit
+// hosts) fall back to buffered fread into the caller's buffer.
+
+struct AmlImage;
+
+AmlImage *AmlImageOpen(const char *filename); // nullptr if the file can not be opened
+// Raw image read as Android sparse (see AmlSparse.h): size and reads are those of the encoded
+// stream, which is always buffered. The raw image may be compressed. stats may be nullptr.
+AmlImage *AmlImageOpenSparse(const char *filename, bool skipZero, struct AmlSparseStats *stats);
+// Same, but gzip/xz/zstd/lz4 compressed files (see AmlDecompress.h) are read decompressed through
+// a pipe. Seeking forward discards, seeking back restarts the decompressor, so the sparse encoder
+// still works on them; AmlImageReadAt does not. The size is worked out on the first AmlImageSize.
+AmlImage *AmlImageOpenDecompressed(const char *filename);
+bool AmlImageMapped(AmlImage *image);
+long long AmlImageSize(AmlImage *image);      // -1 if not known up front (pipe)
+long long AmlImageOffset(AmlImage *image);    // bytes consumed so far
+// Next `len` bytes (fewer at end of file) into *data. Mapped: *data points into the mapping and
+// stays valid until AmlImageClose, `buffer` is not touched and may be nullptr. Buffered: bytes
+// are read into `buffer` and *data == buffer. Returns bytes read, 0 at end of file, -1 on error.
+int AmlImageRead(AmlImage *image, char *buffer, int len, const char **data);
+// 0 or -1 (buffered input that can not seek). Sparse encoded and decompressed images seek forward
+// by producing and dropping the bytes in between.
+int AmlImageSeek(AmlImage *image, long long offset);
+// Positional read that leaves the sequential position alone. Thread safe for mapped images only.
+int AmlImageReadAt(AmlImage *image, long long offset, char *buffer, int len, const char **data);
+void AmlImageClose(AmlImage *image);
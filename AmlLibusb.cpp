@@ -1,12 +1,12 @@
 #include "AmlLibusb.h"
+#include "AmlUsbSim.h"
+#include "AmlUsbCapture.h"
 #include "Amldbglog.h"
 #include "defs.h"
 #include "pozix.h"
 
 #pragma warning(disable: 4100) // unreferenced formal parameter
 
-usbio_file_t handle;
-
 /*
  * Standard requests
  */
@@ -37,16 +37,64 @@ usbio_file_t handle;
 #define USB_ENDPOINT_IN  0x80
 #define USB_ENDPOINT_OUT 0x00
 
+static int UsbioControl (usbio_file_t file, int requestType, int request, int value, int index,
+    char *bytes, int size, int timeout) {
+    usbio_ctrl_setup_t setup = {};
+    setup.rt = (byte)requestType;
+    setup.req = (byte)request;
+    setup.val = (uint16_t)value;
+    setup.ix = (uint16_t)index;
+    setup.len = (uint16_t)size;
+    int transferred = 0;
+    int r = usbio_control(file, &setup, bytes, &transferred, timeout);
+    return r != 0 ? -r : transferred;
+}
+
+static int UsbioBulkRead (usbio_file_t file, int ep, char *bytes, int size, int timeout) {
+    int transferred = 0;
+    int r = usbio_bulk_in(file, (byte)ep, bytes, size, &transferred);
+    return r != 0 ? -r : transferred;
+}
+
+static int UsbioBulkWrite (usbio_file_t file, int ep, const char *bytes, int size, int timeout) {
+    int r = usbio_bulk_out(file, (byte)ep, bytes, size);
+    return r != 0 ? -r : size;
+}
+
+const AmlUsbBackend AmlUsbBackendUsbio = {
+    "usbio", usbio_open, usbio_count, usbio_open_at, usbio_close, UsbioControl, UsbioBulkRead, UsbioBulkWrite,
+    usbio_alloc_buffer, usbio_free_buffer, usbio_submit_urb, usbio_discard_urb, usbio_reap_urb,
+    usbio_host_controller,
+};
+
+static const AmlUsbBackend *Backend = nullptr;
+
+const AmlUsbBackend *AmlUsbGetBackend (void) {
+    if (Backend == nullptr) {
+        const char *sim = getenv("AML_USB_SIM");
+        const char *capture = getenv("AML_USB_CAPTURE");
+        const AmlUsbBackend *backend = sim ? AmlUsbSimBackend(sim) : &AmlUsbBackendUsbio;
+        const AmlUsbBackend *captured = capture ? AmlUsbCaptureBackend(backend, capture) : nullptr;
+        Backend = captured ? captured : backend;
+    }
+    return Backend;
+}
+
+void AmlUsbSetBackend (const AmlUsbBackend *backend) {
+    Backend = backend;
+}
+
 int usb_control_msg(usbio_file_t file, int requesttype, int request, int value, int index, char *bytes, int size, int timeout) {
-    return -1;
+    return AmlUsbGetBackend()->control(file, requesttype, request, value, index, bytes, size,
+        timeout);
 }
 
 int usb_bulk_read(usbio_file_t file, int ep, char *bytes, int size, int timeout) {
-    return -1;
+    return AmlUsbGetBackend()->bulkRead(file, ep, bytes, size, timeout);
 }
 
 int usb_bulk_write(usbio_file_t file, int ep, char *bytes, int size, int timeout) {
-    return -1;
+    return AmlUsbGetBackend()->bulkWrite(file, ep, bytes, size, timeout);
 }
 
 const char* usb_strerror() { return "usb error"; }
@@ -55,7 +103,7 @@ int IOCTL_READ_MEM_Handler(usbDevIoCtrl ctrl) {
     if (!ctrl.in_buf || !ctrl.out_buf || ctrl.in_len != 4 || !ctrl.out_len) {
         return 0;
     }
-    int ret = usb_control_msg(handle, USB_ENDPOINT_IN | USB_TYPE_VENDOR,
+    int ret = usb_control_msg(ctrl.handle, USB_ENDPOINT_IN | USB_TYPE_VENDOR,
         AML_LIBUSB_REQ_READ_CTRL, SHORT_AT(ctrl.in_buf, 2),
         SHORT_AT(ctrl.in_buf, 0), ctrl.out_buf,
         min(ctrl.out_len, 64u), 50000);
@@ -72,7 +120,7 @@ int IOCTL_WRITE_MEM_Handler(usbDevIoCtrl ctrl) {
             47LL, ctrl.in_buf, ctrl.in_len);
         return 0;
     }
-    int ret = usb_control_msg(handle, USB_ENDPOINT_OUT | USB_TYPE_VENDOR,
+    int ret = usb_control_msg(ctrl.handle, USB_ENDPOINT_OUT | USB_TYPE_VENDOR,
         AML_LIBUSB_REQ_WRITE_CTRL, SHORT_AT(ctrl.in_buf, 2),
         SHORT_AT(ctrl.in_buf, 0), ctrl.in_buf + 4,
         min(ctrl.in_len - 4, 64u), 50000);
@@ -104,7 +152,7 @@ int IOCTL_RUN_IN_ADDR_Handler(usbDevIoCtrl ctrl) {
         return 0;
     }
     ctrl.in_buf[0] |= 0x10;
-    usb_control_msg(handle, USB_ENDPOINT_OUT | USB_TYPE_VENDOR,
+    usb_control_msg(ctrl.handle, USB_ENDPOINT_OUT | USB_TYPE_VENDOR,
         AML_LIBUSB_REQ_RUN_ADDR, SHORT_AT(ctrl.in_buf, 2),
         SHORT_AT(ctrl.in_buf, 0), ctrl.in_buf, 4, 50000);
     return 1LL;
@@ -123,7 +171,7 @@ int IOCTL_DO_LARGE_MEM_Handler(usbDevIoCtrl ctrl, int readOrWrite) {
     }
     uint64_t len = LONG_AT(ctrl.in_buf, 4);
     unsigned int index = (unsigned int)(value + len - 1) / value;
-    int ret = usb_control_msg(handle, USB_ENDPOINT_OUT | USB_TYPE_VENDOR,
+    int ret = usb_control_msg(ctrl.handle, USB_ENDPOINT_OUT | USB_TYPE_VENDOR,
         readOrWrite ? AML_LIBUSB_REQ_READ_MEM
         : AML_LIBUSB_REQ_WRITE_MEM, value, index,
         ctrl.in_buf, 16, 50000);
@@ -137,7 +185,7 @@ int IOCTL_DO_LARGE_MEM_Handler(usbDevIoCtrl ctrl, int readOrWrite) {
 
 int IOCTL_IDENTIFY_HOST_Handler(usbDevIoCtrl ctrl) {
     if (ctrl.out_buf && ctrl.out_len <= 8) {
-        int ret = usb_control_msg(handle, USB_ENDPOINT_IN | USB_TYPE_VENDOR,
+        int ret = usb_control_msg(ctrl.handle, USB_ENDPOINT_IN | USB_TYPE_VENDOR,
             AML_LIBUSB_REQ_IDENTIFY, 0, 0, ctrl.out_buf, ctrl.out_len,
             5000);
         *ctrl.p_in_data_size = (unsigned int)max(0, ret);
@@ -156,7 +204,7 @@ int IOCTL_TPL_CMD_Handler(usbDevIoCtrl ctrl) {
     if (!ctrl.in_buf || ctrl.in_len != 68) {
         return 0;
     }
-    int ret = usb_control_msg(handle, USB_ENDPOINT_OUT | USB_TYPE_VENDOR,
+    int ret = usb_control_msg(ctrl.handle, USB_ENDPOINT_OUT | USB_TYPE_VENDOR,
         AML_LIBUSB_REQ_TPL_CMD, SHORT_AT(ctrl.in_buf, 64),
         SHORT_AT(ctrl.in_buf, 66), ctrl.in_buf, 64, 50000);
     *ctrl.p_in_data_size = (unsigned int)max(0, ret);
@@ -176,7 +224,7 @@ int IOCTL_TPL_STATUS_Handler_Ex (usbDevIoCtrl ctrl, unsigned int timeout) {
         return 0;
     }
 
-    int ret = usb_control_msg(handle, USB_ENDPOINT_IN | USB_TYPE_VENDOR,
+    int ret = usb_control_msg(ctrl.handle, USB_ENDPOINT_IN | USB_TYPE_VENDOR,
         AML_LIBUSB_REQ_TPL_STATUS, SHORT_AT(ctrl.in_buf, 0),
         SHORT_AT(ctrl.in_buf, 2), ctrl.out_buf, 64, 1000 * timeout);
     if (ret < 0) {
@@ -189,7 +237,7 @@ int IOCTL_WRITE_MEDIA_Handler (usbDevIoCtrl ctrl, unsigned int timeout) {
     if (ctrl.in_buf && ctrl.in_len > 0x1F) {
         *((short *)ctrl.in_buf + 8) = 239;
         *((short *)ctrl.in_buf + 9) = 256;
-        int ret = usb_control_msg(handle, USB_ENDPOINT_OUT | USB_TYPE_VENDOR,
+        int ret = usb_control_msg(ctrl.handle, USB_ENDPOINT_OUT | USB_TYPE_VENDOR,
             AML_LIBUSB_REQ_WRITE_MEDIA, 1, 0xFFFF, ctrl.in_buf, 32,
             timeout);
         *ctrl.p_in_data_size = (unsigned int)max(0, ret);
@@ -220,7 +268,7 @@ int IOCTL_READ_MEDIA_Handler (usbDevIoCtrl ctrl, unsigned int timeout) {
     }
     uint64_t len = LONG_AT(ctrl.in_buf, 4);
     unsigned int index = (unsigned int)(value + len - 1) / value;
-    int ret = usb_control_msg(handle, USB_ENDPOINT_IN | USB_TYPE_VENDOR,
+    int ret = usb_control_msg(ctrl.handle, USB_ENDPOINT_IN | USB_TYPE_VENDOR,
         AML_LIBUSB_REQ_READ_MEDIA, value, index, ctrl.in_buf, 16,
         timeout);
     *ctrl.p_in_data_size = (unsigned int)max(0, ret);
@@ -235,7 +283,7 @@ int IOCTL_BULK_CMD_Handler (usbDevIoCtrl ctrl, unsigned int a1, unsigned int req
     if (!ctrl.in_buf || ctrl.in_len != 68) {
         return 0;
     }
-    int ret = usb_control_msg(handle, 64, request, 0, 2, ctrl.in_buf, 64, 50000);
+    int ret = usb_control_msg(ctrl.handle, 64, request, 0, 2, ctrl.in_buf, 64, 50000);
     *ctrl.p_in_data_size = (unsigned int)max(0, ret);
     if (ret < 0) {
         aml_printf("AM_REQ_BULK_CMD_Handler ret=%d,blkcmd=%s error_msg=%s\n", ret,
@@ -254,6 +302,7 @@ int usbDeviceIoControl(AmlUsbDrv *drv, unsigned int control_code, void *in_buf,
     ctrl.out_len = out_len;
     ctrl.p_in_data_size = in_data_size;
     ctrl.p_out_data_size = out_data_size;
+    ctrl.handle = drv->handle;
     usbDevIo v18 = {};
     v18.a = 1;
     v18.b = 0;
@@ -299,6 +348,7 @@ int usbDeviceIoControlEx(AmlUsbDrv *drv, unsigned int controlCode, void *in_buf,
     ctrl.out_len = out_len;
     ctrl.p_in_data_size = in_data_size;
     ctrl.p_out_data_size = out_data_size;
+    ctrl.handle = drv->handle;
     usbDevIo v18 = {};
     v18.a = 1;
     v18.b = 0;
@@ -322,7 +372,7 @@ int usbDeviceIoControlEx(AmlUsbDrv *drv, unsigned int controlCode, void *in_buf,
 }
 
 int usbReadFile(AmlUsbDrv *drv, void *buf, unsigned int len, unsigned int *read) {
-    int ret = usb_bulk_read(handle, drv->read_ep, (char *)buf, len, 90000);
+    int ret = usb_bulk_read(drv->handle, drv->read_ep, (char *)buf, len, 90000);
     *read = (unsigned int)max(0, ret);
     if (ret < 0) {
         aml_printf("usbReadFile len=%d,ret=%d error_msg=%s\n", len, ret, usb_strerror());
@@ -331,7 +381,7 @@ int usbReadFile(AmlUsbDrv *drv, void *buf, unsigned int len, unsigned int *read)
 }
 
 int usbWriteFile(AmlUsbDrv *drv, const void *buf, unsigned int len, unsigned int *read) {
-    int ret = usb_bulk_write(handle, drv->write_ep, (char *)buf, len, 50000);
+    int ret = usb_bulk_write(drv->handle, drv->write_ep, (char *)buf, len, 50000);
     *read = (unsigned int)max(0, ret);
     if (ret < 0) {
         aml_printf("usbWriteFile len=%d,ret=%d error_msg=%s\n", len, ret, usb_strerror());
@@ -339,16 +389,263 @@ int usbWriteFile(AmlUsbDrv *drv, const void *buf, unsigned int len, unsigned int
     return ret >= 0;
 }
 
-int OpenUsbDevice(AmlUsbDrv *drv) {
-    int r = usbio_open(AML_ID_VENDOR, AML_ID_PRODUCE, &handle, 1);
-    assert(r == 0);
+// Gets every URB of urbs[0, depth) that is not idle back before its buffers go away: discards them
+// and reaps until none is in flight, EINTR retried. If the backend will not give one back the
+// session is closed (that kills its URBs) so that no stale URB reaches the next queued call.
+static void DrainUrbs (AmlUsbDrv *drv, usbio_buffer_t *urbs, usbio_buffer_t **idle, int *nIdle, int depth) {
+    const AmlUsbBackend *usb = AmlUsbGetBackend();
+    for (int i = 0; i < depth; i++) {
+        bool pending = true;
+        for (int j = 0; j < *nIdle && pending; j++) { pending = idle[j] != &urbs[i]; }
+        if (pending) { usb->discardUrb(drv->handle, &urbs[i]); }
+    }
+    int failures = 0;
+    while (*nIdle < depth) {
+        usbio_buffer_t *b = nullptr;
+        int e = usb->reapUrb(drv->handle, &b);
+        if (b != nullptr && b >= urbs && b < urbs + depth) {
+            idle[(*nIdle)++] = b;
+        } else if (b == nullptr && e != EINTR && ++failures > 3) {
+            aml_printf("DrainUrbs %d URBs not reaped (error=%d), closing the device\n", depth - *nIdle, e);
+            usb->close(drv->handle);
+            drv->handle = -1;
+            if (drv->device) {
+                drv->device->handle = -1; // the next OpenUsbDevice() opens a new session
+            }
+            return;
+        }
+    }
+}
+
+// Pipelined bulk OUT: keeps up to `depth` URBs of `chunk` bytes in flight on drv->write_ep
+// instead of waiting for every usbWriteFile() to complete. URBs complete in submission order
+// thus *written is always a contiguous prefix of buf; *transfers counts completed URBs.
+// With usbfs DMA memory every chunk is staged in its URB's slot: the copy replaces the one the
+// kernel would do and the kernel skips allocating a buffer per URB. Otherwise URBs point into buf.
+int usbWriteFileQueued(AmlUsbDrv *drv, const void *buf, unsigned int len, unsigned int chunk,
+    int depth, unsigned int *written, unsigned int *transfers) {
+    const AmlUsbBackend *usb = AmlUsbGetBackend();
+    usbio_buffer_t urbs[USBIO_BULK_REQUEST_QUEUE_SIZE];
+    usbio_buffer_t *idle[USBIO_BULK_REQUEST_QUEUE_SIZE];
+    int requested[USBIO_BULK_REQUEST_QUEUE_SIZE] = {};
+    depth = max(1, min(depth, (int)USBIO_BULK_REQUEST_QUEUE_SIZE));
+    chunk = max(1u, min(chunk, (unsigned int)USBIO_BULK_REQUEST_SIZE));
+    int staging = depth * (int)chunk;
+    bool dma = false;
+    byte *slots = (byte *)usb->allocBuffer(drv->handle, staging, &dma);
+    if (!dma) {
+        usb->freeBuffer(slots, staging, dma); // heap staging would only add a copy
+        slots = nullptr;
+    }
+    int nIdle = 0;
+    for (int i = 0; i < depth; i++) {
+        idle[nIdle++] = &urbs[i];
+    }
+    *written = 0;
+    *transfers = 0;
+    unsigned int submitted = 0;
+    int r = 0;
+    while (submitted < len || nIdle < depth) {
+        while (r == 0 && submitted < len && nIdle > 0) {
+            usbio_buffer_t *b = idle[--nIdle];
+            memset(b, 0, sizeof(*b));
+            b->bytes = (int)min(len - submitted, chunk);
+            if (slots) {
+                b->data = slots + (b - urbs) * chunk;
+                memcpy(b->data, (const byte *)buf + submitted, b->bytes);
+            } else {
+                b->data = (byte *)buf + submitted;
+            }
+            requested[b - urbs] = b->bytes;
+            r = usb->submitUrb(drv->handle, drv->write_ep, b);
+            if (r == 0) {
+                submitted += b->bytes;
+            } else {
+                idle[nIdle++] = b;
+                aml_printf("usbWriteFileQueued submit len=%d error=%d\n", b->bytes, r);
+            }
+        }
+        if (nIdle == depth) {
+            break; // nothing in flight (done or failed to submit)
+        }
+        if (r != 0) { // drain: whatever is still pending must be back before the buffers go away
+            DrainUrbs(drv, urbs, idle, &nIdle, depth);
+            break;
+        }
+        usbio_buffer_t *b = nullptr;
+        int e = usb->reapUrb(drv->handle, &b);
+        if (b == nullptr) {
+            if (e != EINTR) {
+                aml_printf("usbWriteFileQueued reap error=%d\n", e);
+                r = e != 0 ? e : EIO;
+            }
+            continue;
+        }
+        idle[nIdle++] = b;
+        if (e == 0 && b->bytes != requested[b - urbs]) {
+            aml_printf("usbWriteFileQueued want %d, actual %d\n", requested[b - urbs], b->bytes);
+            e = EIO;
+        }
+        if (e == 0 && r == 0) {
+            *written += (unsigned int)b->bytes;
+            ++*transfers;
+        } else if (r == 0) {
+            r = e;
+        }
+    }
+    usb->freeBuffer(slots, staging, dma);
+    return r == 0 && *written == len;
+}
+
+// Read-ahead bulk IN: keeps up to `depth` USBIO_BULK_REQUEST_SIZE URBs submitted on drv->read_ep
+// and hands every completed buffer to sink() in order while the following URBs are still on the wire.
+// sink() returning non zero stops the transfer. *read is the number of bytes given to sink().
+// URB buffers are usbfs DMA memory when available, so the device writes straight into what sink() sees.
+int usbReadFileQueued(AmlUsbDrv *drv, unsigned int len, int depth,
+    int (*sink)(void *that, char *data, unsigned int bytes), void *that, unsigned int *read) {
+    const AmlUsbBackend *usb = AmlUsbGetBackend();
+    usbio_buffer_t urbs[USBIO_BULK_REQUEST_QUEUE_SIZE];
+    usbio_buffer_t *idle[USBIO_BULK_REQUEST_QUEUE_SIZE];
+    unsigned int expected[USBIO_BULK_REQUEST_QUEUE_SIZE] = {};
+    depth = max(1, min(depth, (int)USBIO_BULK_REQUEST_QUEUE_SIZE));
+    bool dma = false;
+    byte *buffers = (byte *)usb->allocBuffer(drv->handle, depth * USBIO_BULK_REQUEST_SIZE, &dma);
+    if (buffers == nullptr) {
+        aml_printf("usbReadFileQueued out of memory\n");
+        return 0;
+    }
+    int nIdle = 0;
+    for (int i = 0; i < depth; i++) {
+        idle[nIdle++] = &urbs[i];
+    }
+    *read = 0;
+    unsigned int requested = 0;
+    int r = 0;
+    while (true) {
+        while (r == 0 && requested < len && nIdle > 0) {
+            usbio_buffer_t *b = idle[--nIdle];
+            memset(b, 0, sizeof(*b));
+            b->data = buffers + (b - urbs) * USBIO_BULK_REQUEST_SIZE;
+            b->bytes = USBIO_BULK_REQUEST_SIZE;
+            r = usb->submitUrb(drv->handle, drv->read_ep, b);
+            if (r == 0) {
+                expected[b - urbs] = min(len - requested, (unsigned int)USBIO_BULK_REQUEST_SIZE);
+                requested += expected[b - urbs];
+            } else {
+                idle[nIdle++] = b;
+                aml_printf("usbReadFileQueued submit error=%d\n", r);
+            }
+        }
+        if (nIdle == depth) {
+            break; // nothing in flight (done or failed to submit)
+        }
+        if (r != 0) { // drain: whatever is still pending must be back before the buffers go away
+            DrainUrbs(drv, urbs, idle, &nIdle, depth);
+            break;
+        }
+        usbio_buffer_t *b = nullptr;
+        int e = usb->reapUrb(drv->handle, &b);
+        if (b == nullptr) {
+            if (e != EINTR) {
+                aml_printf("usbReadFileQueued reap error=%d\n", e);
+                r = e != 0 ? e : EIO;
+            }
+            continue;
+        }
+        idle[nIdle++] = b;
+        if (e == 0 && r == 0) {
+            unsigned int bytes = min((unsigned int)b->bytes, expected[b - urbs]);
+            requested -= expected[b - urbs] - bytes; // short packet: device will send the rest in next URBs
+            if (bytes == 0) {
+                aml_printf("usbReadFileQueued zero length transfer at %d of %d\n", *read, len);
+                r = EIO;
+            } else if (sink(that, (char *)b->data, bytes) != 0) {
+                r = ECANCELED;
+            }
+            *read += bytes;
+        } else if (r == 0) {
+            r = e;
+        }
+    }
+    usb->freeBuffer(buffers, depth * USBIO_BULK_REQUEST_SIZE, dma);
+    return r == 0 && *read == len;
+}
+
+struct usb_device *AmlNewDeviceHandle (void) {
+    struct usb_device *device = new usb_device();
+    device->handle = -1;
+    device->index = 0;
+    device->read_ep = (unsigned char)0x81;
+    device->write_ep = 2;
+    return device;
+}
+
+void AmlReleaseDeviceHandle (struct usb_device *device) {
+    if (device) {
+        if (device->handle >= 0) {
+            AmlUsbGetBackend()->close(device->handle);
+        }
+        delete device;
+    }
+}
+
+// Opens and claims the first `count` attached WorldCup devices in one enumeration pass (devall,
+// which drives all of them). devices[i]->index == i. Returns number of sessions created (0 if none).
+int AmlOpenDeviceHandles (struct usb_device **devices, int count) {
+    usbio_file_t files[AML_MAX_DEVICES] = {};
+    count = min(count, (int)AML_MAX_DEVICES);
+    int n = count > 0 ? AmlUsbGetBackend()->open(AML_ID_VENDOR, AML_ID_PRODUCE, files, count) : 0;
+    for (int i = 0; i < n; i++) {
+        devices[i] = AmlNewDeviceHandle();
+        devices[i]->handle = files[i];
+        devices[i]->index = i;
+    }
+    return max(0, n);
+}
+
+// Number of attached WorldCup devices. None of them is opened or claimed, so a board that another
+// process is flashing does not block the count.
+int AmlCountDevices (void) {
+    return max(0, AmlUsbGetBackend()->count(AML_ID_VENDOR, AML_ID_PRODUCE));
+}
+
+// Enumeration order is the only identity usbio gives us. Only the device at that position is
+// opened and claimed, the ones before it (possibly in use by other processes) are left alone.
+static int OpenSession (struct usb_device *device) {
+    if (device->index < 0 || device->index >= (int)AML_MAX_DEVICES) {
+        return 0;
+    }
+    return AmlUsbGetBackend()->openAt(AML_ID_VENDOR, AML_ID_PRODUCE, device->index,
+        &device->handle) == 1;
+}
+
+int OpenUsbDevice(AmlUsbDrv *drv, struct usb_device *device) {
+    drv->device = device;
     drv->read_ep = (unsigned char)0x81;
     drv->write_ep = 2;
-    return r == 0;
+    if (device == nullptr) {
+        return AmlUsbGetBackend()->open(AML_ID_VENDOR, AML_ID_PRODUCE, &drv->handle, 1) == 1;
+    }
+    if (device->handle < 0) { // enumerate /dev/bus/usb and claim interface 0 once per session
+        if (!OpenSession(device)) {
+            device->handle = -1;
+            return 0;
+        }
+    }
+    drv->handle = device->handle;
+    drv->read_ep = device->read_ep;
+    drv->write_ep = device->write_ep;
+    return 1;
 }
 
 int CloseUsbDevice (AmlUsbDrv *drv) {
-    int r = usbio_close(handle);
+    if (drv->device) {
+        return 1; // session stays open until AmlReleaseDeviceHandle()
+    }
+    if (drv->handle < 0) {
+        return 1; // closed by DrainUrbs()
+    }
+    int r = AmlUsbGetBackend()->close(drv->handle);
     assert(r == 0);
     return r == 0;
 }
@@ -362,14 +659,14 @@ int ResetDev (AmlUsbDrv *drv) {
 int Aml_Libusb_Ctrl_RdWr (void *device, unsigned int offset, char *buf, unsigned int len,
     unsigned int readOrWrite, unsigned int timeout) {
     struct AmlUsbDrv drv = {};
-    if (OpenUsbDevice(&drv) != 1) {
+    if (OpenUsbDevice(&drv, (struct usb_device *)device) != 1) {
         aml_printf("Fail in open dev\n");
         return -647;
     }
     int processedData = 0;
     while (processedData < (int)len) {
         int requestLen = min(len - processedData, 64u);
-        usb_control_msg(handle,
+        usb_control_msg(drv.handle,
             readOrWrite ? USB_ENDPOINT_IN | USB_TYPE_VENDOR : USB_TYPE_VENDOR,
             readOrWrite ? AML_LIBUSB_REQ_READ_CTRL : AML_LIBUSB_REQ_WRITE_CTRL,
             offset >> 16, offset, buf, requestLen, timeout);
@@ -383,7 +680,7 @@ int Aml_Libusb_Ctrl_RdWr (void *device, unsigned int offset, char *buf, unsigned
 
 int Aml_Libusb_Password (void *device, char *buf, int size, int timeout) {
     struct AmlUsbDrv drv = {};
-    if (OpenUsbDevice(&drv) != 1) {
+    if (OpenUsbDevice(&drv, (struct usb_device *)device) != 1) {
         aml_printf("Fail in open dev\n");
         return -698;
     }
@@ -397,7 +694,7 @@ int Aml_Libusb_Password (void *device, char *buf, int size, int timeout) {
     while (bufPtr < size) {
         value += buf[bufPtr++];
     }
-    int result = usb_control_msg(handle, USB_ENDPOINT_OUT | USB_TYPE_VENDOR,
+    int result = usb_control_msg(drv.handle, USB_ENDPOINT_OUT | USB_TYPE_VENDOR,
         AML_LIBUSB_REQ_PASSWORD, value, 0, buf, size, timeout);
     CloseUsbDevice(&drv);
     return result;
@@ -405,7 +702,7 @@ int Aml_Libusb_Password (void *device, char *buf, int size, int timeout) {
 
 int Aml_Libusb_get_chipinfo (void *device, char *buf, int size, int index, int timeout) {
     struct AmlUsbDrv drv = {};
-    if (OpenUsbDevice(&drv) != 1) {
+    if (OpenUsbDevice(&drv, (struct usb_device *)device) != 1) {
         aml_printf("Fail in open dev\n");
         return -750;
     }
@@ -414,7 +711,7 @@ int Aml_Libusb_get_chipinfo (void *device, char *buf, int size, int index, int t
             (unsigned int)size);
         return -757;
     }
-    int ret = usb_control_msg(handle, USB_ENDPOINT_IN | USB_TYPE_VENDOR,
+    int ret = usb_control_msg(drv.handle, USB_ENDPOINT_IN | USB_TYPE_VENDOR,
         AML_LIBUSB_REQ_CHIP_INFO, 0, index, buf, size, timeout);
     CloseUsbDevice(&drv);
     return ret;
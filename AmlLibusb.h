@@ -1,7 +1,7 @@
 #pragma once
 #include "usbio.h"
 
-extern usbio_file_t handle;
+enum { AML_MAX_DEVICES = 16 }; // WorldCup devices one process can drive at the same time
 
 struct usbDevIoCtrl {
     char *in_buf;   // host to device
@@ -10,6 +10,7 @@ struct usbDevIoCtrl {
     unsigned int out_len;
     unsigned int *p_in_data_size;
     unsigned int *p_out_data_size;
+    usbio_file_t handle; // device the request is sent to
 };
 
 struct usbDevIo {
@@ -21,9 +22,25 @@ struct usbDevIo {
     void *p5;
 };
 
+// Device session. The libusb-0.1 name is kept because `struct usb_device *` is the device handle
+// passed around by the scan code and AmlUsbRomRW. The device is opened and interface 0 claimed
+// by the first OpenUsbDevice() (or AmlOpenDeviceHandles()) and stays open until
+// AmlReleaseDeviceHandle(). All per-device state lives here, sessions of different devices
+// can be used from different threads.
+struct usb_device {
+    usbio_file_t handle; // -1 while not opened
+    int index;           // ordinal of the device in /dev/bus/usb enumeration order
+    unsigned char read_ep;
+    unsigned char write_ep;
+    int writeSeqNum; // large-mem sequence counters (see AmlUsbWriteLargeMem/AmlUsbReadLargeMem)
+    int readSeqNum;
+};
+
 struct AmlUsbDrv {
+    usbio_file_t handle;
     unsigned char read_ep;
     unsigned char write_ep;
+    struct usb_device *device; // null: legacy open/close of the first device on every call
 };
 
 enum AmlUsbRequest {
@@ -46,6 +63,32 @@ enum AmlUsbRequest {
     AML_LIBUSB_REQ_CHIP_INFO = 0x40,
 };
 
+// Where AmlLibusb sends its USB traffic. AmlUsbBackendUsbio drives real devices; with AML_USB_SIM
+// set in the environment the first AmlUsbGetBackend() picks the simulated device of AmlUsbSim.h,
+// with AML_USB_CAPTURE set it records the transfers of either (AmlUsbCapture.h).
+// control/bulkRead/bulkWrite return bytes transferred or -errno, everything else is as in usbio.h.
+struct AmlUsbBackend {
+    const char *name;
+    int (*open)(int vid, int pid, usbio_file_t *files, int count);
+    int (*count)(int vid, int pid);
+    int (*openAt)(int vid, int pid, int index, usbio_file_t *file);
+    int (*close)(usbio_file_t file);
+    int (*control)(usbio_file_t file, int requestType, int request, int value, int index,
+        char *bytes, int size, int timeout);
+    int (*bulkRead)(usbio_file_t file, int ep, char *bytes, int size, int timeout);
+    int (*bulkWrite)(usbio_file_t file, int ep, const char *bytes, int size, int timeout);
+    void *(*allocBuffer)(usbio_file_t file, int bytes, bool *dma);
+    void (*freeBuffer)(void *data, int bytes, bool dma);
+    int (*submitUrb)(usbio_file_t file, int pipe, usbio_buffer_t *urb);
+    int (*discardUrb)(usbio_file_t file, usbio_buffer_t *urb);
+    int (*reapUrb)(usbio_file_t file, usbio_buffer_t **urb);
+    int (*hostController)(usbio_file_t file, char *name, int bytes);
+};
+
+extern const AmlUsbBackend AmlUsbBackendUsbio;
+const AmlUsbBackend *AmlUsbGetBackend(void);
+void AmlUsbSetBackend(const AmlUsbBackend *backend); // before the first device is opened
+
 int IOCTL_READ_MEM_Handler(usbDevIoCtrl ctrl);
 int IOCTL_WRITE_MEM_Handler(usbDevIoCtrl ctrl);
 int IOCTL_READ_AUX_REG_Handler (usbDevIoCtrl ctrl);
@@ -68,7 +111,15 @@ int usbDeviceIoControlEx (AmlUsbDrv *drv, unsigned int controlCode, void *in_buf
     unsigned int timeout);
 int usbReadFile (AmlUsbDrv *drv, void *buf, unsigned int len, unsigned int *read);
 int usbWriteFile (AmlUsbDrv *drv, const void *buf, unsigned int len, unsigned int *read);
-int OpenUsbDevice(AmlUsbDrv *drv);
+int usbWriteFileQueued (AmlUsbDrv *drv, const void *buf, unsigned int len, unsigned int chunk,
+    int depth, unsigned int *written, unsigned int *transfers);
+int usbReadFileQueued (AmlUsbDrv *drv, unsigned int len, int depth,
+    int (*sink)(void *that, char *data, unsigned int bytes), void *that, unsigned int *read);
+struct usb_device *AmlNewDeviceHandle(void);
+void AmlReleaseDeviceHandle(struct usb_device *device);
+int AmlOpenDeviceHandles(struct usb_device **devices, int count);
+int AmlCountDevices(void);
+int OpenUsbDevice(AmlUsbDrv *drv, struct usb_device *device);
 int CloseUsbDevice(AmlUsbDrv *drv);
 int ResetDev(AmlUsbDrv *drv);
 int Aml_Libusb_Ctrl_RdWr(void *device, unsigned int offset, char *buf, unsigned int len, unsigned int readOrWrite, unsigned int timeout);
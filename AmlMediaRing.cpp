@@ -0,0 +1,254 @@
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include "AmlMediaRing.h"
+#include "AmlImage.h"
+#include "AmlSha1.h"
+#include "Amldbglog.h"
+#include "UsbRomDrv.h"
+#include "pozix.h"
+
+enum { AML_MEDIA_RING_MAX_CONSUMERS = AML_MAX_DEVICES };
+
+struct AmlMediaRing {
+    AmlImage *image;
+    long long size;
+    int nSlots;
+    AmlMediaChunk *slots;
+    char *buffers;           // nullptr when the image is mapped
+    mutex_t mutex;
+    pthread_cond_t changed;
+    pthread_t reader;
+    unsigned int produced;   // chunks [0..produced) have been read
+    bool finished;           // reader is done (end of file, error or nobody left to read for)
+    int error;
+    bool hash;
+    bool hashed;             // sha1 covers the whole image
+    AmlSha1 sha1Ctx;
+    unsigned char sha1[AML_SHA1_DIGEST_SIZE];
+    int nConsumers;
+    unsigned int released[AML_MEDIA_RING_MAX_CONSUMERS]; // chunks [0..released) are done with
+    bool holding[AML_MEDIA_RING_MAX_CONSUMERS];          // chunk `released` is in use
+    bool attached[AML_MEDIA_RING_MAX_CONSUMERS];
+};
+
+// slot of chunk `produced` may be refilled when every attached consumer released chunk produced - nSlots
+static bool SlotFree (AmlMediaRing *ring, bool *anyAttached) {
+    *anyAttached = false;
+    for (int i = 0; i < ring->nConsumers; i++) {
+        if (ring->attached[i]) {
+            *anyAttached = true;
+            if (ring->produced - ring->released[i] >= (unsigned int)ring->nSlots) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// A ring started part way (resumed transfer) still hashes the whole image: the skipped part first
+static bool HashPrefix (AmlMediaRing *ring, long long start) {
+    if (AmlImageSeek(ring->image, 0) != 0) {
+        return false;
+    }
+    for (long long offset = 0; offset < start;) {
+        int len = (int)min(start - offset, (long long)AML_MEDIA_CHUNK_SIZE);
+        const char *data = nullptr;
+        if (AmlImageRead(ring->image, ring->buffers, len, &data) != len) { // no slot in use yet
+            return false;
+        }
+        AmlSha1Update(&ring->sha1Ctx, data, (unsigned int)len);
+        offset += len;
+    }
+    return true;
+}
+
+static void ReaderThread (void *that) {
+    AmlMediaRing *ring = (AmlMediaRing *)that;
+    long long offset = (long long)ring->produced * AML_MEDIA_CHUNK_SIZE;
+    if (offset > 0 && ring->hash && !HashPrefix(ring, offset)) {
+        aml_printf("[AmlMediaRing]hashing the first 0x%llx bytes failed\n", offset);
+        ring->hash = false;
+    }
+    // end of file is checked before waiting for a slot: the digest must not wait for the slowest consumer
+    while (offset < ring->size) {
+        bool anyAttached = false;
+        mutex_lock(&ring->mutex);
+        while (!SlotFree(ring, &anyAttached) && ring->error == 0) {
+            pthread_cond_wait(&ring->changed, &ring->mutex);
+        }
+        unsigned int index = ring->produced;
+        bool aborted = ring->error != 0;
+        mutex_unlock(&ring->mutex);
+        if (!anyAttached || aborted) {
+            break;
+        }
+        AmlMediaChunk *chunk = &ring->slots[index % ring->nSlots];
+        chunk->len = (unsigned int)min(ring->size - offset, (long long)AML_MEDIA_CHUNK_SIZE);
+        char *buffer = ring->buffers ? ring->buffers + (size_t)(index % ring->nSlots) *
+            AML_MEDIA_CHUNK_SIZE : nullptr;
+        const char *data = nullptr;
+        if (AmlImageRead(ring->image, buffer, (int)chunk->len, &data) != (int)chunk->len) {
+            aml_printf("[AmlMediaRing]read at 0x%llx failed\n", offset);
+            mutex_lock(&ring->mutex);
+            ring->error = errno != 0 ? errno : EIO;
+            mutex_unlock(&ring->mutex);
+            break;
+        }
+        chunk->data = (char *)data;
+        chunk->checksum = checksum_64K(chunk->data, (int)chunk->len);
+        if (ring->hash) {
+            AmlSha1Update(&ring->sha1Ctx, chunk->data, chunk->len);
+        }
+        chunk->index = index;
+        chunk->offset = offset;
+        offset += chunk->len;
+        mutex_lock(&ring->mutex);
+        ring->produced++;
+        pthread_cond_broadcast(&ring->changed);
+        mutex_unlock(&ring->mutex);
+    }
+    mutex_lock(&ring->mutex);
+    if (ring->hash && ring->error == 0 && offset >= ring->size) {
+        AmlSha1Final(&ring->sha1Ctx, ring->sha1);
+        ring->hashed = true;
+    }
+    ring->finished = true;
+    pthread_cond_broadcast(&ring->changed);
+    mutex_unlock(&ring->mutex);
+}
+
+AmlMediaRing *AmlMediaRingOpen (const char *filename, int consumers, int slots, bool hash) {
+    AmlImage *image = AmlImageOpen(filename);
+    if (!image) {
+        return nullptr;
+    }
+    return AmlMediaRingOpenImage(image, consumers, slots, hash);
+}
+
+AmlMediaRing *AmlMediaRingOpenImage (AmlImage *image, int consumers, int slots, bool hash) {
+    if (consumers <= 0 || consumers > AML_MEDIA_RING_MAX_CONSUMERS || slots <= 0) {
+        aml_printf("[AmlMediaRing]consumers=%d slots=%d invalid\n", consumers, slots);
+        AmlImageClose(image);
+        return nullptr;
+    }
+    if (AmlImageSize(image) < 0 || AmlImageOffset(image) % AML_MEDIA_CHUNK_SIZE != 0) {
+        aml_printf("[AmlMediaRing]image size unknown (pipe?) or not at a chunk boundary\n");
+        AmlImageClose(image);
+        return nullptr;
+    }
+    AmlMediaRing *ring = new AmlMediaRing();
+    ring->image = image;
+    ring->size = AmlImageSize(image);
+    ring->nSlots = slots;
+    ring->slots = new AmlMediaChunk[slots]();
+    if (!AmlImageMapped(image)) {
+        ring->buffers = (char *)malloc((size_t)slots * AML_MEDIA_CHUNK_SIZE);
+        if (ring->buffers == nullptr) {
+            aml_printf("[AmlMediaRing]out of memory for %d slots\n", slots);
+            AmlImageClose(image);
+            delete[] ring->slots;
+            delete ring;
+            return nullptr;
+        }
+    }
+    ring->hash = hash;
+    if (hash) {
+        AmlSha1Init(&ring->sha1Ctx);
+    }
+    ring->produced = (unsigned int)(AmlImageOffset(image) / AML_MEDIA_CHUNK_SIZE);
+    ring->nConsumers = consumers;
+    for (int i = 0; i < consumers; i++) {
+        ring->attached[i] = true;
+        ring->released[i] = ring->produced;
+    }
+    mutex_init(&ring->mutex, 0);
+    pthread_cond_init(&ring->changed, nullptr);
+    ring->reader = pthread_start_np(ReaderThread, ring);
+    if (ring->reader == (pthread_t)0) {
+        aml_printf("[AmlMediaRing]failed to start reader thread\n");
+        ring->finished = true;
+        ring->error = ENOMEM;
+    }
+    return ring;
+}
+
+long long AmlMediaRingSize (AmlMediaRing *ring) {
+    return ring->size;
+}
+
+const AmlMediaChunk *AmlMediaRingNext (AmlMediaRing *ring, int consumer) {
+    const AmlMediaChunk *chunk = nullptr;
+    mutex_lock(&ring->mutex);
+    if (ring->holding[consumer]) {
+        ring->holding[consumer] = false;
+        ring->released[consumer]++;
+        pthread_cond_broadcast(&ring->changed);
+    }
+    while (ring->attached[consumer] && ring->released[consumer] >= ring->produced &&
+        !ring->finished && ring->error == 0) {
+        pthread_cond_wait(&ring->changed, &ring->mutex);
+    }
+    if (ring->attached[consumer] && ring->released[consumer] < ring->produced &&
+        ring->error == 0) {
+        ring->holding[consumer] = true;
+        chunk = &ring->slots[ring->released[consumer] % ring->nSlots];
+    }
+    mutex_unlock(&ring->mutex);
+    return chunk;
+}
+
+void AmlMediaRingDetach (AmlMediaRing *ring, int consumer) {
+    mutex_lock(&ring->mutex);
+    ring->attached[consumer] = false;
+    ring->holding[consumer] = false;
+    pthread_cond_broadcast(&ring->changed);
+    mutex_unlock(&ring->mutex);
+}
+
+void AmlMediaRingAbort (AmlMediaRing *ring, int error) {
+    mutex_lock(&ring->mutex);
+    if (ring->error == 0) {
+        ring->error = error;
+    }
+    pthread_cond_broadcast(&ring->changed);
+    mutex_unlock(&ring->mutex);
+}
+
+int AmlMediaRingError (AmlMediaRing *ring) {
+    mutex_lock(&ring->mutex);
+    int error = ring->error;
+    mutex_unlock(&ring->mutex);
+    return error;
+}
+
+bool AmlMediaRingDigest (AmlMediaRing *ring, unsigned char sha1[20]) {
+    mutex_lock(&ring->mutex);
+    while (!ring->finished) {
+        pthread_cond_wait(&ring->changed, &ring->mutex);
+    }
+    bool hashed = ring->hashed;
+    if (hashed) {
+        memcpy(sha1, ring->sha1, AML_SHA1_DIGEST_SIZE);
+    }
+    mutex_unlock(&ring->mutex);
+    return hashed;
+}
+
+void AmlMediaRingClose (AmlMediaRing *ring) {
+    if (ring == nullptr) {
+        return;
+    }
+    for (int i = 0; i < ring->nConsumers; i++) {
+        AmlMediaRingDetach(ring, i);
+    }
+    if (ring->reader != (pthread_t)0) {
+        pthread_join(ring->reader, nullptr);
+    }
+    pthread_cond_destroy(&ring->changed);
+    mutex_destroy(&ring->mutex);
+    AmlImageClose(ring->image);
+    free(ring->buffers);
+    delete[] ring->slots;
+    delete ring;
+}
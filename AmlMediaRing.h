@@ -0,0 +1,39 @@
+#pragma once
+
+// Shared read-ahead ring for WriteMedia transfers. One reader thread reads the image in
+// AML_MEDIA_CHUNK_SIZE pieces and computes checksum_64K() once per chunk. When the image is
+// memory mapped (see AmlImage) chunks point into the mapping and nothing is copied. Every consumer
+// (one per device) walks the same sequence of chunks at its own pace. A slot is refilled only
+// after all attached consumers released it, so the slowest device throttles the reader but
+// faster devices may run up to `slots` chunks ahead of it.
+// With `hash` the reader also feeds every chunk to SHA1 in the same pass, so the digest for the
+// u-boot `verify` command is ready when the last chunk is produced without reading the image again.
+
+enum { AML_MEDIA_CHUNK_SIZE = 0x10000 };
+
+struct AmlMediaChunk {
+    char *data;            // read only
+    unsigned int len;
+    unsigned int checksum; // checksum_64K(data, len)
+    unsigned int index;    // chunk number, used as AmlUsbRomRW::address by AmlWriteMedia
+    long long offset;      // in the image
+};
+
+struct AmlMediaRing;
+
+AmlMediaRing *AmlMediaRingOpen(const char *filename, int consumers, int slots, bool hash = false);
+// Same for an already opened image (e.g. AmlImageOpenSparse), the ring takes ownership of it.
+// Chunks start at the image's current offset (a chunk boundary), e.g. to resume a transfer.
+AmlMediaRing *AmlMediaRingOpenImage(struct AmlImage *image, int consumers, int slots, bool hash = false);
+long long AmlMediaRingSize(AmlMediaRing *ring);
+// Releases the chunk previously returned to `consumer` and waits for the next one.
+// Returns nullptr at the end of the image, on read error or after AmlMediaRingDetach().
+const AmlMediaChunk *AmlMediaRingNext(AmlMediaRing *ring, int consumer);
+// A consumer that stops early (device failed) must detach or the other consumers stall.
+void AmlMediaRingDetach(AmlMediaRing *ring, int consumer);
+// Stops the transfer for every consumer (e.g. the image failed validation), any thread may call it.
+void AmlMediaRingAbort(AmlMediaRing *ring, int error);
+int AmlMediaRingError(AmlMediaRing *ring); // 0 or errno of the failed read / AmlMediaRingAbort
+// Waits for the reader; false unless opened with `hash` and the whole image was read.
+bool AmlMediaRingDigest(AmlMediaRing *ring, unsigned char sha1[20]);
+void AmlMediaRingClose(AmlMediaRing *ring);
@@ -0,0 +1,91 @@
+#include "AmlPoll.h"
+#include "Amldbglog.h"
+#include "pozix.h"
+
+double AmlPollMinIntervalMs = 2;
+
+struct AmlPollStats {
+    unsigned int count;      // completed operations
+    unsigned int failed;
+    unsigned int polls;      // status reads that were answered "busy"
+    double waitMs;           // total time from start of polling to final reply
+    double maxWaitMs;
+    double predictedMs;      // moving average of waitMs per operation
+    double transferMs;
+    unsigned long long transferBytes;
+};
+
+static const char *const names[AML_POLL_KINDS] = { "WriteMedia", "BulkCmd", "ReadStatus" };
+static AmlPollStats stats[AML_POLL_KINDS];
+
+static mutex_t statsMutex;
+
+static_init(aml_poll) {
+    mutex_init(&statsMutex, 0);
+}
+
+void AmlPollBegin (AmlPoller *poller, int kind, double maxIntervalMs) {
+    poller->kind = kind;
+    poller->maxIntervalMs = maxIntervalMs;
+    poller->startMs = time_in_milliseconds();
+    poller->intervalMs = AmlPollMinIntervalMs;
+    poller->polls = 0;
+}
+
+double AmlPollElapsed (AmlPoller *poller) {
+    return time_in_milliseconds() - poller->startMs;
+}
+
+void AmlPollWait (AmlPoller *poller) {
+    mutex_lock(&statsMutex);
+    AmlPollStats *s = &stats[poller->kind];
+    double predicted = s->count >= 2 ? s->predictedMs : 0;
+    mutex_unlock(&statsMutex);
+    double elapsed = AmlPollElapsed(poller);
+    double delay = poller->intervalMs;
+    if (predicted * 0.9 > elapsed) {
+        delay = max(delay, predicted * 0.9 - elapsed); // jump close to the expected completion
+    } else {
+        poller->intervalMs = min(poller->intervalMs * 2, poller->maxIntervalMs);
+    }
+    poller->polls++;
+    millisleep(min(delay, poller->maxIntervalMs));
+}
+
+void AmlPollEnd (AmlPoller *poller, bool completed) {
+    double elapsed = AmlPollElapsed(poller);
+    mutex_lock(&statsMutex);
+    AmlPollStats *s = &stats[poller->kind];
+    s->polls += poller->polls;
+    s->waitMs += elapsed;
+    if (completed) {
+        s->predictedMs = s->count == 0 ? elapsed : s->predictedMs * 0.75 + elapsed * 0.25;
+        s->maxWaitMs = max(s->maxWaitMs, elapsed);
+        s->count++;
+    } else {
+        s->failed++;
+    }
+    mutex_unlock(&statsMutex);
+}
+
+void AmlPollAddTransfer (int kind, double ms, unsigned long long bytes) {
+    mutex_lock(&statsMutex);
+    stats[kind].transferMs += ms;
+    stats[kind].transferBytes += bytes;
+    mutex_unlock(&statsMutex);
+}
+
+void AmlPollReport (void) {
+    mutex_lock(&statsMutex);
+    for (int i = 0; i < AML_POLL_KINDS; i++) {
+        const AmlPollStats *s = &stats[i];
+        if (s->count + s->failed == 0) {
+            continue;
+        }
+        aml_printf("[update]%-10s n=%u failed=%u busy polls=%u wait %.0fms (avg %.1f max %.1f)"
+            " transfer %.0fms %lluKB\n", names[i], s->count, s->failed, s->polls, s->waitMs,
+            s->waitMs / max(1u, s->count + s->failed), s->maxWaitMs, s->transferMs,
+            s->transferBytes >> 10);
+    }
+    mutex_unlock(&statsMutex);
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+// Adaptive status polling for "Continue:NN" style replies. Instead of a fixed sleep between
+// status reads the poller starts at AmlPollMinIntervalMs and doubles the interval up to the
+// caller's cap. Once a kind of operation has completed a few times, the next poll is
+// scheduled shortly before its predicted completion time (moving average of past
+// operations). Per-kind statistics keep time spent waiting for the device apart from time
+// spent transferring data.
+
+enum AmlPollKind {
+    AML_POLL_WRITE_MEDIA, // AmlWriteMedia "Continue:32" -> "OK!!"
+    AML_POLL_BULK_CMD,    // AmlUsbBulkCmd "Continue:34" -> "success"
+    AML_POLL_STATUS,      // AmlUsbReadStatus retries after a tpl command
+    AML_POLL_KINDS
+};
+
+struct AmlPoller {
+    int kind;
+    double maxIntervalMs;
+    double startMs;
+    double intervalMs;
+    int polls;
+};
+
+extern double AmlPollMinIntervalMs;
+
+void AmlPollBegin(AmlPoller *poller, int kind, double maxIntervalMs);
+void AmlPollWait(AmlPoller *poller); // sleeps until the next status read is due
+double AmlPollElapsed(AmlPoller *poller);
+void AmlPollEnd(AmlPoller *poller, bool completed);
+void AmlPollAddTransfer(int kind, double ms, unsigned long long bytes);
+void AmlPollReport(void); // prints statistics of the kinds used so far
@@ -0,0 +1,143 @@
+#include <stdlib.h>
+#include <string.h>
+#include "AmlSha1.h"
+
+#define ROL32(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+static void Sha1Block (unsigned int h[5], const unsigned char *p) {
+    unsigned int w[80];
+    for (int i = 0; i < 16; i++) {
+        w[i] = (unsigned int)p[4 * i] << 24 | (unsigned int)p[4 * i + 1] << 16 |
+            (unsigned int)p[4 * i + 2] << 8 | (unsigned int)p[4 * i + 3];
+    }
+    for (int i = 16; i < 80; i++) {
+        w[i] = ROL32(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+    }
+    unsigned int a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+#define SHA1_ROUND(f, k, i) do { \
+        unsigned int t = ROL32(a, 5) + (f) + e + (k) + w[i]; \
+        e = d; \
+        d = c; \
+        c = ROL32(b, 30); \
+        b = a; \
+        a = t; \
+    } while (0)
+    for (int i = 0; i < 20; i++) {
+        SHA1_ROUND((b & c) | (~b & d), 0x5A827999, i);
+    }
+    for (int i = 20; i < 40; i++) {
+        SHA1_ROUND(b ^ c ^ d, 0x6ED9EBA1, i);
+    }
+    for (int i = 40; i < 60; i++) {
+        SHA1_ROUND((b & c) | (b & d) | (c & d), 0x8F1BBCDC, i);
+    }
+    for (int i = 60; i < 80; i++) {
+        SHA1_ROUND(b ^ c ^ d, 0xCA62C1D6, i);
+    }
+#undef SHA1_ROUND
+    h[0] += a;
+    h[1] += b;
+    h[2] += c;
+    h[3] += d;
+    h[4] += e;
+}
+
+void AmlSha1Init (AmlSha1 *ctx) {
+    ctx->h[0] = 0x67452301;
+    ctx->h[1] = 0xEFCDAB89;
+    ctx->h[2] = 0x98BADCFE;
+    ctx->h[3] = 0x10325476;
+    ctx->h[4] = 0xC3D2E1F0;
+    ctx->bytes = 0;
+    ctx->used = 0;
+}
+
+void AmlSha1Update (AmlSha1 *ctx, const void *data, size_t len) {
+    const unsigned char *p = (const unsigned char *)data;
+    ctx->bytes += len;
+    if (ctx->used > 0) {
+        size_t n = 64 - ctx->used < len ? 64 - ctx->used : len;
+        memcpy(ctx->block + ctx->used, p, n);
+        ctx->used += (unsigned int)n;
+        p += n;
+        len -= n;
+        if (ctx->used < 64) {
+            return;
+        }
+        Sha1Block(ctx->h, ctx->block);
+        ctx->used = 0;
+    }
+    for (; len >= 64; len -= 64, p += 64) {
+        Sha1Block(ctx->h, p);
+    }
+    memcpy(ctx->block, p, len);
+    ctx->used = (unsigned int)len;
+}
+
+void AmlSha1Final (AmlSha1 *ctx, unsigned char digest[AML_SHA1_DIGEST_SIZE]) {
+    unsigned long long bits = ctx->bytes * 8;
+    unsigned char pad[72] = { 0x80 };
+    size_t padLen = ctx->used < 56 ? 56 - ctx->used : 120 - ctx->used;
+    for (int i = 0; i < 8; i++) {
+        pad[padLen + i] = (unsigned char)(bits >> (56 - 8 * i));
+    }
+    AmlSha1Update(ctx, pad, padLen + 8);
+    for (int i = 0; i < 5; i++) {
+        digest[4 * i] = (unsigned char)(ctx->h[i] >> 24);
+        digest[4 * i + 1] = (unsigned char)(ctx->h[i] >> 16);
+        digest[4 * i + 2] = (unsigned char)(ctx->h[i] >> 8);
+        digest[4 * i + 3] = (unsigned char)ctx->h[i];
+    }
+}
+
+char *AmlSha1Hex (const unsigned char digest[AML_SHA1_DIGEST_SIZE],
+    char hex[AML_SHA1_DIGEST_SIZE * 2 + 1]) {
+    static const char digits[] = "0123456789abcdef";
+    for (int i = 0; i < AML_SHA1_DIGEST_SIZE; i++) {
+        hex[2 * i] = digits[digest[i] >> 4];
+        hex[2 * i + 1] = digits[digest[i] & 0xF];
+    }
+    hex[AML_SHA1_DIGEST_SIZE * 2] = 0;
+    return hex;
+}
+
+#ifdef AML_SHA1_SMOKE_TEST // change to #ifndef to run
+
+#include <stdio.h>
+#include "pozix.h"
+
+static_init(aml_sha1_smoke_test) {
+    static const struct {
+        const char *data;
+        const char *sha1;
+    } vectors[] = {
+        { "", "da39a3ee5e6b4b0d3255bfef95601890afd80709" },
+        { "abc", "a9993e364706816aba3e25717850c26c9cd0d89d" },
+        { "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq",
+            "84983e441c3bd26ebaae4aa1f95129e5e54670f1" },
+    };
+    char hex[AML_SHA1_DIGEST_SIZE * 2 + 1];
+    unsigned char digest[AML_SHA1_DIGEST_SIZE];
+    for (size_t i = 0; i < sizeof(vectors) / sizeof(vectors[0]); i++) {
+        AmlSha1 ctx;
+        AmlSha1Init(&ctx);
+        for (const char *p = vectors[i].data; *p; p++) { // byte by byte exercises the block carry
+            AmlSha1Update(&ctx, p, 1);
+        }
+        AmlSha1Final(&ctx, digest);
+        printf("sha1 #%d %s\n", (int)i,
+            strcmp(AmlSha1Hex(digest, hex), vectors[i].sha1) ? "MISMATCH" : "ok");
+    }
+    enum { SIZE = 64 << 20 };
+    unsigned char *data = (unsigned char *)calloc(SIZE, 1);
+    AmlSha1 ctx;
+    double start = time_in_milliseconds();
+    AmlSha1Init(&ctx);
+    AmlSha1Update(&ctx, data, SIZE);
+    AmlSha1Final(&ctx, digest);
+    double ms = time_in_milliseconds() - start;
+    printf("sha1 %.0f MB/s\n", ms > 0 ? (SIZE >> 20) * 1000.0 / ms : 0.0);
+    free(data);
+}
+
+#endif
@@ -0,0 +1,19 @@
+#pragma once
+
+#include <stddef.h>
+
+// SHA-1 (FIPS 180-4) for the u-boot `verify sha1sum <hex>` command.
+
+enum { AML_SHA1_DIGEST_SIZE = 20 };
+
+struct AmlSha1 {
+    unsigned int h[5];
+    unsigned long long bytes;
+    unsigned char block[64];
+    unsigned int used; // bytes in block
+};
+
+void AmlSha1Init(AmlSha1 *ctx);
+void AmlSha1Update(AmlSha1 *ctx, const void *data, size_t len);
+void AmlSha1Final(AmlSha1 *ctx, unsigned char digest[AML_SHA1_DIGEST_SIZE]);
+char *AmlSha1Hex(const unsigned char digest[AML_SHA1_DIGEST_SIZE], char hex[AML_SHA1_DIGEST_SIZE * 2 + 1]);
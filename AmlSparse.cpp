@@ -0,0 +1,503 @@
+#include <stdlib.h>
+#include <string.h>
+#include "AmlSparse.h"
+#include "AmlImage.h"
+#include "AmlCrc32.h"
+#include "AmlThreadPool.h"
+#include "Amldbglog.h"
+#include "AmlTime.h"
+#include "defs.h"
+#include "pozix.h"
+
+// consecutive blocks of the same kind, one sparse chunk each
+struct AmlSparseRun {
+    unsigned short type;
+    unsigned int blocks;
+    unsigned int fill;  // FILL value
+    long long offset;   // RAW: position in the raw image
+};
+
+struct AmlSparseEncoder {
+    AmlImage *raw;
+    long long rawSize;
+    long long encodedSize;
+    AmlSparseRun *runs;
+    unsigned int nRuns;
+    unsigned int capacity;
+    unsigned int totalBlocks;
+    // read position
+    long long position;    // in the encoded stream
+    unsigned int run;      // current run once the file header is out
+    long long runStart;    // encoded position of the current run's chunk header
+};
+
+// raw image is scanned in slices of this many blocks
+static int ScanBlocks = 256;
+// RAW chunks are split after this many blocks (256MB): their total_sz header field is 32-bit
+static unsigned int MaxRawBlocks = 0x10000;
+
+enum { AML_SPARSE_READ_SLICE = 1 << 20 }; // buffered reads of RAW chunk data
+
+static long long RunSize (const AmlSparseRun *run) {
+    switch (run->type) {
+    case AML_SPARSE_CHUNK_RAW: return AML_SPARSE_CHUNK_HEADER_SIZE + (long long)run->blocks * AML_SPARSE_BLOCK_SIZE;
+    case AML_SPARSE_CHUNK_FILL: return AML_SPARSE_CHUNK_HEADER_SIZE + 4;
+    default: return AML_SPARSE_CHUNK_HEADER_SIZE;
+    }
+}
+
+static bool AddBlock (AmlSparseEncoder *encoder, unsigned short type, unsigned int fill,
+    long long offset) {
+    AmlSparseRun *last = encoder->nRuns > 0 ? &encoder->runs[encoder->nRuns - 1] : nullptr;
+    if (last && last->type == type && (type != AML_SPARSE_CHUNK_FILL || last->fill == fill) &&
+        (type != AML_SPARSE_CHUNK_RAW || last->blocks < MaxRawBlocks)) {
+        last->blocks++;
+        return true;
+    }
+    if (encoder->nRuns == encoder->capacity) {
+        unsigned int capacity = max(256u, encoder->capacity * 2);
+        AmlSparseRun *runs = (AmlSparseRun *)realloc(encoder->runs, capacity * sizeof(AmlSparseRun));
+        if (runs == nullptr) {
+            return false;
+        }
+        encoder->runs = runs;
+        encoder->capacity = capacity;
+    }
+    AmlSparseRun *run = &encoder->runs[encoder->nRuns++];
+    run->type = type;
+    run->blocks = 1;
+    run->fill = fill;
+    run->offset = offset;
+    return true;
+}
+
+// the last block of an image that is not a multiple of the block size is zero padded
+static unsigned short ClassifyBlock (const char *block, int len, bool skipZero, unsigned int *fill) {
+    const unsigned char *p = (const unsigned char *)block;
+    if (len < AML_SPARSE_BLOCK_SIZE) {
+        for (int i = 0; i < len; i++) {
+            if (p[i] != 0) {
+                return AML_SPARSE_CHUNK_RAW;
+            }
+        }
+        *fill = 0;
+        return skipZero ? AML_SPARSE_CHUNK_DONT_CARE : AML_SPARSE_CHUNK_FILL;
+    }
+    unsigned int first;
+    memcpy(&first, p, 4);
+    for (int i = 4; i < AML_SPARSE_BLOCK_SIZE; i += 4) {
+        unsigned int word;
+        memcpy(&word, p + i, 4);
+        if (word != first) {
+            return AML_SPARSE_CHUNK_RAW;
+        }
+    }
+    *fill = le32toh(first);
+    return first == 0 && skipZero ? AML_SPARSE_CHUNK_DONT_CARE : AML_SPARSE_CHUNK_FILL;
+}
+
+AmlSparseEncoder *AmlSparseEncoderOpen (AmlImage *raw, bool skipZero, AmlSparseStats *stats) {
+    if (AmlImageSize(raw) < 0) {
+        aml_printf("[AmlSparse]raw image size unknown\n");
+        AmlImageClose(raw);
+        return nullptr;
+    }
+    AmlSparseEncoder *encoder = new AmlSparseEncoder();
+    encoder->raw = raw;
+    encoder->rawSize = AmlImageSize(raw);
+    int sliceLen = ScanBlocks * AML_SPARSE_BLOCK_SIZE;
+    char *buffer = AmlImageMapped(raw) ? nullptr : (char *)malloc(sliceLen);
+    long long offset = 0;
+    bool ok = true;
+    while (ok && offset < encoder->rawSize) {
+        const char *data = nullptr;
+        int n = AmlImageRead(raw, buffer, (int)min((long long)sliceLen, encoder->rawSize - offset), &data);
+        if (n <= 0) {
+            aml_printf("[AmlSparse]read at 0x%llx failed\n", offset);
+            ok = false;
+            break;
+        }
+        for (int i = 0; i < n && ok; i += AML_SPARSE_BLOCK_SIZE) {
+            unsigned int fill = 0;
+            unsigned short type = ClassifyBlock(data + i, min(n - i, (int)AML_SPARSE_BLOCK_SIZE),
+                skipZero, &fill);
+            ok = AddBlock(encoder, type, fill, offset + i);
+        }
+        offset += n;
+    }
+    free(buffer);
+    if (!ok || AmlImageSeek(raw, 0) != 0) {
+        aml_printf("[AmlSparse]scan failed\n");
+        AmlSparseEncoderClose(encoder);
+        return nullptr;
+    }
+    encoder->totalBlocks = (unsigned int)((encoder->rawSize + AML_SPARSE_BLOCK_SIZE - 1) / AML_SPARSE_BLOCK_SIZE);
+    encoder->encodedSize = AML_SPARSE_HEADER_SIZE;
+    AmlSparseStats s = {};
+    for (unsigned int i = 0; i < encoder->nRuns; i++) {
+        const AmlSparseRun *run = &encoder->runs[i];
+        encoder->encodedSize += RunSize(run);
+        if (run->type == AML_SPARSE_CHUNK_RAW) {
+            s.rawBlocks += run->blocks;
+        } else if (run->type == AML_SPARSE_CHUNK_FILL) {
+            s.fillBlocks += run->blocks;
+        } else {
+            s.dontCareBlocks += run->blocks;
+        }
+    }
+    s.rawSize = encoder->rawSize;
+    s.encodedSize = encoder->encodedSize;
+    s.chunks = encoder->nRuns;
+    if (stats) {
+        *stats = s;
+    }
+    AmlSparseEncoderRewind(encoder);
+    return encoder;
+}
+
+long long AmlSparseEncodedSize (AmlSparseEncoder *encoder) {
+    return encoder->encodedSize;
+}
+
+int AmlSparseEncoderRewind (AmlSparseEncoder *encoder) {
+    encoder->position = 0;
+    encoder->run = 0;
+    encoder->runStart = AML_SPARSE_HEADER_SIZE;
+    return AmlImageSeek(encoder->raw, 0);
+}
+
+// bytes [from, from + len) of the RAW payload of `run`, zero padded after the end of the image
+static int ReadRaw (AmlSparseEncoder *encoder, const AmlSparseRun *run, long long from,
+    char *buffer, int len) {
+    long long offset = run->offset + from;
+    int avail = (int)max(0ll, min((long long)len, encoder->rawSize - offset));
+    if (avail > 0) {
+        if (AmlImageOffset(encoder->raw) != offset && AmlImageSeek(encoder->raw, offset) != 0) {
+            return -1;
+        }
+        const char *data = nullptr;
+        if (AmlImageRead(encoder->raw, buffer, avail, &data) != avail) {
+            return -1;
+        }
+        if (data != buffer) {
+            memcpy(buffer, data, avail);
+        }
+    }
+    memset(buffer + avail, 0, len - avail);
+    return len;
+}
+
+int AmlSparseEncoderRead (AmlSparseEncoder *encoder, char *buffer, int len) {
+    int done = 0;
+    while (done < len && encoder->position < encoder->encodedSize) {
+        char header[AML_SPARSE_HEADER_SIZE];
+        int n = 0;
+        if (encoder->position < AML_SPARSE_HEADER_SIZE) {
+            SET_INT_AT(header, 0, 0xED26FF3A);
+            SET_SHORT_AT(header, 4, 1);  // major version
+            SET_SHORT_AT(header, 6, 0);  // minor version
+            SET_SHORT_AT(header, 8, AML_SPARSE_HEADER_SIZE);
+            SET_SHORT_AT(header, 10, AML_SPARSE_CHUNK_HEADER_SIZE);
+            SET_INT_AT(header, 12, AML_SPARSE_BLOCK_SIZE);
+            SET_INT_AT(header, 16, encoder->totalBlocks);
+            SET_INT_AT(header, 20, encoder->nRuns);
+            SET_INT_AT(header, 24, 0);   // image checksum, not used
+            n = (int)min((long long)(len - done), AML_SPARSE_HEADER_SIZE - encoder->position);
+            memcpy(buffer + done, header + encoder->position, n);
+        } else {
+            const AmlSparseRun *run = &encoder->runs[encoder->run];
+            long long inRun = encoder->position - encoder->runStart;
+            if (inRun < AML_SPARSE_CHUNK_HEADER_SIZE + (run->type == AML_SPARSE_CHUNK_FILL ? 4 : 0)) {
+                SET_SHORT_AT(header, 0, run->type);
+                SET_SHORT_AT(header, 2, 0);
+                SET_INT_AT(header, 4, run->blocks);
+                SET_INT_AT(header, 8, (unsigned int)RunSize(run));
+                SET_INT_AT(header, 12, run->fill);
+                n = (int)min((long long)(len - done),
+                    AML_SPARSE_CHUNK_HEADER_SIZE + (run->type == AML_SPARSE_CHUNK_FILL ? 4 : 0) - inRun);
+                memcpy(buffer + done, header + inRun, n);
+            } else {
+                long long from = inRun - AML_SPARSE_CHUNK_HEADER_SIZE;
+                n = (int)min((long long)(len - done), RunSize(run) - inRun);
+                if (ReadRaw(encoder, run, from, buffer + done, n) != n) {
+                    aml_printf("[AmlSparse]read at 0x%llx failed\n", run->offset + from);
+                    return -1;
+                }
+            }
+        }
+        done += n;
+        encoder->position += n;
+        if (encoder->position >= AML_SPARSE_HEADER_SIZE && encoder->run < encoder->nRuns &&
+            encoder->position == encoder->runStart + RunSize(&encoder->runs[encoder->run])) {
+            encoder->runStart = encoder->position;
+            encoder->run++;
+        }
+    }
+    return done;
+}
+
+void AmlSparseEncoderClose (AmlSparseEncoder *encoder) {
+    if (encoder == nullptr) {
+        return;
+    }
+    AmlImageClose(encoder->raw);
+    free(encoder->runs);
+    delete encoder;
+}
+
+// expanded image is checksummed in pieces of at most PieceSize bytes, one core each
+static long long PieceSize = 4ll << 20;
+
+struct AmlSparsePiece {
+    unsigned short type;
+    unsigned int fill;
+    long long offset;       // RAW: position in the sparse file
+    long long len;          // expanded bytes
+    unsigned int crc;
+};
+
+struct AmlSparseCrcMark {
+    unsigned int pieces;    // expanded data before the CRC32 chunk
+    unsigned int expected;
+    unsigned int chunk;
+};
+
+struct AmlSparseCheck {
+    AmlImage *image;
+    AmlSparsePiece *pieces;
+    unsigned int nPieces;
+    unsigned int capacity;
+    AmlSparseCrcMark *marks;
+    unsigned int nMarks;
+    char *buffer;           // buffered image: one thread, one buffer
+    void (*failed)(void *that);
+    void *that;
+    pthread_t thread;
+    int result;
+};
+
+static bool AddPiece (AmlSparseCheck *check, unsigned short type, unsigned int fill,
+    long long offset, long long len) {
+    if (check->nPieces == check->capacity) {
+        unsigned int capacity = max(256u, check->capacity * 2);
+        AmlSparsePiece *pieces = (AmlSparsePiece *)realloc(check->pieces, capacity * sizeof(AmlSparsePiece));
+        if (pieces == nullptr) {
+            return false;
+        }
+        check->pieces = pieces;
+        check->capacity = capacity;
+    }
+    AmlSparsePiece *piece = &check->pieces[check->nPieces++];
+    piece->type = type;
+    piece->fill = fill;
+    piece->offset = offset;
+    piece->len = len;
+    piece->crc = 0;
+    return true;
+}
+
+// reads `len` header bytes at the current position into `to`
+static bool ReadHeader (AmlImage *image, char *to, int len) {
+    const char *data = nullptr;
+    if (AmlImageRead(image, to, len, &data) != len) {
+        return false;
+    }
+    if (data != to) {
+        memcpy(to, data, len);
+    }
+    return true;
+}
+
+// chunk headers only, data is skipped; false with a message if anything does not add up
+static bool ParseSparse (AmlSparseCheck *check, AmlSparseInfo *info) {
+    AmlImage *image = check->image;
+    char header[AML_SPARSE_HEADER_SIZE];
+    info->fileSize = AmlImageSize(image);
+    if (info->fileSize < AML_SPARSE_HEADER_SIZE || !ReadHeader(image, header, AML_SPARSE_HEADER_SIZE) ||
+        (unsigned int)INT_AT(header, 0) != 0xED26FF3A || (SHORT_AT(header, 4) & 0xFFFF) != 1) {
+        aml_printf("[AmlSparse]bad sparse header\n");
+        return false;
+    }
+    unsigned int fileHeaderSize = SHORT_AT(header, 8) & 0xFFFF;
+    unsigned int chunkHeaderSize = SHORT_AT(header, 10) & 0xFFFF;
+    unsigned int blockSize = INT_AT(header, 12);
+    unsigned int totalBlocks = INT_AT(header, 16);
+    unsigned int totalChunks = INT_AT(header, 20);
+    if (fileHeaderSize < AML_SPARSE_HEADER_SIZE || chunkHeaderSize < AML_SPARSE_CHUNK_HEADER_SIZE ||
+        blockSize == 0 || blockSize % 4 != 0 || AmlImageSeek(image, fileHeaderSize) != 0) {
+        aml_printf("[AmlSparse]bad sparse header sizes %u/%u block %u\n", fileHeaderSize,
+            chunkHeaderSize, blockSize);
+        return false;
+    }
+    info->blockSize = blockSize;
+    info->expandedSize = (long long)totalBlocks * blockSize;
+    info->chunks = totalChunks;
+    long long blocks = 0;
+    for (unsigned int i = 0; i < totalChunks; i++) {
+        char chunk[AML_SPARSE_CHUNK_HEADER_SIZE + 4];
+        long long at = AmlImageOffset(image);
+        if (!ReadHeader(image, chunk, AML_SPARSE_CHUNK_HEADER_SIZE) ||
+            (chunkHeaderSize > AML_SPARSE_CHUNK_HEADER_SIZE && AmlImageSeek(image, at + chunkHeaderSize) != 0)) {
+            aml_printf("[AmlSparse]chunk %u: header at 0x%llx truncated\n", i, at);
+            return false;
+        }
+        unsigned short type = (unsigned short)SHORT_AT(chunk, 0);
+        unsigned int chunkBlocks = INT_AT(chunk, 4);
+        unsigned int totalSize = INT_AT(chunk, 8);
+        long long expanded = (long long)chunkBlocks * blockSize;
+        long long data = (long long)totalSize - chunkHeaderSize;
+        long long expect = type == AML_SPARSE_CHUNK_RAW ? expanded
+            : type == AML_SPARSE_CHUNK_FILL || type == AML_SPARSE_CHUNK_CRC32 ? 4
+            : type == AML_SPARSE_CHUNK_DONT_CARE ? 0 : -1;
+        if (expect < 0 || data != expect || at + totalSize > info->fileSize) {
+            aml_printf("[AmlSparse]chunk %u at 0x%llx: type 0x%04x blocks %u size %u invalid\n", i,
+                at, type, chunkBlocks, totalSize);
+            return false;
+        }
+        bool ok = true;
+        unsigned int value = 0;
+        if (data == 4) {
+            ok = ReadHeader(image, chunk + AML_SPARSE_CHUNK_HEADER_SIZE, 4);
+            value = INT_AT(chunk, AML_SPARSE_CHUNK_HEADER_SIZE);
+        }
+        if (type == AML_SPARSE_CHUNK_RAW) {
+            info->rawChunks++;
+            for (long long done = 0; ok && done < expanded; done += PieceSize) {
+                ok = AddPiece(check, type, 0, at + chunkHeaderSize + done, min(PieceSize, expanded - done));
+            }
+            ok = ok && AmlImageSeek(image, at + totalSize) == 0;
+        } else if (type == AML_SPARSE_CHUNK_FILL || type == AML_SPARSE_CHUNK_DONT_CARE) {
+            if (type == AML_SPARSE_CHUNK_FILL) {
+                info->fillChunks++;
+            } else {
+                info->dontCareChunks++;
+            }
+            ok = ok && (expanded == 0 || AddPiece(check, type, value, 0, expanded));
+        } else {
+            info->crcChunks++;
+            AmlSparseCrcMark *marks = (AmlSparseCrcMark *)realloc(check->marks,
+                (check->nMarks + 1) * sizeof(AmlSparseCrcMark));
+            ok = ok && marks != nullptr;
+            if (marks != nullptr) {
+                check->marks = marks;
+                check->marks[check->nMarks].pieces = check->nPieces;
+                check->marks[check->nMarks].expected = value;
+                check->marks[check->nMarks].chunk = i;
+                check->nMarks++;
+            }
+        }
+        if (!ok) {
+            aml_printf("[AmlSparse]chunk %u at 0x%llx: read failed\n", i, at);
+            return false;
+        }
+        blocks += type == AML_SPARSE_CHUNK_CRC32 ? 0 : chunkBlocks;
+    }
+    if (blocks != totalBlocks || AmlImageOffset(image) != info->fileSize) {
+        aml_printf("[AmlSparse]chunks cover %lld of %u blocks, %lld trailing bytes\n", blocks,
+            totalBlocks, info->fileSize - AmlImageOffset(image));
+        return false;
+    }
+    return true;
+}
+
+static void PieceCrc (void *that, int index) {
+    AmlSparseCheck *check = (AmlSparseCheck *)that;
+    AmlSparsePiece *piece = &check->pieces[index];
+    if (piece->type != AML_SPARSE_CHUNK_RAW) {
+        unsigned int pattern = htole32(piece->type == AML_SPARSE_CHUNK_FILL ? piece->fill : 0);
+        piece->crc = AmlCrc32Repeat(&pattern, 4, piece->len / 4);
+        return;
+    }
+    unsigned int crc = 0;
+    for (long long done = 0; done < piece->len;) {
+        const char *data = nullptr;
+        int n = AmlImageReadAt(check->image, piece->offset + done, check->buffer,
+            (int)min(piece->len - done, (long long)AML_SPARSE_READ_SLICE), &data);
+        if (n <= 0) {
+            aml_printf("[AmlSparse]read at 0x%llx failed\n", piece->offset + done);
+            check->result = -1;
+            return;
+        }
+        crc = AmlCrc32(crc, data, n);
+        done += n;
+    }
+    piece->crc = crc;
+}
+
+static void CheckThread (void *that) {
+    AmlSparseCheck *check = (AmlSparseCheck *)that;
+    time_t start = timeGetTime();
+    int threads = AmlImageMapped(check->image) ? max(1, get_number_of_hardware_cores()) : 1;
+    AmlParallelFor((int)check->nPieces, threads, PieceCrc, check);
+    unsigned int crc = 0;
+    unsigned int mark = 0;
+    for (unsigned int i = 0; check->result == 0 && i <= check->nPieces; i++) {
+        for (; mark < check->nMarks && check->marks[mark].pieces == i; mark++) {
+            if (check->marks[mark].expected != crc) {
+                aml_printf("[AmlSparse]chunk %u: CRC32 0x%08x expected 0x%08x\n",
+                    check->marks[mark].chunk, crc, check->marks[mark].expected);
+                check->result = -1;
+                break;
+            }
+        }
+        if (i < check->nPieces) {
+            crc = AmlCrc32Combine(crc, check->pieces[i].crc, check->pieces[i].len);
+        }
+    }
+    aml_printf("[AmlSparse]%u CRC32 chunks %s in %dms (%d threads)\n", check->nMarks,
+        check->result == 0 ? "verified" : "FAILED", (int)(timeGetTime() - start), threads);
+    if (check->result != 0 && check->failed) {
+        check->failed(check->that);
+    }
+}
+
+static void FreeCheck (AmlSparseCheck *check) {
+    AmlImageClose(check->image);
+    free(check->pieces);
+    free(check->marks);
+    free(check->buffer);
+    delete check;
+}
+
+AmlSparseCheck *AmlSparseCheckStart (const char *filename, AmlSparseInfo *info,
+    void (*failed)(void *that), void *that) {
+    AmlImage *image = AmlImageOpen(filename);
+    if (!image) {
+        return nullptr;
+    }
+    AmlSparseCheck *check = new AmlSparseCheck();
+    check->image = image;
+    check->failed = failed;
+    check->that = that;
+    AmlSparseInfo parsed = {};
+    if (AmlImageSize(image) < 0 || !ParseSparse(check, &parsed)) {
+        FreeCheck(check);
+        return nullptr;
+    }
+    if (info) {
+        *info = parsed;
+    }
+    if (check->nMarks == 0) {
+        return check; // nothing to verify
+    }
+    if (!AmlImageMapped(image)) {
+        check->buffer = (char *)malloc(AML_SPARSE_READ_SLICE);
+    }
+    check->thread = pthread_start_np(CheckThread, check);
+    if (check->thread == (pthread_t)0) {
+        CheckThread(check); // no thread to spare: verify before the transfer starts
+    }
+    return check;
+}
+
+int AmlSparseCheckFinish (AmlSparseCheck *check) {
+    if (check == nullptr) {
+        return 0;
+    }
+    if (check->thread != (pthread_t)0) {
+        pthread_join(check->thread, nullptr);
+    }
+    int result = check->result;
+    FreeCheck(check);
+    return result;
+}
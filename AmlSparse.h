@@ -0,0 +1,63 @@
+#pragma once
+
+// Android sparse image (simg) encoder. A raw partition image is scanned once in
+// AML_SPARSE_BLOCK_SIZE blocks: blocks repeating one 32-bit value (all-zero blocks included)
+// become FILL chunks and the rest RAW chunks, so the partition ends up identical to the image.
+// With skipZero all-zero blocks become DONT_CARE chunks instead: the device does not write them
+// and they keep whatever the partition held before, only right when that does not matter.
+// The encoded stream is then produced on the fly while it is downloaded, so no converted
+// copy of the image is ever written to disk.
+// AmlSparseCheck goes the other way for images that already are sparse: it walks the chunk
+// headers up front and verifies CRC32 chunks on all cores while the image is being sent.
+
+struct AmlImage;
+
+enum {
+    AML_SPARSE_BLOCK_SIZE  = 4096,
+    AML_SPARSE_HEADER_SIZE = 28,
+    AML_SPARSE_CHUNK_HEADER_SIZE = 12,
+    AML_SPARSE_CHUNK_RAW       = 0xCAC1,
+    AML_SPARSE_CHUNK_FILL      = 0xCAC2,
+    AML_SPARSE_CHUNK_DONT_CARE = 0xCAC3,
+    AML_SPARSE_CHUNK_CRC32     = 0xCAC4,
+};
+
+struct AmlSparseStats {
+    long long rawSize;
+    long long encodedSize;
+    unsigned int chunks;
+    unsigned int rawBlocks;
+    unsigned int fillBlocks;
+    unsigned int dontCareBlocks;
+};
+
+struct AmlSparseEncoder;
+
+// Takes ownership of `raw`, which must have a known size (it is read twice). nullptr on error.
+AmlSparseEncoder *AmlSparseEncoderOpen(AmlImage *raw, bool skipZero, AmlSparseStats *stats);
+long long AmlSparseEncodedSize(AmlSparseEncoder *encoder);
+// Next bytes of the encoded image. Returns bytes written to buffer, 0 at end, -1 on read error.
+int AmlSparseEncoderRead(AmlSparseEncoder *encoder, char *buffer, int len);
+int AmlSparseEncoderRewind(AmlSparseEncoder *encoder);
+void AmlSparseEncoderClose(AmlSparseEncoder *encoder);
+
+struct AmlSparseInfo {
+    long long fileSize;
+    long long expandedSize;  // total_blks * blk_sz
+    unsigned int blockSize;
+    unsigned int chunks;
+    unsigned int rawChunks;
+    unsigned int fillChunks;
+    unsigned int dontCareChunks;
+    unsigned int crcChunks;
+};
+
+struct AmlSparseCheck;
+
+// Parses every chunk header of a sparse image (chunk data is not read), nullptr if the image is
+// malformed. Then CRC32 chunks are validated on a background thread; when one does not match
+// failed(that) is called from that thread, e.g. to abort the transfer.
+AmlSparseCheck *AmlSparseCheckStart(const char *filename, AmlSparseInfo *info,
+    void (*failed)(void *that), void *that);
+// Waits for the validation and frees the check. 0 if all CRC32 chunks matched (or there were none).
+int AmlSparseCheckFinish(AmlSparseCheck *check);
@@ -0,0 +1,49 @@
+#include "AmlThreadPool.h"
+#include "pozix.h"
+
+enum { AML_THREAD_POOL_MAX = 64 };
+
+struct AmlParallelForContext {
+    volatile int32_t next;
+    int count;
+    void (*proc)(void *that, int index);
+    void *that;
+};
+
+static void ParallelForWorker (void *p) {
+    AmlParallelForContext *ctx = (AmlParallelForContext *)p;
+    for (;;) {
+        int index = atomics_increment_int32(&ctx->next) - 1;
+        if (index >= ctx->count) {
+            break;
+        }
+        ctx->proc(ctx->that, index);
+    }
+}
+
+void AmlParallelFor (int count, int threads, void (*proc)(void *that, int index), void *that) {
+    AmlParallelForContext ctx = {};
+    ctx.next = 0;
+    ctx.count = count;
+    ctx.proc = proc;
+    ctx.that = that;
+    threads = min(min(threads, count), (int)AML_THREAD_POOL_MAX);
+    if (threads <= 1) {
+        ParallelForWorker(&ctx);
+        return;
+    }
+    pthread_t workers[AML_THREAD_POOL_MAX] = {};
+    int started = 0;
+    for (int i = 0; i < threads; i++) {
+        pthread_t t = pthread_start_np(ParallelForWorker, &ctx);
+        if (t != (pthread_t)0) {
+            workers[started++] = t;
+        }
+    }
+    if (started == 0) {
+        ParallelForWorker(&ctx); // out of threads: the caller does all the work
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(workers[i], nullptr);
+    }
+}
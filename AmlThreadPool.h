@@ -0,0 +1,6 @@
+#pragma once
+
+// Calls proc(that, index) for every index in [0..count) from up to `threads` worker threads
+// (pozix pthread_start_np). Indices are handed out in increasing order as workers become free.
+// Returns when all calls have returned.
+void AmlParallelFor(int count, int threads, void (*proc)(void *that, int index), void *that);
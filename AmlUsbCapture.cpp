@@ -0,0 +1,218 @@
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include "AmlUsbCapture.h"
+#include "AmlLibusb.h"
+#include "Amldbglog.h"
+#include "pozix.h"
+
+enum {
+    CAPTURE_URBS = 256,       // URBs submitted and not yet reaped, all devices
+    CAPTURE_ENDPOINT_IN = 0x80,
+};
+
+struct CaptureUrb {
+    usbio_buffer_t *urb; // nullptr: free
+    int pipe;
+    int length;
+};
+
+static const AmlUsbBackend *Inner;
+static FILE *CaptureFile;
+static uint64_t CaptureStart;
+static mutex_t CaptureMutex; // one file for the records of all threads
+static CaptureUrb Urbs[CAPTURE_URBS]; // URBs carry no endpoint on every platform, their submit does
+
+uint32_t AmlUsbCaptureHash (const void *data, int bytes) {
+    uint32_t h = 2166136261u;
+    for (int i = 0; i < bytes; i++) {
+        h = (h ^ ((const uint8_t *)data)[i]) * 16777619u;
+    }
+    return h;
+}
+
+static void Append (AmlUsbCaptureRecord *rec, uint64_t start, const void *payload) {
+    uint64_t now = time_in_nanoseconds();
+    rec->ns = start - CaptureStart;
+    rec->us = (uint32_t)((now - start) / 1000);
+    mutex_lock(&CaptureMutex);
+    fwrite(rec, sizeof(*rec), 1, CaptureFile);
+    if (rec->payload > 0) {
+        fwrite(payload, rec->payload, 1, CaptureFile);
+    }
+    mutex_unlock(&CaptureMutex);
+}
+
+// r is bytes transferred or -errno
+static void Result (AmlUsbCaptureRecord *rec, int op, usbio_file_t file, int ep, int length, int r) {
+    rec->op = (uint8_t)op;
+    rec->file = (uint16_t)file;
+    rec->ep = (uint8_t)ep;
+    rec->length = length;
+    rec->bytes = max(r, 0);
+    rec->error = (uint16_t)(r < 0 ? -r : 0);
+}
+
+static CaptureUrb *FindUrb (usbio_buffer_t *urb) {
+    for (int i = 0; i < CAPTURE_URBS; i++) {
+        if (Urbs[i].urb == urb) {
+            return &Urbs[i];
+        }
+    }
+    return nullptr;
+}
+
+static int Open (int vid, int pid, usbio_file_t *files, int count) {
+    return Inner->open(vid, pid, files, count);
+}
+
+static int Count (int vid, int pid) {
+    return Inner->count(vid, pid);
+}
+
+static int OpenAt (int vid, int pid, int index, usbio_file_t *file) {
+    return Inner->openAt(vid, pid, index, file);
+}
+
+static int Close (usbio_file_t file) {
+    return Inner->close(file);
+}
+
+static int Control (usbio_file_t file, int requestType, int request, int value, int index, char *bytes,
+    int size, int timeout) {
+    uint64_t start = time_in_nanoseconds();
+    int r = Inner->control(file, requestType, request, value, index, bytes, size, timeout);
+    bool in = (requestType & CAPTURE_ENDPOINT_IN) != 0;
+    AmlUsbCaptureRecord rec = {};
+    Result(&rec, AML_USB_CAPTURE_CONTROL, file, 0, size, r);
+    rec.requestType = (uint8_t)requestType;
+    rec.request = (uint8_t)request;
+    rec.value = (uint16_t)value;
+    rec.index = (uint16_t)index;
+    rec.setupLength = (uint16_t)size;
+    int hashed = bytes == nullptr ? 0 : in ? rec.bytes : size;
+    rec.hash = hashed > 0 ? AmlUsbCaptureHash(bytes, hashed) : 0;
+    rec.payload = (uint16_t)(in || bytes == nullptr ? 0 : min(size, (int)AML_USB_CAPTURE_PAYLOAD));
+    Append(&rec, start, bytes);
+    return r;
+}
+
+static int BulkRead (usbio_file_t file, int ep, char *bytes, int size, int timeout) {
+    uint64_t start = time_in_nanoseconds();
+    int r = Inner->bulkRead(file, ep, bytes, size, timeout);
+    AmlUsbCaptureRecord rec = {};
+    Result(&rec, AML_USB_CAPTURE_BULK, file, ep | CAPTURE_ENDPOINT_IN, size, r);
+    rec.hash = rec.bytes > 0 ? AmlUsbCaptureHash(bytes, rec.bytes) : 0;
+    Append(&rec, start, nullptr);
+    return r;
+}
+
+static int BulkWrite (usbio_file_t file, int ep, const char *bytes, int size, int timeout) {
+    uint64_t start = time_in_nanoseconds();
+    int r = Inner->bulkWrite(file, ep, bytes, size, timeout);
+    AmlUsbCaptureRecord rec = {};
+    Result(&rec, AML_USB_CAPTURE_BULK, file, ep & ~CAPTURE_ENDPOINT_IN, size, r);
+    rec.hash = size > 0 ? AmlUsbCaptureHash(bytes, size) : 0;
+    Append(&rec, start, nullptr);
+    return r;
+}
+
+static void *AllocBuffer (usbio_file_t file, int bytes, bool *dma) {
+    return Inner->allocBuffer(file, bytes, dma);
+}
+
+static void FreeBuffer (void *data, int bytes, bool dma) {
+    Inner->freeBuffer(data, bytes, dma);
+}
+
+static int SubmitUrb (usbio_file_t file, int pipe, usbio_buffer_t *urb) {
+    bool out = (pipe & CAPTURE_ENDPOINT_IN) == 0;
+    int length = urb->bytes;
+    uint32_t hash = out && length > 0 ? AmlUsbCaptureHash(urb->data, length) : 0; // before it is on the wire
+    uint64_t start = time_in_nanoseconds();
+    int e = Inner->submitUrb(file, pipe, urb);
+    AmlUsbCaptureRecord rec = {};
+    Result(&rec, AML_USB_CAPTURE_SUBMIT, file, pipe, length, e ? -e : 0);
+    rec.hash = hash;
+    if (e == 0) {
+        mutex_lock(&CaptureMutex);
+        CaptureUrb *u = FindUrb(nullptr);
+        if (u != nullptr) {
+            u->urb = urb;
+            u->pipe = pipe;
+            u->length = length;
+        }
+        mutex_unlock(&CaptureMutex);
+    }
+    Append(&rec, start, nullptr);
+    return e;
+}
+
+static int DiscardUrb (usbio_file_t file, usbio_buffer_t *urb) {
+    uint64_t start = time_in_nanoseconds();
+    int e = Inner->discardUrb(file, urb);
+    AmlUsbCaptureRecord rec = {};
+    mutex_lock(&CaptureMutex);
+    CaptureUrb *u = FindUrb(urb);
+    Result(&rec, AML_USB_CAPTURE_DISCARD, file, u ? u->pipe : 0, u ? u->length : 0, e ? -e : 0);
+    mutex_unlock(&CaptureMutex);
+    Append(&rec, start, nullptr);
+    return e;
+}
+
+static int ReapUrb (usbio_file_t file, usbio_buffer_t **urb) {
+    uint64_t start = time_in_nanoseconds();
+    int e = Inner->reapUrb(file, urb);
+    usbio_buffer_t *b = *urb;
+    AmlUsbCaptureRecord rec = {};
+    int pipe = 0;
+    int length = 0;
+    if (b != nullptr) {
+        mutex_lock(&CaptureMutex);
+        CaptureUrb *u = FindUrb(b);
+        if (u != nullptr) {
+            pipe = u->pipe;
+            length = u->length;
+            u->urb = nullptr;
+        }
+        mutex_unlock(&CaptureMutex);
+    }
+    Result(&rec, AML_USB_CAPTURE_REAP, file, pipe, length, e ? -e : b ? b->bytes : 0);
+    if (b != nullptr && e == 0 && (pipe & CAPTURE_ENDPOINT_IN) && b->bytes > 0) {
+        rec.hash = AmlUsbCaptureHash(b->data, b->bytes);
+    }
+    Append(&rec, start, nullptr);
+    return e;
+}
+
+static int HostController (usbio_file_t file, char *name, int bytes) {
+    return Inner->hostController(file, name, bytes);
+}
+
+static const AmlUsbBackend CaptureBackend = {
+    "capture", Open, Count, OpenAt, Close, Control, BulkRead, BulkWrite, AllocBuffer, FreeBuffer, SubmitUrb,
+    DiscardUrb, ReapUrb, HostController,
+};
+
+const AmlUsbBackend *AmlUsbCaptureBackend (const AmlUsbBackend *backend, const char *filename) {
+    if (CaptureFile != nullptr) {
+        aml_printf("[AmlUsbCapture]ERR: already capturing\n");
+        return nullptr;
+    }
+    AmlUsbCaptureHeader header = { {'A', 'M', 'L', 'U', 'S', 'B', 'C', 'P'}, AML_USB_CAPTURE_VERSION,
+        sizeof(AmlUsbCaptureRecord) };
+    FILE *f = fopen(filename, "wb");
+    if (f == nullptr || fwrite(&header, sizeof(header), 1, f) != 1) {
+        aml_printf("[AmlUsbCapture]ERR: can not write %s\n", filename);
+        if (f != nullptr) {
+            fclose(f);
+        }
+        return nullptr;
+    }
+    mutex_init(&CaptureMutex, 0);
+    Inner = backend;
+    CaptureStart = time_in_nanoseconds();
+    CaptureFile = f; // flushed and closed by exit()
+    aml_printf("[AmlUsbCapture]%s transfers to %s\n", backend->name, filename);
+    return &CaptureBackend;
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <stdint.h>
+
+// Recording of every transfer AmlLibusb makes, on any platform and backend (real devices or
+// AmlUsbSim). Enabled by AML_USB_CAPTURE=<file> in the environment: the first AmlUsbGetBackend()
+// wraps the backend it picked in AmlUsbCaptureBackend(). `update replay` plays a capture back
+// (AmlUsbReplay.h).
+// The file is an AmlUsbCaptureHeader, then one AmlUsbCaptureRecord per control, bulk and URB call,
+// control OUT records followed by `payload` bytes of their data stage (commands, WRITE_MEDIA
+// headers). Bulk and URB payloads are only hashed. All fields little endian.
+
+enum AmlUsbCaptureOp {
+    AML_USB_CAPTURE_CONTROL = 1,
+    AML_USB_CAPTURE_BULK = 2,
+    AML_USB_CAPTURE_SUBMIT = 3,  // URB submitted
+    AML_USB_CAPTURE_REAP = 4,    // URB completed, bytes = actual length
+    AML_USB_CAPTURE_DISCARD = 5, // URB cancelled
+    AML_USB_CAPTURE_OPS,
+};
+
+enum {
+    AML_USB_CAPTURE_PAYLOAD = 64, // most control OUT data stage bytes kept (commands are 64 bytes)
+    AML_USB_CAPTURE_VERSION = 2,
+};
+
+#pragma pack(push, 1)
+
+struct AmlUsbCaptureHeader {
+    char magic[8]; // "AMLUSBCP"
+    uint32_t version;
+    uint32_t recordSize; // sizeof(AmlUsbCaptureRecord)
+};
+
+struct AmlUsbCaptureRecord {
+    uint64_t ns;      // call start in nanoseconds since the capture began (monotonic)
+    uint32_t us;      // call duration in microseconds (REAP: time spent waiting for the URB)
+    uint32_t hash;    // AmlUsbCaptureHash() of the payload, OUT: sent, IN: received, 0 if none
+    int32_t length;   // bytes asked for
+    int32_t bytes;    // bytes transferred
+    uint16_t file;    // usbio_file_t, tells devices apart
+    uint8_t op;       // AmlUsbCaptureOp
+    uint8_t ep;       // endpoint, 0 for control
+    uint16_t error;   // errno, 0 on success
+    uint16_t payload; // control OUT data stage bytes following the record
+    uint8_t requestType; // control setup packet
+    uint8_t request;
+    uint16_t value;
+    uint16_t index;
+    uint16_t setupLength;
+};
+
+#pragma pack(pop)
+
+struct AmlUsbBackend;
+
+// Backend that forwards to `backend` and appends every call to filename, nullptr if it can not be
+// created. One capture per process.
+const AmlUsbBackend *AmlUsbCaptureBackend(const AmlUsbBackend *backend, const char *filename);
+
+uint32_t AmlUsbCaptureHash(const void *data, int bytes); // FNV-1a
@@ -0,0 +1,120 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "AmlUsbProfile.h"
+#include "UsbRomDrv.h"
+#include "Amldbglog.h"
+#include "pozix.h"
+
+enum { AML_USB_PROFILE_MAX_LINES = 256, AML_USB_PROFILE_LINE = 512 };
+
+static void ProfilePath (char *path, size_t size) {
+#ifdef WINDOWS
+    const char *home = getenv("USERPROFILE");
+#else
+    const char *home = getenv("HOME");
+#endif
+    snprintf(path, size, "%s/.amlupdate-profile", home ? home : ".");
+}
+
+// false for comments, blank and malformed lines
+static bool ParseLine (const char *line, AmlUsbProfileKey *key, AmlUsbProfile *profile) {
+    return sscanf(line, "%127s %31s %31s wbulk=%x wdepth=%d rseg=%x rdepth=%d", key->controller,
+        key->identify, key->chipId, &profile->writeBulkSize, &profile->writeQueueDepth,
+        &profile->readSegmentSize, &profile->readQueueDepth) == 7 && key->controller[0] != '#';
+}
+
+static bool Valid (const AmlUsbProfile *profile) {
+    return profile->writeBulkSize >= 64 && profile->writeBulkSize <= 0x10000 &&
+        profile->writeQueueDepth >= 1 && profile->writeQueueDepth <= 64 &&
+        profile->readSegmentSize >= 0x10000 && profile->readQueueDepth >= 1 &&
+        profile->readQueueDepth <= 64;
+}
+
+bool AmlUsbProfileExists () {
+    char path[512];
+    ProfilePath(path, sizeof(path));
+    FILE *fp = fopen(path, "r");
+    if (fp) {
+        fclose(fp);
+    }
+    return fp != nullptr;
+}
+
+bool AmlUsbProfileLoad (const AmlUsbProfileKey *key, AmlUsbProfile *profile) {
+    char path[512];
+    ProfilePath(path, sizeof(path));
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        return false;
+    }
+    bool exact = false;
+    bool family = false;
+    char line[AML_USB_PROFILE_LINE];
+    while (!exact && fgets(line, sizeof(line), fp)) {
+        AmlUsbProfileKey k = {};
+        AmlUsbProfile p = {};
+        if (!ParseLine(line, &k, &p) || !Valid(&p) || strcmp(k.controller, key->controller) ||
+            strcmp(k.identify, key->identify)) {
+            continue;
+        }
+        exact = !strcmp(k.chipId, key->chipId);
+        if (exact || !family) {
+            *profile = p;
+            family = true;
+        }
+    }
+    fclose(fp);
+    return family;
+}
+
+int AmlUsbProfileSave (const AmlUsbProfileKey *key, const AmlUsbProfile *profile, double writeMBps,
+    double readMBps) {
+    char path[512];
+    ProfilePath(path, sizeof(path));
+    static char lines[AML_USB_PROFILE_MAX_LINES][AML_USB_PROFILE_LINE];
+    int n = 0;
+    FILE *fp = fopen(path, "r");
+    while (fp && n < AML_USB_PROFILE_MAX_LINES - 1 && fgets(lines[n], AML_USB_PROFILE_LINE, fp)) {
+        AmlUsbProfileKey k = {};
+        AmlUsbProfile p = {};
+        bool replaced = ParseLine(lines[n], &k, &p) && !strcmp(k.controller, key->controller) &&
+            !strcmp(k.identify, key->identify) && !strcmp(k.chipId, key->chipId);
+        n += replaced ? 0 : 1;
+    }
+    if (fp) {
+        fclose(fp);
+    }
+    snprintf(lines[n++], AML_USB_PROFILE_LINE,
+        "%s %s %s wbulk=0x%x wdepth=%d rseg=0x%x rdepth=%d # write %.1fMB/s read %.1fMB/s\n",
+        key->controller, key->identify, key->chipId, profile->writeBulkSize,
+        profile->writeQueueDepth, profile->readSegmentSize, profile->readQueueDepth, writeMBps,
+        readMBps);
+    fp = fopen(path, "w");
+    if (!fp) {
+        aml_printf("[AmlUsbProfile]can not write %s\n", path);
+        return -1;
+    }
+    for (int i = 0; i < n; i++) {
+        fputs(lines[i], fp);
+    }
+    int result = fclose(fp) == 0 ? 0 : -1;
+    if (result == 0) {
+        aml_printf("[AmlUsbProfile]saved to %s\n", path);
+    }
+    return result;
+}
+
+void AmlUsbProfileCurrent (AmlUsbProfile *profile) {
+    profile->writeBulkSize = AmlUsbWriteLargeMem::BulkSize;
+    profile->writeQueueDepth = AmlUsbWriteLargeMem::QueueDepth;
+    profile->readSegmentSize = AmlUsbReadLargeMem::SegmentSize;
+    profile->readQueueDepth = AmlUsbReadLargeMem::QueueDepth;
+}
+
+void AmlUsbProfileApply (const AmlUsbProfile *profile) {
+    AmlUsbWriteLargeMem::BulkSize = profile->writeBulkSize;
+    AmlUsbWriteLargeMem::QueueDepth = profile->writeQueueDepth;
+    AmlUsbReadLargeMem::SegmentSize = profile->readSegmentSize;
+    AmlUsbReadLargeMem::QueueDepth = profile->readQueueDepth;
+}
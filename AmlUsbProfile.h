@@ -0,0 +1,29 @@
+#pragma once
+
+// Transfer settings found by `update tune`, kept one line per (host controller, device) in
+// $HOME/.amlupdate-profile (%USERPROFILE% on Windows):
+//   <controller> <identify bytes> <chip id|-> wbulk=0x1000 wdepth=8 rseg=0x400000 rdepth=16 # MB/s
+// A device is matched on all three keys first, then on controller and identify bytes only, so
+// a profile tuned on one board of a SoC family is used for the next board on the same port.
+// <controller> is the host controller's sysfs device on Linux (e.g. 0000:00:14.0) and its device
+// instance id on Windows (e.g. PCI\VEN_8086&DEV_A36D&...), see usbio_host_controller().
+
+struct AmlUsbProfile {
+    unsigned int writeBulkSize; // AmlUsbWriteLargeMem::BulkSize
+    int writeQueueDepth;        // AmlUsbWriteLargeMem::QueueDepth
+    unsigned int readSegmentSize; // AmlUsbReadLargeMem::SegmentSize
+    int readQueueDepth;         // AmlUsbReadLargeMem::QueueDepth
+};
+
+struct AmlUsbProfileKey {
+    char controller[128];
+    char identify[32];
+    char chipId[32]; // "-" when the stage can not tell (u-boot)
+};
+
+bool AmlUsbProfileExists();
+bool AmlUsbProfileLoad(const AmlUsbProfileKey *key, AmlUsbProfile *profile); // false if no line matches
+int AmlUsbProfileSave(const AmlUsbProfileKey *key, const AmlUsbProfile *profile, double writeMBps,
+    double readMBps);
+void AmlUsbProfileCurrent(AmlUsbProfile *profile); // settings in use
+void AmlUsbProfileApply(const AmlUsbProfile *profile);
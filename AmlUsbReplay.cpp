@@ -0,0 +1,295 @@
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include "AmlUsbReplay.h"
+#include "AmlUsbSim.h"
+#include "AmlUsbCapture.h"
+#include "AmlLibusb.h"
+#include "Amldbglog.h"
+#include "defs.h"
+#include "pozix.h"
+
+enum {
+    REPLAY_TOP = 5,        // longest command round trips reported
+    REPLAY_TIMEOUT = 5000, // milliseconds, control and bulk transfers
+    REPLAY_TEXT = 80,
+};
+
+static const char *const OpNames[AML_USB_CAPTURE_OPS] = { "?", "control", "bulk", "submit", "reap", "discard" };
+
+struct ReplayDevice {
+    int captured;       // usbio_file_t in the capture
+    usbio_file_t file;  // simulated device
+    usbio_buffer_t urbs[USBIO_BULK_REQUEST_QUEUE_SIZE]; // in flight FIFO, the device completes in order
+    void *data[USBIO_BULK_REQUEST_QUEUE_SIZE];
+    int size[USBIO_BULK_REQUEST_QUEUE_SIZE];
+    int head;
+    int count;
+    uint64_t commandNs; // recorded start of the command in flight
+    double commandMs;   // replayed start
+    char command[REPLAY_TEXT]; // "" none
+};
+
+struct ReplayStats {
+    int count;
+    double recordedMs;
+    double replayedMs;
+    int sizeMismatches;
+    int errorMismatches;
+    int dataMismatches;
+};
+
+struct ReplaySpan {
+    double recordedMs;
+    double replayedMs;
+    int device;
+    char command[REPLAY_TEXT];
+};
+
+static int DeviceIndex (ReplayDevice *devices, int count, int captured) {
+    for (int i = 0; i < count; i++) {
+        if (devices[i].captured == captured) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Commands start with a control OUT whose data stage is their text (or WRITE/READ_MEDIA header),
+// the round trip of a command lasts until the next one is sent to the same device.
+static bool DescribeCommand (const AmlUsbCaptureRecord *rec, const char *payload, char *text) {
+    int len = (int)strnlen(payload, rec->payload);
+    if ((rec->requestType & 0x80) != 0) {
+        return false;
+    } else if (rec->request == AML_LIBUSB_REQ_TPL_CMD) {
+        snprintf(text, REPLAY_TEXT, "tplcmd %.*s", len, payload);
+    } else if (rec->request == 0x34 || (rec->request == AML_LIBUSB_REQ_PASSWORD && rec->index == 2)) {
+        snprintf(text, REPLAY_TEXT, "bulkcmd %.*s", len, payload);
+    } else if ((rec->request == AML_LIBUSB_REQ_WRITE_MEDIA || rec->request == AML_LIBUSB_REQ_READ_MEDIA) &&
+        rec->payload >= 8) {
+        snprintf(text, REPLAY_TEXT, "%s media 0x%X bytes",
+            rec->request == AML_LIBUSB_REQ_WRITE_MEDIA ? "write" : "read", INT_AT(payload, 4));
+    } else {
+        return false;
+    }
+    return true;
+}
+
+static void CommandEnd (ReplayDevice *d, int device, uint64_t ns, double ms, ReplaySpan *top) {
+    if (!d->command[0]) {
+        return;
+    }
+    ReplaySpan span = { (ns - d->commandNs) / 1e6, ms - d->commandMs, device, {} };
+    memcpy(span.command, d->command, sizeof(span.command));
+    d->command[0] = 0;
+    for (int i = 0; i < REPLAY_TOP; i++) { // top is sorted, longest recorded first
+        if (span.recordedMs > top[i].recordedMs) {
+            ReplaySpan t = top[i];
+            top[i] = span;
+            span = t;
+        }
+    }
+}
+
+static void *Grow (void *data, int *size, int bytes) {
+    if (bytes > *size) {
+        free(data);
+        data = malloc(bytes);
+        *size = data ? bytes : 0;
+    }
+    return data;
+}
+
+int AmlUsbReplay (const char *filename, double speed) {
+    int ret = 0;
+    char *capture = nullptr;
+    void *scratch = nullptr;
+    int scratchSize = 0;
+    long bytes = 0;
+    ReplayDevice *devices = nullptr;
+    int deviceCount = 0;
+    int records = 0;
+    uint64_t lastNs = 0;
+    ReplayStats stats[AML_USB_CAPTURE_OPS] = {};
+    ReplaySpan top[REPLAY_TOP] = {};
+    const AmlUsbBackend *usb = nullptr;
+    AmlUsbCaptureHeader header = {};
+    char config[256];
+    const char *env = getenv("AML_USB_SIM");
+    double start = 0;
+    const char *p = nullptr;
+    const char *end = nullptr;
+    usbio_file_t files[AML_MAX_DEVICES];
+    FILE *fp = fopen(filename, "rb");
+    if (fp == nullptr || fseek(fp, 0, SEEK_END) != 0 || (bytes = ftell(fp)) < (long)sizeof(header) ||
+        fseek(fp, 0, SEEK_SET) != 0 || (capture = (char *)malloc(bytes)) == nullptr ||
+        fread(capture, 1, bytes, fp) != (size_t)bytes) {
+        aml_printf("[AmlUsbReplay]ERR: can not read %s\n", filename);
+        ret = EIO;
+        goto finish;
+    }
+    memcpy(&header, capture, sizeof(header));
+    if (memcmp(header.magic, "AMLUSBCP", sizeof(header.magic)) != 0 || header.version != AML_USB_CAPTURE_VERSION ||
+        header.recordSize != sizeof(AmlUsbCaptureRecord)) {
+        aml_printf("[AmlUsbReplay]ERR: %s is not a capture version %d\n", filename, AML_USB_CAPTURE_VERSION);
+        ret = EINVAL;
+        goto finish;
+    }
+    devices = (ReplayDevice *)calloc(AML_MAX_DEVICES, sizeof(ReplayDevice));
+    if (devices == nullptr) {
+        ret = ENOMEM;
+        goto finish;
+    }
+    end = capture + bytes;
+    for (p = capture + sizeof(header); p + sizeof(AmlUsbCaptureRecord) <= end; ) { // devices in order of appearance
+        AmlUsbCaptureRecord rec;
+        memcpy(&rec, p, sizeof(rec));
+        p += sizeof(rec) + rec.payload;
+        if (DeviceIndex(devices, deviceCount, rec.file) < 0 && deviceCount < (int)AML_MAX_DEVICES) {
+            devices[deviceCount++].captured = rec.file;
+        }
+    }
+    // devices= last so that it wins over one in AML_USB_SIM
+    snprintf(config, sizeof(config), "%s,devices=%d", env ? env : "", max(deviceCount, 1));
+    usb = AmlUsbSimBackend(config);
+    if (usb->open(AML_ID_VENDOR, AML_ID_PRODUCE, files, deviceCount) != deviceCount) {
+        aml_printf("[AmlUsbReplay]ERR: can not open %d simulated devices\n", deviceCount);
+        ret = ENODEV;
+        goto finish;
+    }
+    for (int i = 0; i < deviceCount; i++) {
+        devices[i].file = files[i];
+    }
+    start = time_in_milliseconds();
+    for (p = capture + sizeof(header); p + sizeof(AmlUsbCaptureRecord) <= end; ) {
+        AmlUsbCaptureRecord rec;
+        memcpy(&rec, p, sizeof(rec));
+        const char *payload = p + sizeof(rec);
+        p += sizeof(rec) + rec.payload;
+        if (p > end) {
+            aml_printf("[AmlUsbReplay]capture is truncated after %d records\n", records);
+            break;
+        }
+        int index = DeviceIndex(devices, deviceCount, rec.file);
+        if (index < 0 || rec.op >= AML_USB_CAPTURE_OPS) {
+            continue;
+        }
+        ReplayDevice *d = &devices[index];
+        if (speed > 0) {
+            double wait = start + rec.ns / 1e6 / speed - time_in_milliseconds();
+            if (wait > 0) {
+                millisleep(wait);
+            }
+        }
+        double issued = time_in_milliseconds();
+        char text[REPLAY_TEXT];
+        if (rec.op == AML_USB_CAPTURE_CONTROL && DescribeCommand(&rec, payload, text)) {
+            CommandEnd(d, index, rec.ns, issued - start, top);
+            d->commandNs = rec.ns;
+            d->commandMs = issued - start;
+            memcpy(d->command, text, sizeof(text));
+        }
+        bool in = (rec.ep & 0x80) != 0;
+        const void *received = nullptr; // IN data to compare with the captured hash
+        int r = 0; // bytes or -errno
+        if (rec.op == AML_USB_CAPTURE_CONTROL || rec.op == AML_USB_CAPTURE_BULK) {
+            scratch = Grow(scratch, &scratchSize, max(rec.length, 1));
+            if (scratch == nullptr) {
+                ret = ENOMEM;
+                goto finish;
+            }
+            memset(scratch, 0, rec.length);
+            if (rec.op == AML_USB_CAPTURE_CONTROL) {
+                in = (rec.requestType & 0x80) != 0;
+                memcpy(scratch, payload, min((int)rec.payload, rec.length));
+                r = usb->control(d->file, rec.requestType, rec.request, rec.value, rec.index,
+                    (char *)scratch, rec.setupLength, REPLAY_TIMEOUT);
+            } else if (in) {
+                r = usb->bulkRead(d->file, rec.ep, (char *)scratch, rec.length, REPLAY_TIMEOUT);
+            } else {
+                r = usb->bulkWrite(d->file, rec.ep, (const char *)scratch, rec.length, REPLAY_TIMEOUT);
+            }
+            received = in ? scratch : nullptr;
+        } else if (rec.op == AML_USB_CAPTURE_SUBMIT) {
+            int slot = (d->head + d->count) % USBIO_BULK_REQUEST_QUEUE_SIZE;
+            d->data[slot] = Grow(d->data[slot], &d->size[slot], max(rec.length, 1));
+            if (d->data[slot] == nullptr) {
+                ret = ENOMEM;
+                goto finish;
+            }
+            usbio_buffer_t *b = &d->urbs[slot];
+            memset(b, 0, sizeof(*b));
+            memset(d->data[slot], 0, rec.length);
+            b->data = (byte *)d->data[slot];
+            b->bytes = rec.length;
+            r = d->count == USBIO_BULK_REQUEST_QUEUE_SIZE ? -EBUSY : -usb->submitUrb(d->file, rec.ep, b);
+            d->count += r == 0 ? 1 : 0;
+        } else if (rec.op == AML_USB_CAPTURE_REAP) {
+            usbio_buffer_t *b = nullptr;
+            r = d->count == 0 ? -EAGAIN : -usb->reapUrb(d->file, &b);
+            if (b != nullptr) {
+                d->head = (d->head + 1) % USBIO_BULK_REQUEST_QUEUE_SIZE;
+                d->count--;
+                r = r == 0 ? b->bytes : r;
+                received = in ? b->data : nullptr;
+            }
+        } else { // discard: which URB is not captured, the sequence goes on with the reap
+            stats[rec.op].count++;
+            records++;
+            continue;
+        }
+        ReplayStats *s = &stats[rec.op];
+        s->count++;
+        s->recordedMs += rec.us / 1000.0;
+        s->replayedMs += time_in_milliseconds() - issued;
+        if ((r < 0) != (rec.error != 0)) {
+            s->errorMismatches++;
+        } else if (r >= 0 && rec.op != AML_USB_CAPTURE_SUBMIT && r != rec.bytes) {
+            s->sizeMismatches++;
+        } else if (received != nullptr && r > 0 && rec.hash != 0 && rec.hash != AmlUsbCaptureHash(received, r)) {
+            s->dataMismatches++;
+        }
+        lastNs = max(lastNs, rec.ns + rec.us * 1000ull);
+        records++;
+    }
+    for (int i = 0; i < deviceCount; i++) {
+        CommandEnd(&devices[i], i, lastNs, time_in_milliseconds() - start, top);
+        while (devices[i].count > 0) { // URBs submitted but never reaped in the capture
+            usbio_buffer_t *b = nullptr;
+            usb->reapUrb(devices[i].file, &b);
+            devices[i].count--;
+        }
+    }
+    aml_printf("[AmlUsbReplay]%s: %d transfers on %d devices, recorded %.1fms, replayed %.1fms at speed %g\n",
+        filename, records, deviceCount, lastNs / 1e6, time_in_milliseconds() - start, speed);
+    aml_printf("[AmlUsbReplay]%-8s %8s %12s %12s   mismatches size/error/data\n", "op", "count", "recorded ms",
+        "replayed ms");
+    for (int op = AML_USB_CAPTURE_CONTROL; op < AML_USB_CAPTURE_OPS; op++) {
+        ReplayStats *s = &stats[op];
+        if (s->count > 0) {
+            aml_printf("[AmlUsbReplay]%-8s %8d %12.1f %12.1f   %d/%d/%d\n", OpNames[op], s->count, s->recordedMs,
+                s->replayedMs, s->sizeMismatches, s->errorMismatches, s->dataMismatches);
+        }
+    }
+    if (top[0].command[0]) {
+        aml_printf("[AmlUsbReplay]longest commands, recorded ms / replayed ms:\n");
+    }
+    for (int i = 0; i < REPLAY_TOP && top[i].command[0]; i++) {
+        aml_printf("[AmlUsbReplay]%10.1f / %-10.1f dev%d %s\n", top[i].recordedMs, top[i].replayedMs,
+            top[i].device, top[i].command);
+    }
+finish:
+    if (fp) {
+        fclose(fp);
+    }
+    for (int i = 0; devices && i < deviceCount; i++) {
+        for (int j = 0; j < USBIO_BULK_REQUEST_QUEUE_SIZE; j++) {
+            free(devices[i].data[j]);
+        }
+    }
+    free(devices);
+    free(scratch);
+    free(capture);
+    return ret;
+}
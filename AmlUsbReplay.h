@@ -0,0 +1,12 @@
+#pragma once
+
+// Feeds a capture (AML_USB_CAPTURE=<file> update ..., see AmlUsbCapture.h) back into the
+// simulated devices of AmlUsbSim.h, so field timing (long erase waits, slow get_status)
+// can be reproduced and protocol changes compared against real workloads without hardware.
+// speed 1 issues every transfer at its recorded time, 10 ten times faster, 0 back to back.
+// AML_USB_SIM options apply (e.g. busyms=200 to model a slow erase). Control OUT data stages are
+// replayed as captured, bulk and URB OUT payloads as zeros (only their hash is captured).
+// Prints per operation and the longest command round trips recorded vs replayed.
+// Returns 0 or an error code.
+
+int AmlUsbReplay(const char *filename, double speed);
@@ -6,6 +6,7 @@
 #include "Amldbglog.h"
 #include "UsbRomDrv.h"
 #include "AmlUsbScanX3.h"
+#include "AmlImage.h"
 
 #pragma warning(disable: 4100) // unreferenced formal parameter
 
@@ -28,17 +29,19 @@ bool simg_probe(const unsigned char *buf, unsigned int len) {
     return true;
 }
 
+// looks through gzip/xz/zstd/lz4 compression
 bool is_file_format_sparse(const char *filename) {
-    FILE *fp = fopen(filename, "rb");
-    if (fp == nullptr) {
+    AmlImage *image = AmlImageOpenDecompressed(filename);
+    if (image == nullptr) {
         aml_printf("[update]ERR(L%d):", 68);
         aml_printf("Fail to open file in mode rb\n");
         return false;
     }
     auto buf = new unsigned char[0x2000];
-    size_t len = fread(buf, 1, 0x2000, fp);
-    fclose(fp);
-    bool result = simg_probe(buf, (unsigned int)len);
+    const char *data = nullptr;
+    int len = AmlImageRead(image, (char *)buf, 0x2000, &data);
+    bool result = len > 0 && simg_probe((const unsigned char *)data, (unsigned int)len);
+    AmlImageClose(image);
     if (buf) {
         delete[] buf;
     }
@@ -83,11 +86,13 @@ int aml_send_command(void *device, char *mem_type, int retry, char *reply) {
     memcpy(buffer, mem_type, strlen(mem_type));
     buffer[66] = 1;
     struct AmlUsbRomRW rom = {};
+    rom.device = (struct usb_device *)device;
     rom.bufferLen = 68;
     rom.buffer = buffer;
     rom.pDataSize = &data_len;
     if (AmlUsbTplCmd(&rom) == 0) {
         memset(&rom, 0, sizeof(rom));
+        rom.device = (struct usb_device *)device;
         rom.bufferLen = 64;
         rom.buffer = reply;
         while (--retry > 0) {
@@ -110,21 +115,22 @@ int aml_get_sn(char *target_device, char *usid) {
     }
     char buffer[8] = {};
     struct AmlUsbRomRW rom = {};
+    rom.device = device;
     rom.bufferLen = 4;
     rom.buffer = buffer;
     if (AmlUsbIdentifyHost(&rom)) {
-        device = nullptr;
+        AmlReleaseDeviceHandle(device);
         return -1;
     }
     if (buffer[3] != '\x10') {
-        device = nullptr;
+        AmlReleaseDeviceHandle(device);
         return -1;
     }
     aml_send_command(device, "efuse write version", 50, usid);
     int ret = aml_send_command(device, "efuse read usid", 50, usid);
     printf("%s \n", usid);
     if (ret < 0) {
-        device = nullptr;
+        AmlReleaseDeviceHandle(device);
         return -1;
     }
     char s[256];
@@ -135,11 +141,12 @@ int aml_get_sn(char *target_device, char *usid) {
     memset(tmp2, 0, 8);
     memcpy(s, usid, strlen(usid));
     if (strcmp(tmp1, "success") != 0 || sscanf(s, "%[^:]:(%[^)])", tmp1, tmp2) != 2) {
+        AmlReleaseDeviceHandle(device);
         return 0;
     }
     memset(usid, 0, 8);
     memcpy(usid, tmp2, strlen(tmp2));
-    device = nullptr;
+    AmlReleaseDeviceHandle(device);
     return (int)strlen(tmp2);
 }
 
@@ -152,14 +159,15 @@ int aml_set_sn(char *target_device, char *usid) {
     }
     char buffer[8];
     struct AmlUsbRomRW rom = {};
+    rom.device = device;
     rom.bufferLen = 4;
     rom.buffer = buffer;
     if (AmlUsbIdentifyHost(&rom)) {
-        device = nullptr;
+        AmlReleaseDeviceHandle(device);
         return -1;
     }
     if (buffer[3] != '\x10') {
-        device = nullptr;
+        AmlReleaseDeviceHandle(device);
         return -1;
     }
     char cmd[256];
@@ -167,7 +175,7 @@ int aml_set_sn(char *target_device, char *usid) {
     sprintf(cmd, "efuse write usid %s", usid);
     aml_send_command(device, "efuse write version", 50, src);
     if (aml_send_command(device, cmd, 50, src) < 0) {
-        device = nullptr;
+        AmlReleaseDeviceHandle(device);
         return -1;
     }
     char dest[256] = {};
@@ -177,8 +185,9 @@ int aml_set_sn(char *target_device, char *usid) {
     sscanf(dest, "%[^:]:(%[^)])", tmp1, tmp2);
     printf("tmp1=%s,tmp2=%s \n", tmp1, tmp2);
     if (strcmp(tmp1, "success") != 0) {
+        AmlReleaseDeviceHandle(device);
         return 0;
     }
-    device = nullptr;
+    AmlReleaseDeviceHandle(device);
     return (int)strlen(tmp2);
 }
\ No newline at end of file
@@ -4,7 +4,9 @@
 #include <string.h>
 
 #include "AmlUsbScanX3.h"
+#include "AmlLibusb.h"
 #include "Amldbglog.h"
+#include "defs.h"
 
 #pragma warning(disable: 4100) // unreferenced formal parameter
 
@@ -45,8 +47,24 @@ int scanDevices (AmlscanX scan, const char *target) {
     }
     *scan.nDevices = iDevice;
 #endif
-    *scan.nDevices = 1;
-    return 1;
+    // usbio has no bus/port topology: devices are named by their /dev/bus/usb enumeration order.
+    // Only counted here, the chosen one is opened and claimed by its first OpenUsbDevice().
+    int n = min(AmlCountDevices(), (int)AML_MAX_DEVICES);
+    int found = 0;
+    for (int i = 0; i < n; i++) {
+        char tmp[128];
+        snprintf(tmp, sizeof(tmp), "WorldCup Device %02d: ID %04x:%04x", i, AML_ID_VENDOR,
+            AML_ID_PRODUCE);
+        if (target != NULL && !strcmp(tmp, target) && scan.resultDevice != NULL) {
+            *scan.resultDevice = AmlNewDeviceHandle();
+            (*scan.resultDevice)->index = i;
+            found = 1;
+        } else if (scan.candidateDevices != NULL && scan.candidateDevices[i] != NULL) {
+            strcpy(scan.candidateDevices[i], tmp);
+        }
+    }
+    *scan.nDevices = n;
+    return target == NULL || found;
 }
 
 int AmlScanUsbX3Devices(const char *vendorName, char **candidateDevices) {
@@ -69,7 +87,7 @@ int AmlScanUsbX3Devices(const char *vendorName, char **candidateDevices) {
 struct usb_device *AmlGetDeviceHandle (const char *vendorName, char *targetDevice) {
     int nDevices = 0;
     struct usb_device *resultDevice = NULL;
-    char *candidateDevices[8] = {};
+    char *candidateDevices[AML_MAX_DEVICES] = {};
     struct AmlscanX scan = {};
     scan.vendorName = vendorName;
     scan.resultDevice = &resultDevice;
@@ -77,7 +95,7 @@ struct usb_device *AmlGetDeviceHandle (const char *vendorName, char *targetDevic
     scan.candidateDevices = candidateDevices;
     scan.nDevices = &nDevices;
     gLevel = 0;
-    for (int i = 0; i <= 7; ++i) {
+    for (int i = 0; i < AML_MAX_DEVICES; ++i) {
         candidateDevices[i] = (char *)malloc(0x100);
         memset(candidateDevices[i], 0, 0x100);
     }
@@ -85,7 +103,7 @@ struct usb_device *AmlGetDeviceHandle (const char *vendorName, char *targetDevic
         aml_printf("get usb devices handle failed\n");
         resultDevice = NULL;
     }
-    for (int i = 0; i <= 7; ++i) {
+    for (int i = 0; i < AML_MAX_DEVICES; ++i) {
         if (candidateDevices[i]) {
             free(candidateDevices[i]);
         }
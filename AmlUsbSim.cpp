@@ -0,0 +1,580 @@
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include "AmlUsbSim.h"
+#include "AmlLibusb.h"
+#include "AmlSha1.h"
+#include "AmlCrc32.h"
+#include "Amldbglog.h"
+#include "defs.h"
+#include "pozix.h"
+
+enum {
+    SIM_FILE_BASE = 0x5100,   // usbio_file_t of simulated device 0
+    SIM_PAGE_SHIFT = 16,      // DRAM is kept in 64KB pages, allocated on first write
+    SIM_PAGE_SIZE = 1 << SIM_PAGE_SHIFT,
+    SIM_PAGES = 1 << (32 - SIM_PAGE_SHIFT),
+    SIM_REPLY_SIZE = 64,      // status replies are zero padded to this
+    SIM_CHUNK_SIZE = 0x10000, // largest WRITE_MEDIA chunk
+    SIM_ENDPOINT_IN = 0x80,
+};
+
+static const unsigned int SimChipIdAddress = 0xFFFCD400; // where ReadChipId looks for idVer 0x205
+
+enum SimBulk {
+    SIM_BULK_NONE,
+    SIM_BULK_MEM_WRITE,   // after WRITE_MEM: bulk OUT goes to DRAM
+    SIM_BULK_MEM_READ,    // after READ_MEM: bulk IN comes from DRAM
+    SIM_BULK_MEDIA_WRITE, // after WRITE_MEDIA: bulk OUT is the chunk
+    SIM_BULK_MEDIA_READ,  // after READ_MEDIA: bulk IN is the upload
+};
+
+struct SimConfig {
+    int devices;
+    double mbps;
+    double latency;
+    int busy;
+    int cmdBusy;
+    double busyMs;
+    double errors;
+    unsigned int seed;
+    int stage;
+};
+
+struct SimUrb {
+    usbio_buffer_t *urb;
+    int bytes;  // actual length handed back by reap
+    int error;
+    double due; // time_in_milliseconds() the transfer is over
+};
+
+struct SimDevice {
+    mutex_t mutex;
+    int index;
+    int stage;              // identify byte 3: 0 ROM, 8 bl2, 16 u-boot
+    char *dram[SIM_PAGES];
+    int bulk;               // SimBulk
+    unsigned int address;   // next DRAM byte of the large-mem transfer
+    unsigned int remaining; // bytes the large-mem/upload transfer still has
+    bool uploadMem;         // upload reads DRAM from uploadAddress, zeros otherwise
+    unsigned int uploadAddress;
+    char *chunk;            // WRITE_MEDIA chunk being received
+    unsigned int chunkSize;
+    unsigned int chunkFilled;
+    bool download;          // session opened by tplcmd `download`
+    long long downloadSize;
+    long long downloaded;
+    AmlSha1 sha1;           // of the chunks accepted so far
+    char status[SIM_REPLY_SIZE]; // TPL_STATUS reply
+    int continues;          // "Continue:NN" replies still due before result
+    char busyText[16];
+    char result[SIM_REPLY_SIZE]; // empty once read
+    double busFree;         // the simulated bus is idle again
+    SimUrb urbs[USBIO_BULK_REQUEST_QUEUE_SIZE]; // submitted, reaped in submission order
+    int urbHead;
+    int urbCount;
+    unsigned int random;    // error injection state
+};
+
+static SimConfig Config = { 1, 40, 0.125, 1, 1, 0, 0, 1, 0 };
+static SimDevice *Devices[AML_MAX_DEVICES];
+static mutex_t DevicesMutex;
+static const char ZeroPage[SIM_PAGE_SIZE] = {};
+
+
+static SimDevice *DeviceOf (usbio_file_t file) {
+    int i = file - SIM_FILE_BASE;
+    return i >= 0 && i < Config.devices ? Devices[i] : nullptr;
+}
+
+static void DramWrite (SimDevice *d, unsigned int address, const char *data, unsigned int len) {
+    while (len > 0) {
+        unsigned int offset = address & (SIM_PAGE_SIZE - 1);
+        unsigned int n = min(len, (unsigned int)SIM_PAGE_SIZE - offset);
+        char *&page = d->dram[address >> SIM_PAGE_SHIFT];
+        if (page == nullptr) {
+            page = (char *)calloc(1, SIM_PAGE_SIZE);
+            if (page == nullptr) {
+                aml_printf("[AmlUsbSim]out of memory for DRAM at 0x%x\n", address);
+                return;
+            }
+        }
+        memcpy(page + offset, data, n);
+        address += n;
+        data += n;
+        len -= n;
+    }
+}
+
+// bytes at address, ZeroPage for what was never written
+static const char *DramAt (SimDevice *d, unsigned int address, unsigned int *len) {
+    unsigned int offset = address & (SIM_PAGE_SIZE - 1);
+    *len = min(*len, (unsigned int)SIM_PAGE_SIZE - offset);
+    const char *page = d->dram[address >> SIM_PAGE_SHIFT];
+    return (page ? page : ZeroPage) + offset;
+}
+
+static void DramRead (SimDevice *d, unsigned int address, char *data, unsigned int len) {
+    while (len > 0) {
+        unsigned int n = len;
+        const char *from = DramAt(d, address, &n);
+        memcpy(data, from, n);
+        address += n;
+        data += n;
+        len -= n;
+    }
+}
+
+static unsigned int DramCrc32 (SimDevice *d, unsigned int address, unsigned int len) {
+    unsigned int crc = 0;
+    while (len > 0) {
+        unsigned int n = len;
+        const char *from = DramAt(d, address, &n);
+        crc = AmlCrc32(crc, from, n);
+        address += n;
+        len -= n;
+    }
+    return crc;
+}
+
+static SimDevice *NewDevice (int index) {
+    SimDevice *d = (SimDevice *)calloc(1, sizeof(SimDevice));
+    if (d == nullptr) {
+        return nullptr;
+    }
+    mutex_init(&d->mutex, 0);
+    d->index = index;
+    d->stage = Config.stage;
+    d->random = Config.seed * 2654435761u + (unsigned int)index + 1;
+    d->random = d->random ? d->random : 1;
+    char chipId[16] = {};
+    snprintf(chipId, sizeof(chipId), "AMLSIM%06d", index);
+    DramWrite(d, SimChipIdAddress, chipId, 12);
+    return d;
+}
+
+// xorshift32: the same seed fails the same transfers
+static bool Fails (SimDevice *d) {
+    if (Config.errors <= 0) {
+        return false;
+    }
+    d->random ^= d->random << 13;
+    d->random ^= d->random >> 17;
+    d->random ^= d->random << 5;
+    return d->random / 4294967296.0 < Config.errors;
+}
+
+// Books a transfer of `bytes` on the device's bus behind the ones already on it and returns the
+// time it completes. deviceMs is time the device takes before it answers.
+static double Schedule (SimDevice *d, int bytes, double deviceMs) {
+    double start = max(time_in_milliseconds(), d->busFree);
+    double wire = Config.mbps > 0 ? bytes / (Config.mbps * 1048.576) : 0;
+    d->busFree = start + deviceMs + wire;
+    return d->busFree + Config.latency; // the round trip overlaps the transfers queued behind
+}
+
+static void WaitUntil (double due) {
+    double now = time_in_milliseconds();
+    if (due > now) {
+        millisleep(due - now);
+    }
+}
+
+static void Respond (SimDevice *d, const char *busyText, int continues, const char *result) {
+    snprintf(d->busyText, sizeof(d->busyText), "%s", busyText);
+    d->continues = continues;
+    snprintf(d->result, sizeof(d->result), "%s", result);
+}
+
+static void TplCmd (SimDevice *d, const char *cmd) {
+    char storeOrMem[16] = {};
+    char partition[32] = {};
+    char fileType[16] = {};
+    long long size = 0;
+    if (sscanf(cmd, "download %15s %31s %15s %lli", storeOrMem, partition, fileType, &size) == 4) {
+        d->download = true;
+        d->downloadSize = size;
+        d->downloaded = 0;
+        AmlSha1Init(&d->sha1);
+    }
+    snprintf(d->status, sizeof(d->status), "success");
+}
+
+static bool DownloadComplete (SimDevice *d) {
+    return d->download && d->downloaded == d->downloadSize;
+}
+
+// u-boot bulk commands: the ones the tool reads results of are carried out, the rest succeed
+static void BulkCmd (SimDevice *d, const char *cmd) {
+    bool ok = true;
+    char what[16] = {};
+    char hex[AML_SHA1_DIGEST_SIZE * 2 + 8] = {};
+    unsigned int address = 0;
+    unsigned int len = 0;
+    unsigned int store = 0;
+    if (!strcmp(cmd, "download get_status")) {
+        ok = DownloadComplete(d);
+    } else if (sscanf(cmd, "verify sha1sum %47s", hex) == 1) {
+        AmlSha1 sha1 = d->sha1;
+        unsigned char digest[AML_SHA1_DIGEST_SIZE];
+        char received[AML_SHA1_DIGEST_SIZE * 2 + 1];
+        AmlSha1Final(&sha1, digest);
+        ok = DownloadComplete(d) && !stricmp(hex, AmlSha1Hex(digest, received));
+    } else if (sscanf(cmd, "crc32 %x %x %x", &address, &len, &store) == 3) {
+        unsigned int crc = DramCrc32(d, address, len);
+        char stored[4] = { (char)(crc >> 24), (char)(crc >> 16), (char)(crc >> 8), (char)crc };
+        DramWrite(d, store, stored, 4);
+    } else if (sscanf(cmd, "upload %15s %x", what, &address) == 2 && !strcmp(what, "mem")) {
+        d->uploadMem = true;
+        d->uploadAddress = address;
+    } else if (!strncmp(cmd, "upload ", 7)) {
+        d->uploadMem = false;
+    }
+    Respond(d, "Continue:34", Config.cmdBusy, ok ? "success" : "failed");
+}
+
+// Whole chunk received: the host reads Continue:32 then OK!! or, when refused, sends it again
+static void MediaChunk (SimDevice *d) {
+    d->bulk = SIM_BULK_NONE;
+    bool ok = d->download && d->downloaded + d->chunkSize <= d->downloadSize && !Fails(d);
+    if (ok) {
+        AmlSha1Update(&d->sha1, d->chunk, d->chunkSize);
+        d->downloaded += d->chunkSize;
+    }
+    Respond(d, "Continue:32", Config.busy, ok ? "OK!!" : "failed");
+}
+
+static int BulkOut (SimDevice *d, const char *data, int size) {
+    if (d->bulk == SIM_BULK_MEM_WRITE) {
+        DramWrite(d, d->address, data, (unsigned int)size);
+        d->address += (unsigned int)size;
+        d->remaining -= min(d->remaining, (unsigned int)size);
+        return size;
+    }
+    if (d->bulk != SIM_BULK_MEDIA_WRITE) {
+        return -EPIPE;
+    }
+    int n = min(size, (int)(d->chunkSize - d->chunkFilled));
+    memcpy(d->chunk + d->chunkFilled, data, n);
+    d->chunkFilled += n;
+    if (d->chunkFilled == d->chunkSize) {
+        MediaChunk(d);
+    }
+    return n;
+}
+
+// Large-mem or upload data while there is some, then the pending status reply
+static int BulkIn (SimDevice *d, char *data, int size, double *deviceMs) {
+    if ((d->bulk == SIM_BULK_MEM_READ || d->bulk == SIM_BULK_MEDIA_READ) && d->remaining > 0) {
+        unsigned int n = min((unsigned int)size, d->remaining);
+        if (d->bulk == SIM_BULK_MEM_READ || d->uploadMem) {
+            DramRead(d, d->address, data, n);
+        } else {
+            memset(data, 0, n);
+        }
+        d->address += n;
+        d->remaining -= n;
+        if (d->bulk == SIM_BULK_MEDIA_READ) {
+            d->uploadAddress = d->address;
+        }
+        return (int)n;
+    }
+    char reply[SIM_REPLY_SIZE] = {};
+    if (d->continues > 0) {
+        --d->continues;
+        *deviceMs = Config.busyMs;
+        snprintf(reply, sizeof(reply), "%s", d->busyText);
+    } else if (d->result[0]) {
+        snprintf(reply, sizeof(reply), "%s", d->result);
+        d->result[0] = 0;
+    } else {
+        return -ETIMEDOUT; // nothing to say: the host would wait for its timeout
+    }
+    int n = min(size, (int)SIM_REPLY_SIZE);
+    memcpy(data, reply, n);
+    return n;
+}
+
+static int Control (usbio_file_t file, int requestType, int request, int value, int index,
+    char *bytes, int size, int timeout) {
+    SimDevice *d = DeviceOf(file);
+    if (d == nullptr) {
+        return -ENODEV;
+    }
+    mutex_lock(&d->mutex);
+    unsigned int address = ((unsigned int)value << 16) | (unsigned int)(index & 0xFFFF);
+    char text[SIM_REPLY_SIZE + 1] = {};
+    int r = size;
+    if (Fails(d)) {
+        r = -EPIPE;
+    } else switch (request) {
+    case AML_LIBUSB_REQ_WRITE_CTRL:
+        DramWrite(d, address, bytes, (unsigned int)size);
+        break;
+    case AML_LIBUSB_REQ_READ_CTRL:
+        DramRead(d, address, bytes, (unsigned int)size);
+        break;
+    case AML_LIBUSB_REQ_RUN_ADDR:
+        d->stage = d->stage == 0 ? 8 : 16; // ROM runs bl2, bl2 runs u-boot
+        break;
+    case AML_LIBUSB_REQ_WRITE_MEM:
+    case AML_LIBUSB_REQ_READ_MEM:
+        if (size < 16) {
+            r = -EPIPE;
+            break;
+        }
+        d->bulk = request == AML_LIBUSB_REQ_WRITE_MEM ? SIM_BULK_MEM_WRITE : SIM_BULK_MEM_READ;
+        d->address = (unsigned int)INT_AT(bytes, 0);
+        d->remaining = (unsigned int)INT_AT(bytes, 4);
+        break;
+    case AML_LIBUSB_REQ_IDENTIFY: {
+        char id[8] = { 2, 5, 0, (char)d->stage, 0, 0, 0, 0 };
+        r = min(size, (int)sizeof(id));
+        memcpy(bytes, id, r);
+        break;
+    }
+    case AML_LIBUSB_REQ_TPL_CMD:
+        memcpy(text, bytes, min(size, (int)SIM_REPLY_SIZE));
+        TplCmd(d, text);
+        break;
+    case AML_LIBUSB_REQ_TPL_STATUS:
+        r = min(size, (int)SIM_REPLY_SIZE);
+        memcpy(bytes, d->status, r);
+        break;
+    case AML_LIBUSB_REQ_WRITE_MEDIA:
+        d->chunk = d->chunk ? d->chunk : (char *)malloc(SIM_CHUNK_SIZE);
+        if (size < 8 || d->chunk == nullptr) {
+            r = -EPIPE;
+            break;
+        }
+        d->bulk = SIM_BULK_MEDIA_WRITE;
+        d->chunkSize = min((unsigned int)INT_AT(bytes, 4), (unsigned int)SIM_CHUNK_SIZE);
+        d->chunkFilled = 0;
+        Respond(d, "", 0, "");
+        break;
+    case AML_LIBUSB_REQ_READ_MEDIA:
+        if (size < 8) {
+            r = -EPIPE;
+            break;
+        }
+        d->bulk = SIM_BULK_MEDIA_READ;
+        d->address = d->uploadAddress;
+        d->remaining = (unsigned int)INT_AT(bytes, 4);
+        break;
+    case 0x34: // bulk command, index 2
+    case AML_LIBUSB_REQ_PASSWORD: // 0x35 with index 2 is a bulk command too
+        if (request == 0x34 || index == 2) {
+            memcpy(text, bytes, min(size, (int)SIM_REPLY_SIZE));
+            BulkCmd(d, text);
+        }
+        break;
+    case AML_LIBUSB_REQ_CHIP_INFO:
+        memset(bytes, 0, size);
+        if (size >= 32) {
+            DramRead(d, SimChipIdAddress, bytes + 20, 12);
+        }
+        break;
+    default:
+        r = -EPIPE;
+        break;
+    }
+    double due = Schedule(d, max(r, 0), 0);
+    mutex_unlock(&d->mutex);
+    WaitUntil(due);
+    return r;
+}
+
+static int BulkRead (usbio_file_t file, int ep, char *bytes, int size, int timeout) {
+    SimDevice *d = DeviceOf(file);
+    if (d == nullptr) {
+        return -ENODEV;
+    }
+    mutex_lock(&d->mutex);
+    double deviceMs = 0;
+    int r = Fails(d) ? -EIO : BulkIn(d, bytes, size, &deviceMs);
+    double due = Schedule(d, max(r, 0), deviceMs);
+    mutex_unlock(&d->mutex);
+    WaitUntil(due);
+    return r;
+}
+
+static int BulkWrite (usbio_file_t file, int ep, const char *bytes, int size, int timeout) {
+    SimDevice *d = DeviceOf(file);
+    if (d == nullptr) {
+        return -ENODEV;
+    }
+    mutex_lock(&d->mutex);
+    int r = Fails(d) ? -EIO : BulkOut(d, bytes, size);
+    double due = Schedule(d, max(r, 0), 0);
+    mutex_unlock(&d->mutex);
+    WaitUntil(due);
+    return r;
+}
+
+static int Open (int vid, int pid, usbio_file_t *files, int count) {
+    mutex_lock(&DevicesMutex);
+    int n = 0;
+    while (n < min(count, Config.devices) && (Devices[n] || (Devices[n] = NewDevice(n)))) {
+        files[n] = SIM_FILE_BASE + n;
+        n++;
+    }
+    mutex_unlock(&DevicesMutex);
+    return n;
+}
+
+static int Count (int vid, int pid) {
+    return Config.devices;
+}
+
+static int OpenAt (int vid, int pid, int index, usbio_file_t *file) {
+    if (index < 0 || index >= Config.devices) {
+        return -1;
+    }
+    mutex_lock(&DevicesMutex);
+    bool opened = Devices[index] || (Devices[index] = NewDevice(index));
+    mutex_unlock(&DevicesMutex);
+    if (opened) {
+        *file = SIM_FILE_BASE + index;
+    }
+    return opened ? 1 : -1;
+}
+
+static int Close (usbio_file_t file) {
+    return DeviceOf(file) ? 0 : EBADF; // the device runs on, as a real one does
+}
+
+static void *AllocBuffer (usbio_file_t file, int bytes, bool *dma) {
+    *dma = false;
+    return malloc(bytes);
+}
+
+static void FreeBuffer (void *data, int bytes, bool dma) {
+    free(data);
+}
+
+// The transfer is carried out at submit time, reap waits until the bus would have finished it
+static int SubmitUrb (usbio_file_t file, int pipe, usbio_buffer_t *urb) {
+    SimDevice *d = DeviceOf(file);
+    if (d == nullptr) {
+        return EBADF;
+    }
+    mutex_lock(&d->mutex);
+    if (d->urbCount == USBIO_BULK_REQUEST_QUEUE_SIZE) {
+        mutex_unlock(&d->mutex);
+        return EBUSY;
+    }
+    SimUrb *u = &d->urbs[(d->urbHead + d->urbCount++) % USBIO_BULK_REQUEST_QUEUE_SIZE];
+    double deviceMs = 0;
+    int r = -EIO;
+    if (!Fails(d) && (pipe & SIM_ENDPOINT_IN)) {
+        r = BulkIn(d, (char *)urb->data, urb->bytes, &deviceMs);
+    } else if (!Fails(d)) {
+        r = BulkOut(d, (const char *)urb->data, urb->bytes);
+    }
+    u->urb = urb;
+    u->bytes = max(r, 0);
+    u->error = r < 0 ? -r : 0;
+    u->due = Schedule(d, u->bytes, deviceMs);
+    mutex_unlock(&d->mutex);
+    return 0;
+}
+
+static int DiscardUrb (usbio_file_t file, usbio_buffer_t *urb) {
+    SimDevice *d = DeviceOf(file);
+    if (d == nullptr) {
+        return EBADF;
+    }
+    mutex_lock(&d->mutex);
+    int r = EINVAL;
+    for (int i = 0; i < d->urbCount; i++) {
+        SimUrb *u = &d->urbs[(d->urbHead + i) % USBIO_BULK_REQUEST_QUEUE_SIZE];
+        if (u->urb == urb) {
+            u->bytes = 0;
+            u->error = ENOENT;
+            u->due = 0;
+            r = 0;
+        }
+    }
+    mutex_unlock(&d->mutex);
+    return r;
+}
+
+static int ReapUrb (usbio_file_t file, usbio_buffer_t **urb) {
+    SimDevice *d = DeviceOf(file);
+    if (d == nullptr) {
+        return EBADF;
+    }
+    mutex_lock(&d->mutex);
+    if (d->urbCount == 0) {
+        mutex_unlock(&d->mutex);
+        return EAGAIN;
+    }
+    SimUrb u = d->urbs[d->urbHead];
+    d->urbHead = (d->urbHead + 1) % USBIO_BULK_REQUEST_QUEUE_SIZE;
+    d->urbCount--;
+    mutex_unlock(&d->mutex);
+    WaitUntil(u.due);
+    u.urb->bytes = u.bytes;
+    *urb = u.urb;
+    return u.error;
+}
+
+static int HostController (usbio_file_t file, char *name, int bytes) {
+    snprintf(name, bytes, "sim");
+    return DeviceOf(file) ? 0 : EBADF;
+}
+
+static const AmlUsbBackend SimBackend = {
+    "sim", Open, Count, OpenAt, Close, Control, BulkRead, BulkWrite, AllocBuffer, FreeBuffer, SubmitUrb,
+    DiscardUrb, ReapUrb, HostController,
+};
+
+static int ParseStage (const char *stage) {
+    return !strcmp(stage, "uboot") ? 16 : !strcmp(stage, "bl2") ? 8 : 0;
+}
+
+const AmlUsbBackend *AmlUsbSimBackend (const char *config) {
+    static bool initialized; // not in a static_init: callers may run from one before ours
+    if (!initialized) {
+        mutex_init(&DevicesMutex, 0);
+        initialized = true;
+    }
+    char option[64];
+    const char *next = config;
+    while (*next) {
+        size_t len = strcspn(next, ",");
+        snprintf(option, sizeof(option), "%.*s", (int)min(len, sizeof(option) - 1), next);
+        next += len + (next[len] == ',' ? 1 : 0);
+        char *value = strchr(option, '=');
+        if (value == nullptr) {
+            continue; // AML_USB_SIM=1: defaults
+        }
+        *value++ = 0;
+        if (!strcmp(option, "devices")) {
+            Config.devices = max(1, min(atoi(value), (int)AML_MAX_DEVICES));
+        } else if (!strcmp(option, "mbps")) {
+            Config.mbps = atof(value);
+        } else if (!strcmp(option, "latency")) {
+            Config.latency = atof(value);
+        } else if (!strcmp(option, "busy")) {
+            Config.busy = atoi(value);
+        } else if (!strcmp(option, "cmdbusy")) {
+            Config.cmdBusy = atoi(value);
+        } else if (!strcmp(option, "busyms")) {
+            Config.busyMs = atof(value);
+        } else if (!strcmp(option, "errors")) {
+            Config.errors = atof(value);
+        } else if (!strcmp(option, "seed")) {
+            Config.seed = (unsigned int)strtoul(value, nullptr, 0);
+        } else if (!strcmp(option, "stage")) {
+            Config.stage = ParseStage(value);
+        } else {
+            aml_printf("[AmlUsbSim]unknown option %s\n", option);
+        }
+    }
+    aml_printf("[AmlUsbSim]%d devices, %.1fMB/s, %.3fms latency, busy %d/%d x %.1fms,"
+        " errors %g, stage %d\n", Config.devices, Config.mbps, Config.latency, Config.busy,
+        Config.cmdBusy, Config.busyMs, Config.errors, Config.stage);
+    return &SimBackend;
+}
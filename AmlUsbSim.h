@@ -0,0 +1,22 @@
+#pragma once
+
+// In-process WorldCup device for running the transfer code without hardware (AmlLibusb backend,
+// see AmlUsbBackend). Enabled by AML_USB_SIM in the environment, a comma separated list:
+//   AML_USB_SIM=devices=2,mbps=40,latency=0.125,errors=0.001,stage=uboot
+// devices  simulated devices, all with the WorldCup VID/PID (1)
+// mbps     bulk bandwidth in MB/s shared by the transfers of one device, 0 unlimited (40)
+// latency  milliseconds from the end of a transfer until the host sees it complete, control
+//          transfers included; queued URBs overlap it (0.125)
+// busy     "Continue:32" replies before a media chunk is acknowledged with "OK!!" (1)
+// cmdbusy  "Continue:34" replies before a bulk command's "success" (1)
+// busyms   device time in milliseconds behind every "Continue" reply, e.g. an erase (0)
+// errors   probability that a transfer fails or a media chunk is refused (0)
+// seed     of the error injection, runs with the same seed fail the same transfers (1)
+// stage    rom, bl2 or uboot, what identify reports; RUN_ADDR moves rom -> bl2 -> uboot (rom)
+// The device keeps a sparse 4GB DRAM (large-mem, ctrl read/write, crc32, upload mem) and a
+// download session (WRITE_MEDIA chunks, get_status, verify sha1sum); media content is not
+// stored, upload store reads zeros. Device state lives as long as the process.
+
+struct AmlUsbBackend;
+
+const AmlUsbBackend *AmlUsbSimBackend(const char *config);
@@ -6,12 +6,37 @@
 #include "UsbRomDrv.h"
 #include "Amldbglog.h"
 #include "AmlTime.h"
+#include "AmlPoll.h"
+#include "AmlImage.h"
+#include "AmlUsbSim.h"
 #include "defs.h"
+#include "pozix.h"
 
 #pragma warning(disable: 4100) // unreferenced formal parameter
 
 namespace AmlUsbWriteLargeMem {
-    int WriteSeqNum = 0;
+    int WriteSeqNum = 0; // used when no device session is given
+    int QueueDepth = 8; // bulk OUT URBs kept in flight, 1 means one blocking write_bulk_usb() at a time
+    unsigned int BulkSize = 0x1000; // bytes per bulk OUT transfer, announced in the large-mem command
+
+    static int &SeqNum (AmlUsbDrv *drv) {
+        return drv->device ? drv->device->writeSeqNum : WriteSeqNum;
+    }
+
+    static int WriteQueued (AmlUsbDrv *drv, AmlUsbRomRW *rom, unsigned short checksum,
+        unsigned int *bufferPtr) {
+        unsigned int transferSize = min(rom->bufferLen, BulkSize);
+        unsigned int maxAllowedSize = min(rom->bufferLen, 0x10000u);
+        if (WriteLargeMemCMD(drv, rom->address, maxAllowedSize, transferSize, checksum,
+            SeqNum(drv)) == 0) {
+            return 0;
+        }
+        unsigned int transfers = 0;
+        int ret = usbWriteFileQueued(drv, rom->buffer, rom->bufferLen, transferSize, QueueDepth,
+            bufferPtr, &transfers);
+        SeqNum(drv) += transfers; // one sequence number per bulk transfer
+        return ret;
+    }
 
     int AmlUsbWriteLargeMem (AmlUsbRomRW *rom) {
         if (ValidParamDWORD(&rom->bufferLen) != 1) {
@@ -24,7 +49,7 @@ namespace AmlUsbWriteLargeMem {
             return -3;
         }
         struct AmlUsbDrv drv = {};
-        if (OpenUsbDevice(&drv) != 1) {
+        if (OpenUsbDevice(&drv, rom->device) != 1) {
             return -4;
         }
 
@@ -38,17 +63,27 @@ namespace AmlUsbWriteLargeMem {
             if (++retry == 4) {
                 break;
             }
+            bufferPtr = 0; // a retry re-sends the large-mem command and the whole buffer
+            startTransfer = -1;
+            if (QueueDepth > 1) {
+                if (WriteQueued(&drv, rom, checksum, &bufferPtr) == 1 && bufferPtr == rom->bufferLen) {
+                    break;
+                }
+                aml_printf("[AmlUsbWriteLargeMem]queued write failed at 0x%x/0x%x, try %d\n", bufferPtr,
+                    rom->bufferLen, retry);
+                continue;
+            }
             while (bufferRemain > 0) {
-                unsigned int transferSize = min(bufferRemain, 0x1000u);
+                unsigned int transferSize = min(bufferRemain, BulkSize);
                 if (startTransfer == -1) {
                     unsigned int maxAllowedSize = min(bufferRemain, 0x10000u);
                     if (WriteLargeMemCMD(&drv, rom->address, maxAllowedSize, transferSize, checksum,
-                        AmlUsbWriteLargeMem::WriteSeqNum) == 0) {
+                        SeqNum(&drv)) == 0) {
                         break;
                     }
                     startTransfer = maxAllowedSize;
                 }
-                ++AmlUsbWriteLargeMem::WriteSeqNum;
+                ++SeqNum(&drv);
                 int actual_len = write_bulk_usb(&drv, (char *)&rom->buffer[bufferPtr],
                     transferSize);
                 if (actual_len) {
@@ -76,7 +111,11 @@ namespace AmlUsbWriteLargeMem {
 }
 
 namespace AmlUsbReadLargeMem {
-    int ReadSeqNum = 0;
+    int ReadSeqNum = 0; // used when no device session is given
+
+    static int &SeqNum (AmlUsbDrv *drv) {
+        return drv->device ? drv->device->readSeqNum : ReadSeqNum;
+    }
 
     int AmlUsbReadLargeMem (AmlUsbRomRW *rom) {
         if (ValidParamDWORD(&rom->bufferLen) != 1) {
@@ -88,11 +127,11 @@ namespace AmlUsbReadLargeMem {
         if (ValidParamVOID(rom->buffer) != 1) {
             return -3;
         }
-        ++AmlUsbReadLargeMem::ReadSeqNum;
         struct AmlUsbDrv drv = {};
-        if (OpenUsbDevice(&drv) != 1) {
+        if (OpenUsbDevice(&drv, rom->device) != 1) {
             return -4;
         }
+        ++SeqNum(&drv);
         unsigned int bufferPtr = 0;
         int startTransfer = -1;
         int transferErrorCnt = 0;
@@ -108,7 +147,7 @@ namespace AmlUsbReadLargeMem {
                 if (startTransfer == -1) {
                     if (ReadLargeMemCMD(&drv, rom->address, rom->bufferLen,
                         transferSize >= 0x1000 ? 0x1000 : min(transferSize, 0x200u),
-                        checksum, AmlUsbReadLargeMem::ReadSeqNum) == 0) {
+                        checksum, SeqNum(&drv)) == 0) {
                         break;
                     }
                     startTransfer = transferSize;
@@ -139,9 +178,50 @@ namespace AmlUsbReadLargeMem {
 
 }
 
+namespace AmlUsbReadLargeMem {
+    int QueueDepth = 16; // bulk IN URBs (USBIO_BULK_REQUEST_SIZE each) submitted ahead by the stream mode
+    unsigned int SegmentSize = 0x400000; // bytes covered by one read large-mem command
+
+    // Streaming read of rom->bufferLen bytes from rom->address: the data is not stored in rom->buffer
+    // but handed to sink() in order, while further bulk IN URBs are already queued on the device.
+    int AmlUsbReadLargeMemStream (AmlUsbRomRW *rom,
+        int (*sink)(void *that, char *data, unsigned int bytes), void *that) {
+        if (ValidParamDWORD(&rom->bufferLen) != 1) {
+            return -1;
+        }
+        if (ValidParamHANDLE((void **)&rom->device) != 1) {
+            return -2;
+        }
+        struct AmlUsbDrv drv = {};
+        if (OpenUsbDevice(&drv, rom->device) != 1) {
+            return -4;
+        }
+        unsigned int bufferPtr = 0;
+        while (bufferPtr < rom->bufferLen) {
+            unsigned int segment = min(rom->bufferLen - bufferPtr, SegmentSize);
+            ++SeqNum(&drv);
+            if (ReadLargeMemCMD(&drv, rom->address + bufferPtr, segment,
+                segment >= 0x1000 ? 0x1000 : min(segment, 0x200u), 0,
+                SeqNum(&drv)) == 0) {
+                break;
+            }
+            unsigned int read = 0;
+            usbReadFileQueued(&drv, segment, QueueDepth, sink, that, &read);
+            bufferPtr += read;
+            if (read != segment) {
+                break;
+            }
+        }
+        CloseUsbDevice(&drv);
+        *rom->pDataSize = bufferPtr;
+        return rom->bufferLen == bufferPtr ? 0 : -6;
+    }
+
+}
+
 int AmlUsbReadMemCtr (AmlUsbRomRW *rom) {
     struct AmlUsbDrv drv = {};
-    if (OpenUsbDevice(&drv) == 0) {
+    if (OpenUsbDevice(&drv, rom->device) == 0) {
         return 0;
     }
 
@@ -164,7 +244,7 @@ int AmlUsbReadMemCtr (AmlUsbRomRW *rom) {
 
 int AmlUsbWriteMemCtr (AmlUsbRomRW *rom) {
     struct AmlUsbDrv drv = {};
-    if (OpenUsbDevice(&drv) == 0) {
+    if (OpenUsbDevice(&drv, rom->device) == 0) {
         return 0;
     }
 
@@ -187,7 +267,7 @@ int AmlUsbWriteMemCtr (AmlUsbRomRW *rom) {
 int AmlUsbRunBinCode (AmlUsbRomRW *rom) {
     struct AmlUsbDrv drv = {};
     aml_printf("AmlUsbRunBinCode:ram_addr=%08x\n", rom->address);
-    if (OpenUsbDevice(&drv) == 0) {
+    if (OpenUsbDevice(&drv, rom->device) == 0) {
         return -1;
     }
 
@@ -200,7 +280,7 @@ int AmlUsbRunBinCode (AmlUsbRomRW *rom) {
 int AmlUsbIdentifyHost (AmlUsbRomRW *rom) {
     struct AmlUsbDrv drv = {};
     aml_printf("AmlUsbIdentifyHost\n");
-    if (OpenUsbDevice(&drv) == 0) {
+    if (OpenUsbDevice(&drv, rom->device) == 0) {
         return -1;
     }
 
@@ -210,10 +290,35 @@ int AmlUsbIdentifyHost (AmlUsbRomRW *rom) {
     return ret == 1 ? 0 : -2;
 }
 
+// Largest rom->bufferLen one AmlUsbWriteLargeMem call is sent in, from the identify bytes
+// (id[0].id[1] protocol version, id[3] stage):
+//   stage 8 (bl2/SPL) or 16 (u-boot)       64KB, a full large-mem command in 4KB bulk transfers
+//   stage 0 (bl1 ROM), version 2.0 or later 64KB, the ROMs ReadChipId knows (gx and later)
+//   older ROMs, unknown stages, no answer   64 bytes, as older tools sent everything
+unsigned int AmlUsbLargeMemChunkSize (AmlUsbRomRW *rom) {
+    char id[16] = {};
+    unsigned int dataLen = 0;
+    AmlUsbRomRW probe = *rom;
+    probe.buffer = id;
+    probe.bufferLen = 4;
+    probe.pDataSize = &dataLen;
+    if (AmlUsbIdentifyHost(&probe) != 0 || dataLen < 4) {
+        aml_printf("[AmlUsbLargeMemChunkSize]identify failed, 64B chunks\n");
+        return 64;
+    }
+    int idVer = id[1] | (id[0] << 8);
+    bool large = id[3] == 8 || id[3] == 16 || (id[3] == 0 && idVer >= 0x200);
+    if (!large) {
+        aml_printf("[AmlUsbLargeMemChunkSize]identify %d-%d-%d-%d, 64B chunks\n", id[0], id[1], id[2],
+            id[3]);
+    }
+    return large ? 0x10000 : 64;
+}
+
 int AmlUsbTplCmd (AmlUsbRomRW *rom) {
     struct AmlUsbDrv drv = {};
     aml_printf("AmlUsbTplCmd = %s ", rom->buffer);
-    if (OpenUsbDevice(&drv) == 0) {
+    if (OpenUsbDevice(&drv, rom->device) == 0) {
         return -1;
     }
     int ret = usbDeviceIoControl(&drv, 0x80002040, rom->buffer, rom->bufferLen, nullptr, 0,
@@ -229,24 +334,31 @@ int AmlUsbburn (struct usb_device *device, const char *filename, unsigned int ad
         return -15;
     }
 
-    FILE *fp = fopen(filename, "rb");
-    if (!fp) {
+    AmlImage *image = AmlImageOpen(filename);
+    if (!image) {
+        return -25;
+    }
+    if (AmlImageSize(image) < 0) {
+        AmlImageClose(image);
         return -25;
     }
 
     AmlUsbRomRW rom = {};
     rom.device = device,
         rom.address = address;
-    char* buffer = (char *)malloc(bulkTransferSize);
-    fseek(fp, 0, 2);
+    // a mapped image is sent straight from the mapping
+    char *buffer = AmlImageMapped(image) ? nullptr : (char *)malloc(bulkTransferSize);
     int filePtr = 0;
     int ret = 0;
-    size_t len = (size_t)ftell(fp);
-    fseek(fp, 0, 0);
+    size_t len = (size_t)AmlImageSize(image);
     while (len) {
         size_t transferSize = min(len, bulkTransferSize);
-        fread(buffer, 1, transferSize, fp);
-        rom.buffer = buffer;
+        const char *data = nullptr;
+        if (AmlImageRead(image, buffer, (int)transferSize, &data) != (int)transferSize) {
+            ret = -26;
+            break;
+        }
+        rom.buffer = (char *)data;
         rom.bufferLen = (int)transferSize;
         unsigned int dataSize;
         rom.pDataSize = &dataSize;
@@ -257,21 +369,22 @@ int AmlUsbburn (struct usb_device *device, const char *filename, unsigned int ad
         len -= dataSize;
         rom.address += dataSize;
         filePtr += dataSize;
-        fseek(fp, filePtr, 0);
+        if (dataSize != transferSize && AmlImageSeek(image, filePtr) != 0) { // partial write: resend the rest
+            ret = -26;
+            break;
+        }
     }
     if (buffer) {
         free(buffer);
     }
-    if (fp) {
-        fclose(fp);
-    }
+    AmlImageClose(image);
     return ret ? ret : filePtr;
 }
 
 int AmlUsbReadStatus (AmlUsbRomRW *rom) {
     struct AmlUsbDrv drv = {};
     aml_printf("AmlUsbReadStatus ");
-    if (OpenUsbDevice(&drv) != 1) {
+    if (OpenUsbDevice(&drv, rom->device) != 1) {
         return -1;
     }
 
@@ -285,7 +398,7 @@ int AmlUsbReadStatus (AmlUsbRomRW *rom) {
 int AmlUsbReadStatusEx (AmlUsbRomRW *rom, unsigned int timeout) {
     struct AmlUsbDrv drv = {};
     aml_printf("AmlUsbReadStatus ");
-    if (OpenUsbDevice(&drv) != 1) {
+    if (OpenUsbDevice(&drv, rom->device) != 1) {
         return -1;
     }
 
@@ -301,7 +414,7 @@ int AmlResetDev (AmlUsbRomRW *rom) {
         return -1;
     }
     struct AmlUsbDrv drv = {};
-    if (OpenUsbDevice(&drv) != 1) { return 2; }
+    if (OpenUsbDevice(&drv, rom->device) != 1) { return 2; }
 
     aml_printf("reset worldcup device\n");
     int result = ResetDev(&drv);
@@ -328,8 +441,15 @@ int AmlSetFileCopyCompleteEx (AmlUsbRomRW *rom) {
 }
 
 int AmlWriteMedia (AmlUsbRomRW *rom) {
+    if (ValidParamVOID(rom->buffer) != 1) {
+        return -3;
+    }
+    return AmlWriteMediaEx(rom, checksum_64K(rom->buffer, rom->bufferLen));
+}
+
+// AmlWriteMedia with the checksum_64K() of rom->buffer already known (see AmlMediaRing)
+int AmlWriteMediaEx (AmlUsbRomRW *rom, unsigned int checksum) {
     int result = 0;
-    unsigned int checksum = 0;
     struct AmlUsbDrv drv = {};
     if (ValidParamDWORD(&rom->bufferLen) != 1) {
         return -1;
@@ -341,13 +461,11 @@ int AmlWriteMedia (AmlUsbRomRW *rom) {
         return -3;
     }
 
-    if (OpenUsbDevice(&drv) != 1) {
+    if (OpenUsbDevice(&drv, rom->device) != 1) {
         aml_printf("Open device failed\n");
         return -4;
     }
 
-    checksum = checksum_64K(rom->buffer, rom->bufferLen);
-
     for (int address = 0; address <= 2; ++address) {
         unsigned int want_write = min(rom->bufferLen, 0x10000u);
         unsigned int cmd = 16 * rom->address;
@@ -358,7 +476,9 @@ int AmlWriteMedia (AmlUsbRomRW *rom) {
             return -6;
         }
         unsigned int actual_len = 0;
+        double transferStart = time_in_milliseconds();
         int ret = usbWriteFile(&drv, rom->buffer, want_write, &actual_len);
+        AmlPollAddTransfer(AML_POLL_WRITE_MEDIA, time_in_milliseconds() - transferStart, actual_len);
         if (ret != 1) {
             aml_printf("usbReadFile failed ret=%d", ret);
             CloseUsbDevice(&drv);
@@ -372,8 +492,9 @@ int AmlWriteMedia (AmlUsbRomRW *rom) {
         }
         result = 0;
         unsigned char buf[512] = {};
-        for (time_t startTime = get_tick_count(), curTime = startTime;
-            curTime - startTime < 12 * 60 * 1000; curTime = get_tick_count()) {
+        AmlPoller poller;
+        AmlPollBegin(&poller, AML_POLL_WRITE_MEDIA, 500);
+        for (; AmlPollElapsed(&poller) < 12 * 60 * 1000; AmlPollWait(&poller)) {
             if (usbReadFile(&drv, buf, sizeof(buf), &actual_len) != 1) {
                 aml_printf("[AmlUsbRom]Err:");
                 aml_printf("usbReadFile failed ret=%d", 0);
@@ -391,8 +512,8 @@ int AmlWriteMedia (AmlUsbRomRW *rom) {
             if (strncmp((const char *)buf, strBusy, strLenBusy) != 0) {
                 break;
             }
-            usleep(500000);
         }
+        AmlPollEnd(&poller, result == 0);
         if (!result) {
             result = strncmp((const char *)buf, "OK!!", 4);
             if (result) {
@@ -423,7 +544,7 @@ int AmlReadMedia (AmlUsbRomRW *rom) {
         return -3;
     }
 
-    if (OpenUsbDevice(&drv) != 1) {
+    if (OpenUsbDevice(&drv, rom->device) != 1) {
         aml_printf("Open device failed\n");
         return -4;
     }
@@ -456,14 +577,17 @@ int AmlReadMedia (AmlUsbRomRW *rom) {
 int AmlUsbBulkCmd (AmlUsbRomRW *rom) {
     AmlUsbDrv drv = {};
     drv.read_ep = 2;
-    if (OpenUsbDevice(&drv) == 0) {
+    if (OpenUsbDevice(&drv, rom->device) == 0) {
         aml_printf("[AmlUsbRom]Err:");
         aml_printf("FAil in OpenUsbDevice\n");
         return -924;
     }
     aml_printf("AmlUsbBulkCmd[%s]\n", rom->buffer);
-    if (!usbDeviceIoControlEx(&drv, 0x80002050, rom->buffer, rom->bufferLen, nullptr, 0,
-        rom->pDataSize, nullptr, 5000)) {
+    double transferStart = time_in_milliseconds();
+    int sent = usbDeviceIoControlEx(&drv, 0x80002050, rom->buffer, rom->bufferLen, nullptr, 0,
+        rom->pDataSize, nullptr, 5000);
+    AmlPollAddTransfer(AML_POLL_BULK_CMD, time_in_milliseconds() - transferStart, rom->bufferLen);
+    if (!sent) {
         aml_printf("[AmlUsbRom]Err:");
         aml_printf("rettemp = %d buffer = [%s]\n", 0, rom->buffer);
         CloseUsbDevice(&drv);
@@ -471,8 +595,9 @@ int AmlUsbBulkCmd (AmlUsbRomRW *rom) {
     }
     char buf[512] = {};
     bool success = true;
-    for (time_t startTime = get_tick_count(), curTime = startTime;
-        curTime - startTime < 20 * 60 * 1000; curTime = get_tick_count()) {
+    AmlPoller poller;
+    AmlPollBegin(&poller, AML_POLL_BULK_CMD, 3000);
+    for (; AmlPollElapsed(&poller) < 20 * 60 * 1000; AmlPollWait(&poller)) {
         int ret = read_bulk_usb(&drv, buf, sizeof(buf));
         char strBusy[] = "Continue:34";
         size_t strLenBusy = strlen(strBusy);
@@ -485,11 +610,11 @@ int AmlUsbBulkCmd (AmlUsbRomRW *rom) {
         if (strncmp(buf, strBusy, strLenBusy) != 0) {
             break;
         }
-        usleep(3000000);
     }
     if (success) {
         success = strncmp(buf, "success", 7) == 0;
     }
+    AmlPollEnd(&poller, success);
     if (!success) {
         aml_printf("[AmlUsbRom]Err:");
         aml_printf("bulkInReply=[%s]\n", buf);
@@ -501,7 +626,7 @@ int AmlUsbBulkCmd (AmlUsbRomRW *rom) {
 int AmlUsbCtrlWr (AmlUsbRomRW *rom) {
     AmlUsbDrv drv = {};
     drv.read_ep = 2;
-    if (OpenUsbDevice(&drv) != 1) {
+    if (OpenUsbDevice(&drv, rom->device) != 1) {
         return -1;
     }
     int ret = usbDeviceIoControlEx(&drv, 0x80002004, rom->buffer, rom->bufferLen, nullptr,
@@ -634,48 +759,6 @@ int read_usb_status (void *addr, char *buf, size_t len) {
     return -1;
 }
 
-unsigned short checksum_add (unsigned short *buf, int len, int noFlip) {
-    unsigned int checksum = 0;
-
-    for (; len > 1; len -= 2) {
-        checksum += le16toh(*buf);
-        ++buf;
-    }
-    if (len) {
-        checksum += *(unsigned char *)buf;
-    }
-    checksum = (checksum >> 16) + (unsigned short)checksum;
-    checksum = (checksum >> 16) + (unsigned short)checksum;
-    if (!noFlip) {
-        checksum = ~checksum;
-    }
-    return (unsigned short)checksum;
-}
-
-unsigned int checksum_64K (void *buf, int len) {
-    unsigned int checksum = 0;
-
-    // process an int every time
-    for (int div = len >> 2; div >= 0; div--) {
-        checksum += le32toh(*(unsigned int *)buf);
-        buf = (char *)buf + 4;
-    }
-    switch (len & 3) {
-    case 1:
-        checksum += *(unsigned char *)buf;
-        break;
-    case 2:
-        checksum += le16toh(*(unsigned short *)buf);
-        break;
-    case 3:
-        checksum += le32toh(*(unsigned int *)buf) & 0xFFFFFF;
-        break;
-    default:
-        break;
-    }
-    return checksum;
-}
-
 unsigned short originale_add (unsigned short *buf, int len) {
     return checksum_add(buf, len, 1);
 }
@@ -712,3 +795,64 @@ int AmlUsbBurnWrite (AmlUsbRomRW *cmd, char *memType, unsigned long long nBytes,
     }
     return ret;
 }
+
+#ifdef USBROMDRV_SMOKE_TEST // change to #ifndef to run
+
+// Before/after comparison of AmlUsbWriteLargeMem: blocking 4KB writes (QueueDepth = 1)
+// versus pipelined bulk OUT URBs. Loads 8MB into scratch DRAM in 64KB pieces like
+// AmlUsbBurnWrite() does and reads it back. Runs against the simulated device of AmlUsbSim.h
+// (40MB/s, 0.125ms per transfer, AML_USB_SIM options override) so the numbers are reproducible.
+
+static double write_large_mem_mbps (int depth, char *data, unsigned int bytes) {
+    int saved = AmlUsbWriteLargeMem::QueueDepth;
+    AmlUsbWriteLargeMem::QueueDepth = depth;
+    AmlUsbRomRW rom = {};
+    unsigned int dataSize = 0;
+    rom.pDataSize = &dataSize;
+    double time = time_in_milliseconds();
+    for (unsigned int offset = 0; offset < bytes; offset += 0x10000) {
+        rom.address = 0x1080000 + offset;
+        rom.buffer = data + offset;
+        rom.bufferLen = min(bytes - offset, 0x10000u);
+        if (AmlUsbWriteLargeMem::AmlUsbWriteLargeMem(&rom) != 0) {
+            aml_printf("QueueDepth=%d failed at offset 0x%x\n", depth, offset);
+            break;
+        }
+    }
+    time = time_in_milliseconds() - time;
+    AmlUsbWriteLargeMem::QueueDepth = saved;
+    return bytes / (1024.0 * 1024.0) / (time / 1000.0);
+}
+
+static bool read_back_matches (const char *data, unsigned int bytes) {
+    char *back = (char *)malloc(bytes);
+    AmlUsbRomRW rom = {};
+    unsigned int dataSize = 0;
+    rom.pDataSize = &dataSize;
+    rom.address = 0x1080000;
+    rom.buffer = back;
+    rom.bufferLen = bytes;
+    bool match = back && AmlUsbReadLargeMem::AmlUsbReadLargeMem(&rom) == 0 && memcmp(back, data, bytes) == 0;
+    free(back);
+    return match;
+}
+
+static_init(usbromdrv_smoke_test) {
+    const char *sim = getenv("AML_USB_SIM");
+    char config[256];
+    snprintf(config, sizeof(config), "mbps=40,latency=0.125,%s", sim ? sim : "");
+    AmlUsbSetBackend(AmlUsbSimBackend(config));
+    const unsigned int bytes = 8 * 1024 * 1024;
+    char *data = (char *)malloc(bytes);
+    for (int depth = 1; depth <= 32; depth *= 2) {
+        for (unsigned int i = 0; i < bytes; i++) {
+            data[i] = (char)(i * 7 + depth);
+        }
+        double mbps = write_large_mem_mbps(depth, data, bytes);
+        aml_printf("AmlUsbWriteLargeMem QueueDepth=%2d %.1f MB/s %s\n", depth, mbps,
+            read_back_matches(data, bytes) ? "read back OK" : "read back MISMATCH");
+    }
+    free(data);
+}
+
+#endif
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "AmlLibusb.h"
+#include "AmlChecksum.h"
 
 struct AmlUsbRomRW {
     struct usb_device *device;
@@ -11,17 +12,24 @@ struct AmlUsbRomRW {
 };
 
 namespace AmlUsbWriteLargeMem {
+    extern int QueueDepth;
+    extern unsigned int BulkSize;
     int AmlUsbWriteLargeMem (AmlUsbRomRW *rom);
 }
 
 namespace AmlUsbReadLargeMem {
+    extern int QueueDepth;
+    extern unsigned int SegmentSize;
     int AmlUsbReadLargeMem (AmlUsbRomRW *rom);
+    int AmlUsbReadLargeMemStream (AmlUsbRomRW *rom,
+        int (*sink)(void *that, char *data, unsigned int bytes), void *that);
 }
 
 int AmlUsbReadMemCtr (AmlUsbRomRW *rom);
 int AmlUsbWriteMemCtr (AmlUsbRomRW *rom);
 int AmlUsbRunBinCode (AmlUsbRomRW *rom);
 int AmlUsbIdentifyHost (AmlUsbRomRW *rom);
+unsigned int AmlUsbLargeMemChunkSize (AmlUsbRomRW *rom);
 int AmlUsbTplCmd (AmlUsbRomRW *rom);
 int AmlUsbburn (struct usb_device *device, const char *filename, unsigned int address,
     const char *memType, int nBytes, size_t bulkTransferSize, int checksum);
@@ -32,6 +40,7 @@ int AmlSetFileCopyComplete (AmlUsbRomRW *rom);
 int AmlGetUpdateComplete (AmlUsbRomRW *rom);
 int AmlSetFileCopyCompleteEx (AmlUsbRomRW *rom);
 int AmlWriteMedia (AmlUsbRomRW *rom);
+int AmlWriteMediaEx (AmlUsbRomRW *rom, unsigned int checksum);
 int AmlReadMedia (AmlUsbRomRW *rom);
 int AmlUsbBulkCmd (AmlUsbRomRW *rom);
 int AmlUsbCtrlWr (AmlUsbRomRW *rom);
@@ -60,8 +69,6 @@ int rw_ctrl_usb (AmlUsbDrv *drv, unsigned long ctrl, char *buf, unsigned long le
 int write_control_usb (AmlUsbDrv *drv, unsigned long ctrl, char *buf, unsigned long len);
 int read_control_usb (AmlUsbDrv *drv, unsigned long ctrl, char *buf, unsigned long len);
 int read_usb_status (void *addr, char *buf, size_t len);
-unsigned short checksum_add (unsigned short *buf, int len, int noFlip);
-unsigned int checksum_64K (void *buf, int len);
 unsigned short originale_add (unsigned short *buf, int len);
 unsigned short checksum (unsigned short *buf, int len);
 int AmlUsbBurnWrite (AmlUsbRomRW *cmd, char *memType, unsigned long long nBytes,
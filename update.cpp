@@ -4,6 +4,16 @@
 #include "AmlUsbScanX3.h"
 #include "UsbRomDrv.h"
 #include "AmlUsbScan.h"
+#include "AmlThreadPool.h"
+#include "AmlMediaRing.h"
+#include "AmlSha1.h"
+#include "AmlImage.h"
+#include "AmlSparse.h"
+#include "AmlDecompress.h"
+#include "AmlCrc32.h"
+#include "AmlUsbProfile.h"
+#include "AmlUsbReplay.h"
+#include "AmlPoll.h"
 #include "defs.h"
 #include <conio.h>
 
@@ -116,7 +126,10 @@ int update_help () {
     puts("update <mread>    : Dump a data from media or memory to pc and save as a file");
     puts("update <tplcmd>   : like bulkcmd");
     puts("update <bulkcmd>  : pass and exec a command platform bootloader can support");
-    puts("update <write>    : Down a file to memory");
+    puts("update <script>   : Run update commands from a file (or - for stdin) over one device session");
+    puts("update <flash-plan>: Burn the partitions of a manifest, preparing each image during the previous one");
+    puts("update <gzpartition>: Burn a partition with a gzip image expanded by u-boot");
+    puts("update <write>    : Down a file to memory (write/boot/cwr/write2; boot/cwr/write2 ... --verify=crc checks it by crc32)");
     puts("update <run>      : Run code from memory address");
     puts("update <read>     : Dump data from memory:");
     puts("update <wreg>     : set one 32bits reg:");
@@ -124,14 +137,45 @@ int update_help () {
     puts("update <password> : unlock chip:");
     puts("update <chipinfo> : get chip info at page index:");
     puts("update <chipid>   : get chip id");
+    puts("\n[device name]: devN (N-th device), path-<name> (see 'update scan') or devall (every attached device in parallel)");
+    puts("\t\te.g.--\tupdate partition devall boot z:\\a\\b\\boot.img //burn boot on all boards at once");
     puts("\nCommon Commands format:");
-    puts("update partition partName imgFilePath [imgFileFmt] [sha1VeryFile]");
+    puts("update partition partName imgFilePath [imgFileFmt] [sha1VeryFile|auto]");
+    puts("\timgFileFmt: normal, sparse, ubifs, tosparse (raw image sent as Android sparse),"
+        " tosparse-skipzero (same, all-zero blocks are not written and keep the partition's old"
+        " data) or delta (raw image, only regions whose CRC32 differs from"
+        " the partition's are written)");
+    puts("\timgFilePath may be gzip, xz, zstd or lz4 compressed: it is decompressed while it is sent"
+        " (needs the gzip/xz/zstd/lz4 tool on PATH)");
     puts(
         "\t\te.g.--\tupdate partition boot z:\\a\\b\\boot.img [normal] //format normal is optional");
     puts(
         "\t\te.g.--\tupdate partition system z:\\xxxx\\system.img [sparse] //format sparse is optional");
+    puts(
+        "\t\te.g.--\tupdate partition boot z:\\a\\b\\boot.img normal auto //verify with sha1 computed while downloading");
+    puts(
+        "\t\te.g.--\tupdate partition system z:\\xxxx\\system.img sparse --resume //continue a failed transfer from the last acknowledged chunk");
     puts(
         "\t\te.g.--\tupdate partition upgrade z:\\xxxx\\upgrade.ubifs.img ubifs //format ubifs is MANDATORY");
+    puts("\nupdate gzpartition partName|mmc:<dev>[:<byteOffset>] imgFile.gz [loadAddr] [expandAddr]");
+    puts("\t\te.g.--\tupdate gzpartition boot z:\\a\\b\\boot.img.gz //u-boot unzip + store write");
+    puts("\t\te.g.--\tupdate gzpartition mmc:1:0x2400000 z:\\a\\b\\system.img.gz //u-boot gzwrite");
+    puts("\nupdate flash-plan manifestFile //lines of: partName imgFilePath [imgFileFmt] [sha1VeryFile|auto]");
+    puts("\nupdate tune [devN|path-xxx] [dramAddr] [bytes]");
+    puts("\t\tmeasure bulk size / queue depth / read segment size against DRAM (0x10000000, 16M),");
+    puts("\t\tthe fastest are saved in ~/.amlupdate-profile and used by later runs on that port and SoC");
+    puts("\nupdate bench [devN|path-xxx] [dramAddr] [bytes] [roundTrips]");
+    puts("\t\tMB/s and p50/p99 latency of control, large-mem and tplcmd round trips and of opening the device");
+    puts("\nAML_USB_SIM=devices=2,mbps=40,latency=0.125,busy=1,busyms=0,errors=0,stage=rom update ...");
+    puts("\t\truns any command against simulated devices instead of USB (options in AmlUsbSim.h)");
+    puts("\nAML_USB_CAPTURE=captureFile update ...");
+    puts("\t\tlogs every USB transfer: setup packet, size, payload hash and time (AmlUsbCapture.h)");
+    puts("\nupdate replay captureFile [speed]");
+    puts("\t\tplays a capture against simulated devices (AML_USB_SIM options apply) at the recorded");
+    puts("\t\tspeed, speed times faster, or back to back with 0; compares sizes, errors and timing");
+    puts("\nupdate script [devN|path-xxx] recipeFile|-");
+    puts("\t\tone command per line as after 'update' (e.g. bulkcmd \"disk_initial 0\"), # comments,");
+    puts("\t\t'reopen [seconds]' waits for the device after it re-enumerates; stops at the first failure");
     puts("\nupdate bulkcmd \"burning cmd or u-boot cmd\"");
     puts(
         "\t\te.g.--\tupdate bulkcmd \"disk_intial 0\" //cmd to init flash for usb burning");
@@ -201,30 +245,222 @@ finish:
     return result;
 }
 
-int do_cmd_mwrtie(const char **argv, signed int argc, AmlUsbRomRW &rom) {
+// "tosparse" writes all-zero blocks as FILL chunks, "tosparse-skipzero" leaves them out (DONT_CARE)
+static bool IsToSparse (const char *fileType) {
+    return fileType && (!strcmp(fileType, "tosparse") || !strcmp(fileType, "tosparse-skipzero"));
+}
+
+// Image for mwrite. Format "tosparse" encodes a raw image as Android sparse while it is sent
+// (an image that already is sparse is sent as is), the download format is "sparse" then.
+// Compressed images are decompressed on the way, see AmlDecompress.h.
+static AmlImage *OpenMediaImage (const char *filename, const char *fileType) {
+    if (!IsToSparse(fileType) || is_file_format_sparse(filename)) {
+        return AmlImageOpenDecompressed(filename);
+    }
+    AmlSparseStats stats = {};
+    time_t start = timeGetTime();
+    AmlImage *image = AmlImageOpenSparse(filename, !strcmp(fileType, "tosparse-skipzero"), &stats);
+    if (image) {
+        aml_printf("[update]sparse encoded 0x%llx -> 0x%llx bytes (%.1f%%) in %dms, %u chunks:"
+            " %u raw, %u fill, %u dont care blocks\n", stats.rawSize, stats.encodedSize,
+            stats.rawSize ? 100.0 * stats.encodedSize / stats.rawSize : 100.0,
+            (int)(timeGetTime() - start), stats.chunks, stats.rawBlocks, stats.fillBlocks,
+            stats.dontCareBlocks);
+    }
+    return image;
+}
+
+static void SparseCheckFailed (void *that) {
+    AmlMediaRingAbort((AmlMediaRing *)that, EBADMSG);
+}
+
+// Sparse images are parsed before anything is sent, so a malformed one is rejected right away,
+// and their CRC32 chunks are verified on all cores while the image is sent: a mismatch aborts
+// the transfer through the ring. Returns -1 if the image is malformed.
+static int StartSparseCheck (const char *filename, const char *fileType, AmlMediaRing *ring,
+    AmlSparseCheck **check) {
+    *check = nullptr;
+    if (!fileType || (strcmp(fileType, "sparse") &&
+        (!IsToSparse(fileType) || !is_file_format_sparse(filename)))) {
+        return 0; // not sparse, or encoded here
+    }
+    if (AmlCompressionDetect(filename) != AML_COMPRESSION_NONE) {
+        aml_printf("[update]%s is compressed, its CRC32 chunks are not checked on the host\n",
+            filename);
+        return 0; // the check needs random access to the sparse image
+    }
+    AmlSparseInfo info = {};
+    *check = AmlSparseCheckStart(filename, &info, SparseCheckFailed, ring);
+    if (*check == nullptr) {
+        aml_printf("[update]ERR: %s is not a valid sparse image\n", filename);
+        return -1;
+    }
+    aml_printf("[update]sparse image: %u chunks (%u raw, %u fill, %u dont care, %u crc32),"
+        " expands 0x%llx -> 0x%llx bytes (ratio %.2f)\n", info.chunks, info.rawChunks,
+        info.fillChunks, info.dontCareChunks, info.crcChunks, info.fileSize, info.expandedSize,
+        info.fileSize ? (double)info.expandedSize / info.fileSize : 0.0);
+    return 0;
+}
+
+// 64KB chunks read (and checksummed) ahead of the one on the bus by the AmlMediaRing thread
+static int PrefetchSlots = 8;
+
+// mwrite --resume: when a transfer fails, the chunks the device acknowledged are recorded in
+// <TMPDIR>/update-dev<N>-<store|mem>-<partition>.resume with the device and the CRC32 of the
+// image they cover. A later --resume checks that it talks to the same device and that the image
+// still starts with those bytes and, without a new download command, sends the rest to the
+// download session the device still has open.
+static void ResumeCheckpointPath (char *path, size_t size, AmlUsbRomRW &rom,
+    const char *storeOrMem, const char *partition) {
+    const char *dir = getenv("TMPDIR");
+    dir = dir ? dir : getenv("TEMP");
+    snprintf(path, size, "%s/update-dev%d-%s-%s.resume", dir ? dir : "/tmp",
+        rom.device ? rom.device->index : 0, storeOrMem, partition);
+}
+
+// The device the download session is open on: devN and the host controller it is attached to.
+// Nothing is sent to the device, it is in the middle of a download.
+static void ResumeDeviceId (AmlUsbRomRW &rom, char *id, size_t size) {
+    char controller[128] = "host";
+    AmlUsbDrv drv = {};
+    if (OpenUsbDevice(&drv, rom.device) == 1) {
+        if (AmlUsbGetBackend()->hostController(drv.handle, controller, sizeof(controller)) != 0) {
+            snprintf(controller, sizeof(controller), "host");
+        }
+        CloseUsbDevice(&drv);
+    }
+    snprintf(id, size, "dev%d %s", rom.device ? rom.device->index : 0, controller);
+}
+
+static bool LoadResumeCheckpoint (const char *path, const char *readFile, const char *deviceId,
+    long long fileSize, WriteMediaCheckpoint *checkpoint) {
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        return false;
+    }
+    char image[512] = {};
+    char device[256] = {};
+    long long size = -1;
+    bool loaded = fscanf(fp, "image %511[^\n]\ndevice %255[^\n]\nsize %lli\nchunk %u\ncrc32 %x",
+        image, device, &size, &checkpoint->nextChunk, &checkpoint->crc) == 5;
+    fclose(fp);
+    if (loaded && strcmp(device, deviceId)) {
+        aml_printf("[update]ERR: the transfer to resume was made to %s, this is %s\n", device,
+            deviceId);
+        return false;
+    }
+    return loaded && !strcmp(image, readFile) && size == fileSize &&
+        (long long)checkpoint->nextChunk * AML_MEDIA_CHUNK_SIZE < fileSize;
+}
+
+static void SaveResumeCheckpoint (const char *path, const char *readFile, const char *deviceId,
+    long long fileSize, const WriteMediaCheckpoint *checkpoint) {
+    FILE *fp = fopen(path, "w");
+    if (fp) {
+        fprintf(fp, "image %s\ndevice %s\nsize 0x%llx\nchunk %u\ncrc32 %08x\n", readFile,
+            deviceId, fileSize, checkpoint->nextChunk, checkpoint->crc);
+        fclose(fp);
+    }
+}
+
+// CRC32 of the first len bytes of image, which is left positioned after them
+static int ImagePrefixCrc (AmlImage *image, long long len, unsigned int *crc) {
+    char *buffer = AmlImageMapped(image) ? nullptr : (char *)malloc(AML_MEDIA_CHUNK_SIZE);
+    int result = 0;
+    *crc = 0;
+    for (long long offset = 0; result == 0 && offset < len;) {
+        int n = (int)min(len - offset, (long long)AML_MEDIA_CHUNK_SIZE);
+        const char *data = nullptr;
+        result = AmlImageRead(image, buffer, n, &data) == n ? 0 : -1;
+        *crc = result == 0 ? AmlCrc32(*crc, data, (size_t)n) : *crc;
+        offset += n;
+    }
+    free(buffer);
+    return result;
+}
+
+// ring: image is fed from a broadcast AmlMediaRing shared with other devices instead of read here
+int do_cmd_mwrtie(const char **argv, signed int argc, AmlUsbRomRW &rom, AmlMediaRing *ring,
+    int consumer) {
     int result = -229;
+    bool resume = argc > 4 && !strcmp(argv[argc - 1], "--resume");
+    argc -= resume ? 1 : 0;
     const char *readFile = argv[0];
     const char *storeOrMem = argv[1];
     const char *partition = argv[2];
     const char *fileType = argv[3];
     const char *verifyFile = argc <= 4 ? nullptr : argv[4];
+    WriteMediaCheckpoint checkpoint = {};
+    unsigned int resumedAt = 0;
+    char checkpointPath[512] = {};
+    char deviceId[256] = {};
+    bool verifyAuto = verifyFile && !strcmp(verifyFile, "auto");
+    unsigned char sha1[AML_SHA1_DIGEST_SIZE] = {};
     int retry; // [rsp+20h] [rbp-E0h]
+    int written;
+    AmlPoller poller;
     off_t fileSize;
     unsigned int dataSize; // [rsp+30h] [rbp-D0h]fp; // [rsp+38h] [rbp-C8h]
     char buffer[128] = {};
-    FILE *fp = fopen(readFile, "rb");
-    if (!fp) {
-        aml_printf("Open file %s failed\n", readFile);
-        goto finish;
+    FILE *fp = nullptr;
+    AmlMediaRing *localRing = nullptr;
+    AmlSparseCheck *sparseCheck = nullptr;
+    if (!ring) {
+        AmlImage *image = OpenMediaImage(readFile, fileType);
+        if (!image) {
+            goto finish;
+        }
+        if (AmlImageSize(image) < 0) {
+            aml_printf("size of %s unknown, mwrite needs a seekable file\n", readFile);
+            AmlImageClose(image);
+            goto finish;
+        }
+        ResumeCheckpointPath(checkpointPath, sizeof(checkpointPath), rom, storeOrMem, partition);
+        ResumeDeviceId(rom, deviceId, sizeof(deviceId));
+        if (resume) {
+            unsigned int crc = 0;
+            if (!LoadResumeCheckpoint(checkpointPath, readFile, deviceId, AmlImageSize(image),
+                &checkpoint) ||
+                ImagePrefixCrc(image, (long long)checkpoint.nextChunk * AML_MEDIA_CHUNK_SIZE,
+                    &crc) != 0 || crc != checkpoint.crc) {
+                aml_printf("[update]ERR: no transfer of %s to resume (or the image changed)\n",
+                    readFile);
+                AmlImageClose(image);
+                result = -253;
+                goto finish;
+            }
+            aml_printf("[update]resuming at chunk %u (0x%llx of 0x%llx bytes acknowledged)\n",
+                checkpoint.nextChunk, (long long)checkpoint.nextChunk * AML_MEDIA_CHUNK_SIZE,
+                AmlImageSize(image));
+        }
+        // reading starts while the device prepares for the download
+        localRing = AmlMediaRingOpenImage(image, 1, PrefetchSlots, verifyAuto);
+        if (!localRing) {
+            goto finish;
+        }
+        ring = localRing;
+        if (StartSparseCheck(readFile, fileType, ring, &sparseCheck) != 0) {
+            result = -251;
+            goto finish;
+        }
+    }
+    fileSize = AmlMediaRingSize(ring);
+    if (IsToSparse(fileType)) {
+        fileType = "sparse";
     }
-    fseeko64(fp, 0, 2);
-    fileSize = ftello(fp);
-    fclose(fp);
-    fp = nullptr;
     aml_printf("file size is 0x%llx\n", fileSize);
     if (!fileSize) {
         aml_printf("file size 0!!\n");
-        return -252;
+        result = -252;
+        goto finish;
+    }
+
+    if (resume) {
+        if (!localRing) {
+            aml_printf("[update]ERR: --resume works with one device\n");
+            goto finish;
+        }
+        goto transfer; // the device still has the download session
     }
 
     snprintf((char *)buffer, sizeof(buffer), "download %s %s %s 0x%llx", storeOrMem,
@@ -239,6 +475,7 @@ int do_cmd_mwrtie(const char **argv, signed int argc, AmlUsbRomRW &rom) {
 
     retry = 1;
     memset(buffer, 0, 0x80);
+    AmlPollBegin(&poller, AML_POLL_STATUS, 1000);
     while (retry) {
         rom.buffer = buffer;
         rom.bufferLen = 64;
@@ -246,23 +483,51 @@ int do_cmd_mwrtie(const char **argv, signed int argc, AmlUsbRomRW &rom) {
         if (!(unsigned int)AmlUsbReadStatus(&rom)) {
             break;
         }
-        usleep(1000000);
-        --retry;
+        if (AmlPollElapsed(&poller) >= 1000) { // same 1 second budget, polled adaptively
+            --retry;
+        } else {
+            AmlPollWait(&poller);
+        }
     }
+    AmlPollEnd(&poller, retry != 0);
     if (!retry) {
         aml_printf("Read status failed\n");
         result = -292;
         goto finish;
     }
 
-    if (strncmp((const char *)&rom.buffer, "success", 7) != 0) {
+    if (strncmp((const char *)rom.buffer, "success", 7) != 0) {
         aml_printf("[update]ERR(L%d):", 298);
         aml_printf("cmdret=[%s]\n", rom.buffer);
         result = -299;
         goto finish;
     }
 
-    if (WriteMediaFile(&rom, readFile) != 0) {
+transfer:
+    resumedAt = checkpoint.nextChunk;
+    written = WriteMediaRing(&rom, ring, consumer, localRing != nullptr,
+        localRing ? &checkpoint : nullptr);
+    if (localRing && written != 0 && checkpoint.nextChunk > resumedAt) {
+        SaveResumeCheckpoint(checkpointPath, readFile, deviceId, fileSize, &checkpoint);
+        aml_printf("[update]%u chunks acknowledged, add --resume to continue from there\n",
+            checkpoint.nextChunk);
+    } else if (localRing) {
+        if (resume && written != 0) {
+            aml_printf("[update]the device no longer has the download session, run again"
+                " without --resume\n");
+        }
+        remove(checkpointPath);
+    }
+    if (sparseCheck) {
+        int crcResult = AmlSparseCheckFinish(sparseCheck);
+        sparseCheck = nullptr;
+        if (crcResult != 0) {
+            aml_printf("[update]ERR: %s failed CRC32 validation\n", readFile);
+            result = -305;
+            goto finish;
+        }
+    }
+    if (written != 0) {
         aml_printf("ERR:write data to media failed\n");
         result = -306;
         goto finish;
@@ -287,16 +552,26 @@ int do_cmd_mwrtie(const char **argv, signed int argc, AmlUsbRomRW &rom) {
     }
 
     memset(buffer, 0, 0x80);
-    fp = fopen(verifyFile, "rb");
-    if (!fp) {
-        aml_printf("Open file %s failed\n", verifyFile);
-        goto finish;
+    if (verifyAuto) {
+        // digest of the data just sent, computed by the reader in the same pass as the checksums
+        if (!AmlMediaRingDigest(ring, sha1)) {
+            aml_printf("[update]ERR(L%d):", 333);
+            aml_printf("image sha1 not available\n");
+            goto finish;
+        }
+        strcpy(buffer, "verify sha1sum ");
+        AmlSha1Hex(sha1, &buffer[15]);
+    } else {
+        fp = fopen(verifyFile, "rb");
+        if (!fp) {
+            aml_printf("Open file %s failed\n", verifyFile);
+            goto finish;
+        }
+        strcpy(buffer, "verify ");
+        fread(&buffer[7], 1, 0x79, fp);
+        fclose(fp);
+        fp = nullptr;
     }
-
-    strcpy(buffer, "verify ");
-    fread(&buffer[7], 1, 0x79, fp);
-    fclose(fp);
-    fp = nullptr;
     buffer[66] = 1;
     rom.buffer = buffer;
     rom.bufferLen = 68;
@@ -306,15 +581,15 @@ int do_cmd_mwrtie(const char **argv, signed int argc, AmlUsbRomRW &rom) {
         result = -346;
         goto finish;
     }
-
+    result = 0;
+    aml_printf("[update]mwrite and verify success\n");
 
 finish:
     if (fp) {
         fclose(fp);
     }
-    if (rom.device) {
-        rom.device = nullptr;
-    }
+    AmlSparseCheckFinish(sparseCheck); // before the ring it may abort goes away
+    AmlMediaRingClose(localRing);
     return result;
 }
 
@@ -493,8 +768,136 @@ finish:;
     return result;
 }
 
+static int SendBulkCmd (AmlUsbRomRW &rom, const char *cmd) {
+    char buffer[128] = {};
+    unsigned int dataSize = 0;
+    if (strlen(cmd) > 64) {
+        aml_printf("[update]ERR: bulkcmd [%s] longer than 64 bytes\n", cmd);
+        return -1;
+    }
+    strcpy(buffer, cmd);
+    buffer[66] = 1;
+    rom.buffer = buffer;
+    rom.bufferLen = 68;
+    rom.pDataSize = &dataSize;
+    return AmlUsbBulkCmd(&rom); // waits out "Continue:34" while u-boot is busy
+}
+
+// `upload mem` of size bytes at address into `to`
+static int UploadMemory (AmlUsbRomRW &rom, unsigned int address, char *to, unsigned int size) {
+    char cmd[64];
+    snprintf(cmd, sizeof(cmd), "upload mem 0x%x normal 0x%x", address, size);
+    if (SendBulkCmd(rom, cmd) != 0) {
+        return -1;
+    }
+    for (unsigned int done = 0; done < size;) {
+        unsigned int dataSize = 0;
+        rom.buffer = to + done;
+        rom.bufferLen = min(size - done, 0x10000u);
+        rom.pDataSize = &dataSize;
+        if (AmlReadMedia(&rom) != 0 || dataSize == 0) {
+            return -1;
+        }
+        done += dataSize;
+    }
+    return 0;
+}
+
+// u-boot `crc32 <addr> <len> <store>` stores the result big-endian, some vendor trees in native
+// order: either matches
+static bool StoredCrcMatches (const unsigned char stored[4], unsigned int crc) {
+    unsigned int be = (unsigned int)stored[0] << 24 | stored[1] << 16 | stored[2] << 8 | stored[3];
+    unsigned int le = (unsigned int)stored[3] << 24 | stored[2] << 16 | stored[1] << 8 | stored[0];
+    return crc == be || crc == le;
+}
+
+// u-boot keeps the result of `cwr ... --verify=crc` here (moved past the blob if it overlaps)
+static unsigned int VerifyCrcAddress = 0x0F000000;
+
+static int crc_sink (void *that, char *data, unsigned int bytes) {
+    *(unsigned int *)that = AmlCrc32(*(unsigned int *)that, data, bytes);
+    return 0;
+}
+
+// 0 if DRAM [address, address + len) has CRC32 crc. u-boot checksums it with `crc32` and only the
+// 4 byte result comes back; ROM and bl2 have no such command, so the blob is read back instead.
+static int VerifyMemoryCrc (AmlUsbRomRW &rom, unsigned int address, unsigned int len, unsigned int crc) {
+    char id[16] = {};
+    unsigned int dataLen = 0;
+    double start = time_in_milliseconds();
+    rom.buffer = id;
+    rom.bufferLen = 4;
+    rom.pDataSize = &dataLen;
+    bool uboot = AmlUsbIdentifyHost(&rom) == 0 && id[3] != 0 && id[3] != 8;
+    bool match = false;
+    if (uboot) {
+        unsigned int store = VerifyCrcAddress;
+        if (store < address + len && store + 4 > address) {
+            store = (address + len + 63) & ~63u;
+        }
+        char cmd[64];
+        unsigned char stored[4] = {};
+        snprintf(cmd, sizeof(cmd), "crc32 0x%x 0x%x 0x%x", address, len, store);
+        if (SendBulkCmd(rom, cmd) != 0 || UploadMemory(rom, store, (char *)stored, 4) != 0) {
+            aml_printf("[update]ERR: crc32 on the device failed\n");
+            return -1;
+        }
+        match = StoredCrcMatches(stored, crc);
+    } else {
+        unsigned int readCrc = 0;
+        rom.address = address;
+        rom.buffer = nullptr;
+        rom.bufferLen = len;
+        rom.pDataSize = &dataLen;
+        if (AmlUsbReadLargeMem::AmlUsbReadLargeMemStream(&rom, crc_sink, &readCrc) != 0) {
+            aml_printf("[update]ERR: read back 0x%x failed\n", address);
+            return -1;
+        }
+        match = readCrc == crc;
+    }
+    aml_printf("[update]crc32 0x%08x %s by %s in %.0fms\n", crc, match ? "verified" : "MISMATCH",
+        uboot ? "u-boot" : "read back", time_in_milliseconds() - start);
+    return match ? 0 : -1;
+}
+
+struct DumpSink {
+    FILE *fp;
+    const char *filename;
+    unsigned int address;
+    DownloadProgressInfo *info;
+};
+
+static int dump_sink (void *that, char *data, unsigned int bytes) {
+    DumpSink *sink = (DumpSink *)that;
+    if (sink->fp) {
+        unsigned int written = (unsigned int)fwrite(data, 1, bytes, sink->fp);
+        if (written != bytes) {
+            aml_printf("[update]ERR(L%d):", __LINE__);
+            aml_printf("Want to write %dB to path[%s], but only %dB\n", bytes, sink->filename,
+                written);
+            return -1;
+        }
+        sink->info->update_progress((int)bytes);
+    } else {
+        _print_memory_view(data, bytes, sink->address);
+    }
+    sink->address += bytes;
+    return 0;
+}
+
 int update_sub_cmd_read_write (AmlUsbRomRW &rom, const char *cmd, const char **argv,
     int argc) {
+    // boot/cwr/write2 ... --verify=crc: checked on the device before anything runs
+    bool verifyCrc = argc > 0 && !strcmp(argv[argc - 1], "--verify=crc");
+    unsigned int crc = 0;
+    if (verifyCrc) {
+        --argc;
+    }
+    if (verifyCrc && !strcmp(cmd, "write")) { // the control pipe keeps only 64 bytes of every chunk
+        aml_printf("[update]ERR(L%d):", 576);
+        aml_printf("--verify=crc needs boot/cwr/write2, 'write' does not store the whole file\n");
+        return 577;
+    }
     if (argc <= 1) {
         aml_printf("[update]ERR(L%d):", 574);
         aml_printf("cmd[%s] must at least %d parameters, but only %d\n", cmd, 2, argc);
@@ -507,7 +910,7 @@ int update_sub_cmd_read_write (AmlUsbRomRW &rom, const char *cmd, const char **a
     int dataLen; // [rsp+38h] [rbp-108h] MAPDST
     unsigned int dumpFileSize; // [rsp+60h] [rbp-E0h]
     unsigned int bufLen = 0; // [rsp+70h] [rbp-D0h]
-    FILE *fp = nullptr; // [rsp+78h] [rbp-C8h]
+    AmlImage *image = nullptr;
     char *buffer = nullptr; // [rsp+80h] [rbp-C0h] MAPDST
     const char *readFile = nullptr; // [rsp+88h] [rbp-B8h]
     unsigned int dataSize;
@@ -539,18 +942,21 @@ int update_sub_cmd_read_write (AmlUsbRomRW &rom, const char *cmd, const char **a
         offset = rom.address;
         DownloadProgressInfo info(total_, "DUMP");
         buffer = new char[0x20000];
-        while (bufLen) {
-            if (!strcmp("dump", cmd)) {
-                if (bufLen >= 65536) {
-                    dataLen = 65536;
-                } else if (bufLen >= 4096) {
-                    dataLen = 4096;
-                } else {
-                    dataLen = min(bufLen, 512u);
-                }
-            } else {
-                dataLen = min(bufLen, 512u);
+        if (!strcmp("dump", cmd)) {
+            // one device open, bulk IN URBs queued ahead while the file is being written
+            DumpSink sink = { dumpFp, dumpFilename, rom.address, &info };
+            rom.buffer = nullptr;
+            rom.bufferLen = bufLen;
+            rom.pDataSize = &dataSize;
+            if (AmlUsbReadLargeMem::AmlUsbReadLargeMemStream(&rom, dump_sink, &sink) != 0) {
+                aml_printf("[update]ERR(L%d):", 630);
+                aml_printf("read device failed\n");
+                result = -631;
             }
+            bufLen = 0;
+        }
+        while (bufLen) {
+            dataLen = min(bufLen, 512u);
 
             rom.buffer = buffer;
             rom.bufferLen = dataLen;
@@ -592,8 +998,8 @@ int update_sub_cmd_read_write (AmlUsbRomRW &rom, const char *cmd, const char **a
     }
 
     readFile = argv[0];
-    fp = fopen(readFile, "rb");
-    if (!fp) {
+    image = AmlImageOpen(readFile);
+    if (!image || AmlImageSize(image) < 0) {
         aml_printf("[update]ERR(L%d):", 681);
         aml_printf("ERR: can not open the %s file\n", readFile);
         result = -682;
@@ -601,22 +1007,30 @@ int update_sub_cmd_read_write (AmlUsbRomRW &rom, const char *cmd, const char **a
     }
 
     {
+        // "write" needs the address in front of the data, the others send mapped data as is
         buffer = (char *)malloc(0x10008);
-        fseek(fp, 0, 2);
-        int readFileSize = ftell(fp);
-        fseek(fp, 0, 0);
+        int readFileSize = (int)AmlImageSize(image);
+        int chunkSize = !strcmp(cmd, "write") ? 65536 : (int)AmlUsbLargeMemChunkSize(&rom);
         while (readFileSize) {
-            int bulkSize = min(readFileSize, !strcmp(cmd, "write") ? 65536 : 64);
-            fread(buffer + 8, 1, bulkSize, fp);
+            int bulkSize = min(readFileSize, chunkSize);
+            const char *data = nullptr;
+            if (AmlImageRead(image, buffer + 8, bulkSize, &data) != bulkSize) {
+                aml_printf("ERR: read %s failed\n", readFile);
+                result = -717;
+                goto finish;
+            }
             rom.buffer = buffer + 4;
             rom.bufferLen = bulkSize;
             rom.pDataSize = &dataSize;
 
             int resulta;
             if (strcmp(cmd, "write")) {
-                rom.buffer = buffer + 8;
+                rom.buffer = (char *)data;
                 resulta = AmlUsbWriteLargeMem::AmlUsbWriteLargeMem(&rom);
             } else {
+                if (data != buffer + 8) {
+                    memcpy(buffer + 8, data, bulkSize);
+                }
                 SET_INT_AT(rom.buffer, 0, rom.address);
                 rom.bufferLen += 4;
                 resulta = AmlUsbCtrlWr(&rom);
@@ -626,15 +1040,22 @@ int update_sub_cmd_read_write (AmlUsbRomRW &rom, const char *cmd, const char **a
                 result = -717;
                 goto finish;
             }
+            if (verifyCrc) {
+                crc = AmlCrc32(crc, data, (size_t)bulkSize);
+            }
             readFileSize -= bulkSize;
             rom.address += bulkSize;
             nBytes += bulkSize;
-            fseek(fp, nBytes, 0);
             printf("..");
         }
         printf("\nTransfer Complete! total size is %d Bytes\n", nBytes);
     }
 
+    if (verifyCrc && VerifyMemoryCrc(rom, (unsigned int)offset, nBytes, crc) != 0) {
+        result = -735;
+        goto finish;
+    }
+
     if (!strcmp(cmd, "boot")) {
         rom.address = offset;
         rom.buffer = (char *)&rom.address;
@@ -648,15 +1069,10 @@ int update_sub_cmd_read_write (AmlUsbRomRW &rom, const char *cmd, const char **a
     goto finish;
 
 finish:
-    if (fp) {
-        fclose(fp);
-    }
+    AmlImageClose(image);
     if (buffer) {
         free(buffer);
     }
-    if (rom.device) {
-        rom.device = nullptr;
-    }
     return result;
 }
 
@@ -670,7 +1086,8 @@ int update_sub_cmd_identify_host (AmlUsbRomRW &rom, int idLen, char *id) {
     unsigned int dataLen = 0;
     char id_buf[16];
 
-    rom.buffer = id ? id : id_buf;
+    id = id ? id : id_buf;
+    rom.buffer = id;
     rom.bufferLen = idLen;
     rom.pDataSize = &dataLen;
     if (AmlUsbIdentifyHost(&rom)) {
@@ -703,16 +1120,8 @@ int update_sub_cmd_identify_host (AmlUsbRomRW &rom, int idLen, char *id) {
     return 0;
 }
 
-int update_sub_cmd_get_chipid (AmlUsbRomRW &rom, const char **argv) { (void)argv;
-    char id[16];
-
-    int ret = update_sub_cmd_identify_host(rom, 4, id);
-    if (ret) {
-        aml_printf("[update]ERR(L%d):", 847);
-        aml_printf("Fail in identifyHost, ret=%d\n", ret);
-        return -848;
-    }
-
+// Chip ID of a device in bl1/bl2 stage, id holds its 4 identify bytes
+static int ReadChipId (AmlUsbRomRW &rom, const char *id, char *chipID) {
     if (id[3] && id[3] != 8) {
         aml_printf("[update]ERR(L%d):", 852);
         aml_printf("romStage not bl1/bl2, cannot support chipid\n");
@@ -728,8 +1137,6 @@ int update_sub_cmd_get_chipid (AmlUsbRomRW &rom, const char **argv) { (void)argv
         return -891;
     }
 
-    char chipID[16];
-
     if (idVer == 0x203) {
         char buf[40];
         aml_printf("[update]get chpid by chip info page\n");
@@ -765,6 +1172,24 @@ int update_sub_cmd_get_chipid (AmlUsbRomRW &rom, const char **argv) { (void)argv
             return -899;
         }
     }
+    return 0;
+}
+
+int update_sub_cmd_get_chipid (AmlUsbRomRW &rom, const char **argv) { (void)argv;
+    char id[16];
+
+    int ret = update_sub_cmd_identify_host(rom, 4, id);
+    if (ret) {
+        aml_printf("[update]ERR(L%d):", 847);
+        aml_printf("Fail in identifyHost, ret=%d\n", ret);
+        return -848;
+    }
+
+    char chipID[16];
+    ret = ReadChipId(rom, id, chipID);
+    if (ret) {
+        return ret;
+    }
 
     printf("ChipID is:0x");
     for (int i = 0; i < AML_CHIP_ID_LEN; ++i) {
@@ -823,6 +1248,8 @@ int update_sub_cmd_mread (AmlUsbRomRW &rom, int argc, const char **argv) {
     buffer[66] = 1;
     rom.buffer = buffer;
     rom.bufferLen = 68;
+    unsigned int dataSize = 0;
+    rom.pDataSize = &dataSize;
     if (AmlUsbBulkCmd(&rom)) {
         aml_printf("ERR: AmlUsbBulkCmd failed!\n");
         return 983;
@@ -837,112 +1264,1190 @@ int update_sub_cmd_mread (AmlUsbRomRW &rom, int argc, const char **argv) {
     return 0;
 }
 
-// scan
-// update mread mem 0x1080000 normal c:\mem_2M.dump
+// DRAM used by gzpartition: the gzip image is loaded at GzLoadAddress and, for `unzip`, expanded
+// below it from GzExpandAddress, so the expanded image must fit between the two.
+static unsigned int GzLoadAddress = 0x10000000;
+static unsigned int GzExpandAddress = 0x01080000;
+
+// image[offset, offset + len) into DRAM at address with the large-memory write path, 64KB at a time
+static int LoadToMemory (AmlUsbRomRW &rom, AmlImage *image, long long offset, long long len,
+    unsigned int address) {
+    char *buffer = AmlImageMapped(image) ? nullptr : (char *)malloc(0x10000);
+    unsigned int dataSize = 0;
+    int result = AmlImageOffset(image) == offset || AmlImageSeek(image, offset) == 0 ? 0 : -1;
+    rom.address = address;
+    for (long long done = 0; result == 0 && done < len;) {
+        int bulkSize = (int)min(len - done, 0x10000ll);
+        const char *data = nullptr;
+        bool read = AmlImageRead(image, buffer, bulkSize, &data) == bulkSize;
+        rom.buffer = (char *)data;
+        rom.bufferLen = bulkSize;
+        rom.pDataSize = &dataSize;
+        if (!read || AmlUsbWriteLargeMem::AmlUsbWriteLargeMem(&rom) != 0) {
+            aml_printf("[update]ERR: load to 0x%x failed at 0x%llx\n", address, offset + done);
+            result = -1;
+        }
+        rom.address += bulkSize;
+        done += bulkSize;
+    }
+    free(buffer);
+    return result;
+}
 
-int main (int argc, const char **argv) {
-    aml_init();
-    if (argc == 1) {
+// update gzpartition <partName|mmc:<dev>[:<byteOffset>]> <image.gz> [loadAddr] [expandAddr]
+// The gzip image crosses USB as is and u-boot expands it: `unzip` into DRAM then `store write`
+// for a partition, or `gzwrite`, which streams to the block device, for an mmc target.
+int update_sub_cmd_gzpartition (AmlUsbRomRW &rom, int argc, const char **argv) {
+    if (argc <= 1) {
         update_help();
-        return 0;
+        return -1;
     }
-    const char *cmd = argv[1];
-    const char **cmdArgv = argv + 3;
-    int cmdArgc = argc - 3;
-    if (!strcmp(cmd, "help")) {
-        update_help();
-        return 0;
+    const char *target = argv[0];
+    const char *filename = argv[1];
+    unsigned int loadAddress = argc > 2 ? strtoul(argv[2]) : GzLoadAddress;
+    unsigned int expandAddress = argc > 3 ? strtoul(argv[3]) : GzExpandAddress;
+    bool gzwrite = strchr(target, ':') != nullptr;
+    char cmd[128] = {};
+    int result = -1;
+    long long compressedSize = 0;
+    long long expandedSize = 0;
+    time_t start = timeGetTime();
+    AmlImage *image = nullptr;
+    if (AmlCompressionDetect(filename) != AML_COMPRESSION_GZIP) {
+        aml_printf("[update]ERR: %s is not a gzip image\n", filename);
+        goto finish;
     }
-    int dev_no;
-    int result;
-    int v24;
-    const char *s1 = null;
-    const char *str_dev_no = null;
-    AmlUsbRomRW rom = {};
-    char scan_mass_storage[4] = {};
-    char dest[512] = {};
-    dev_no = -2;
-    str_dev_no = nullptr;
-    FILE *fp = nullptr;
-    char *buffer = nullptr;
-    int  success = 0;
-    result = -1015;
-    if (!strcmp(cmd, "scan")) {
-        if (argc == 2) {
-            update_scan(nullptr, 1, -2, &success, nullptr);
-        } else if (argc == 3) {
-            str_dev_no = argv[2];
-            if (!strncmp(str_dev_no, "mptool", 7)) {
-                update_scan(nullptr, 1, -2, &success, nullptr);
-            } else if (!strncmp(str_dev_no, "msdev", 6) &&
-                update_scan(nullptr, 1, -2, &success, scan_mass_storage) != 0) {
-                puts("can not find device");
-            }
-        }
-        return 0;
+    image = AmlImageOpen(filename);
+    compressedSize = image ? AmlImageSize(image) : -1;
+    if (compressedSize <= 0 || compressedSize > 0xFFFFFFFFll - loadAddress) {
+        aml_printf("[update]ERR: can not load %s at 0x%x\n", filename, loadAddress);
+        goto finish;
     }
-    // find dev no
-    if (argc > 2) {
-        const char* strArgDev = argv[2];
-        if (memcmp(strArgDev, "dev", 3) == 0) {
-            if (strlen(strArgDev) > 5) {
-                aml_printf("[update]ERR(L%d):", 1062);
-                aml_printf("devPara(%s) err\n", strArgDev);
-                goto finish;
-            }
-            dev_no = strtol(strArgDev + 3, nullptr, 10);
-            if (dev_no > 16) {
-                aml_printf("[update]ERR(L%d):", 1068);
-                aml_printf("dev_no(%d) too large\n", dev_no);
-                goto finish;
-            }
-            cmdArgv = argv + 3;
-        } else if (memcmp(strArgDev, "path-", 5) == 0) {
-            aml_printf("[update]devPath is [%s]\n", strArgDev + 5);
-            rom.device = AmlGetDeviceHandle("WorldCup Device", (char*)strArgDev + 5);
-        } else {
-            dev_no = 0;
-            cmdArgv = argv + 2;
-            ++cmdArgc;
+    if (!gzwrite) {
+        expandedSize = AmlDecompressedSize(filename, AML_COMPRESSION_GZIP);
+        if (expandedSize <= 0 || expandedSize > (long long)loadAddress - expandAddress) {
+            aml_printf("[update]ERR: 0x%llx expanded bytes do not fit in [0x%x, 0x%x),"
+                " use partition instead\n", expandedSize, expandAddress, loadAddress);
+            goto finish;
         }
-    } else {
-        dev_no = 0;
-        cmdArgc = 0;
     }
-    if (!rom.device && update_scan((void **)&rom.device, 0, dev_no, &success, nullptr) != 0) {
-        aml_printf("[update]ERR(L%d):", 1090);
-        aml_printf("can not find device\n");
+
+    if (LoadToMemory(rom, image, 0, compressedSize, loadAddress) != 0) {
+        aml_printf("[update]ERR: load %s failed\n", filename);
+        result = -2;
         goto finish;
     }
-    if (!rom.device) {
-        aml_printf("[update]ERR(L%d):", 1094);
-        aml_printf("can not open dev[%d] device, maybe it not exist!\n", dev_no);
+    aml_printf("[update]loaded 0x%llx gzip bytes at 0x%x in %dms\n", compressedSize, loadAddress,
+        (int)(timeGetTime() - start));
+
+    if (gzwrite) {
+        // mmc:<dev>[:<byteOffset>] -> gzwrite mmc <dev> <addr> <len> <wbuf> <offs>
+        char iface[16] = {};
+        unsigned int dev = 0;
+        long long devOffset = 0;
+        if (sscanf(target, "%15[^:]:%u:%lli", iface, &dev, &devOffset) < 2) {
+            aml_printf("[update]ERR: target %s is not <iface>:<dev>[:<byteOffset>]\n", target);
+            goto finish;
+        }
+        snprintf(cmd, sizeof(cmd), "gzwrite %s %u 0x%x 0x%llx 0x100000 0x%llx", iface, dev,
+            loadAddress, compressedSize, devOffset);
+        if (SendBulkCmd(rom, cmd) != 0) {
+            result = -3;
+            goto finish;
+        }
+    } else {
+        snprintf(cmd, sizeof(cmd), "unzip 0x%x 0x%x 0x%llx", loadAddress, expandAddress,
+            expandedSize);
+        if (SendBulkCmd(rom, cmd) != 0) {
+            result = -3;
+            goto finish;
+        }
+        snprintf(cmd, sizeof(cmd), "store write %s 0x%x 0 0x%llx", target, expandAddress,
+            expandedSize);
+        if (SendBulkCmd(rom, cmd) != 0) {
+            result = -4;
+            goto finish;
+        }
+    }
+    aml_printf("[update]gzpartition %s done in %dms, %.1f%% of the image crossed USB\n", target,
+        (int)(timeGetTime() - start), expandedSize > 0 ? 100.0 * compressedSize / expandedSize : 100.0);
+    result = 0;
+
+finish:
+    AmlImageClose(image);
+    return result;
+}
+
+// Delta mode of `partition`: the image is compared with what the partition already holds region
+// by region, using CRC32s computed by u-boot (`store read` + `crc32`) against ones computed here
+// on all cores at the same time, and only regions that differ are written (`store write`).
+static unsigned int DeltaRegionSize = 4 << 20;
+static unsigned int DeltaWindowSize = 64 << 20;     // read from / written to the store per bulkcmd
+static unsigned int DeltaScratchAddress = 0x10000000;
+static unsigned int DeltaCrcAddress = 0x0F000000;   // u-boot stores region CRCs here
+
+struct DeltaJob {
+    AmlImage *image;
+    long long size;
+    int nRegions;
+    unsigned int *crcs;
+    char *buffer;      // buffered images: one thread, one buffer
+    int result;
+};
+
+static void DeltaRegionCrc (void *that, int index) {
+    DeltaJob *job = (DeltaJob *)that;
+    long long offset = (long long)index * DeltaRegionSize;
+    long long len = min((long long)DeltaRegionSize, job->size - offset);
+    unsigned int crc = 0;
+    for (long long done = 0; done < len;) {
+        const char *data = nullptr;
+        int n = AmlImageReadAt(job->image, offset + done, job->buffer,
+            (int)min(len - done, 1ll << 20), &data);
+        if (n <= 0) {
+            job->result = -1;
+            return;
+        }
+        crc = AmlCrc32(crc, data, (size_t)n);
+        done += n;
+    }
+    job->crcs[index] = crc;
+}
+
+static void DeltaHostThread (void *that) {
+    DeltaJob *job = (DeltaJob *)that;
+    int threads = job->buffer ? 1 : max(1, get_number_of_hardware_cores());
+    AmlParallelFor(job->nRegions, threads, DeltaRegionCrc, job);
+}
+
+// Returns 1 when delta mode can not be used and nothing was written: the caller writes it all.
+int update_sub_cmd_partition_delta (AmlUsbRomRW &rom, const char *partition, const char *filename) {
+    char cmd[128] = {};
+    int result = 1;
+    int changed = 0;
+    long long written = 0;
+    time_t start = timeGetTime();
+    pthread_t host = (pthread_t)0;
+    unsigned char *deviceCrcs = nullptr;
+    DeltaJob job = {};
+    if (AmlCompressionDetect(filename) != AML_COMPRESSION_NONE || is_file_format_sparse(filename)) {
+        aml_printf("[update]delta needs a raw uncompressed image, writing all of %s\n", filename);
+        return 1;
+    }
+    job.image = AmlImageOpen(filename);
+    job.size = job.image ? AmlImageSize(job.image) : -1;
+    if (job.size <= 0 || job.size > 0x7FFFFFFFll * DeltaRegionSize ||
+        (job.size + DeltaRegionSize - 1) / DeltaRegionSize * 4 > DeltaScratchAddress - DeltaCrcAddress) {
+        aml_printf("[update]ERR: can not use %s for delta\n", filename);
+        goto finish;
+    }
+    job.nRegions = (int)((job.size + DeltaRegionSize - 1) / DeltaRegionSize);
+    job.crcs = (unsigned int *)calloc((size_t)job.nRegions, sizeof(unsigned int));
+    deviceCrcs = (unsigned char *)malloc((size_t)job.nRegions * 4);
+    job.buffer = AmlImageMapped(job.image) ? nullptr : (char *)malloc(1 << 20);
+    host = pthread_start_np(DeltaHostThread, &job);
+    if (host == (pthread_t)0) {
+        DeltaHostThread(&job);
+    }
+
+    // the device checksums what it holds while the host checksums the image
+    for (long long window = 0; window < job.size; window += DeltaWindowSize) {
+        long long windowLen = min((long long)DeltaWindowSize, job.size - window);
+        snprintf(cmd, sizeof(cmd), "store read %s 0x%x 0x%llx 0x%llx", partition,
+            DeltaScratchAddress, window, windowLen);
+        if (SendBulkCmd(rom, cmd) != 0) {
+            goto finish;
+        }
+        for (long long offset = window; offset < window + windowLen; offset += DeltaRegionSize) {
+            int region = (int)(offset / DeltaRegionSize);
+            snprintf(cmd, sizeof(cmd), "crc32 0x%llx 0x%llx 0x%x",
+                DeltaScratchAddress + (offset - window),
+                min((long long)DeltaRegionSize, job.size - offset), DeltaCrcAddress + 4 * region);
+            if (SendBulkCmd(rom, cmd) != 0) {
+                goto finish;
+            }
+        }
+    }
+    if (UploadMemory(rom, DeltaCrcAddress, (char *)deviceCrcs, (unsigned int)job.nRegions * 4) != 0) {
+        aml_printf("[update]ERR: reading region CRCs back failed\n");
+        goto finish;
+    }
+    if (host != (pthread_t)0) {
+        pthread_join(host, nullptr);
+        host = (pthread_t)0;
+    }
+    if (job.result != 0) {
+        aml_printf("[update]ERR: read %s failed\n", filename);
+        goto finish;
+    }
+    aml_printf("[update]%d region CRCs compared in %dms\n", job.nRegions,
+        (int)(timeGetTime() - start));
+
+    for (int region = 0; region < job.nRegions;) {
+        if (StoredCrcMatches(deviceCrcs + 4 * region, job.crcs[region])) {
+            region++;
+            continue;
+        }
+        // changed regions next to each other are written together, up to a window
+        long long offset = (long long)region * DeltaRegionSize;
+        long long len = 0;
+        do {
+            len = min(len + DeltaRegionSize, job.size - offset);
+            changed++;
+            region++;
+        } while (region < job.nRegions && len + DeltaRegionSize <= DeltaWindowSize &&
+            !StoredCrcMatches(deviceCrcs + 4 * region, job.crcs[region]));
+        result = -1; // partially written from here on: no fallback
+        if (LoadToMemory(rom, job.image, offset, len, DeltaScratchAddress) != 0) {
+            goto finish;
+        }
+        snprintf(cmd, sizeof(cmd), "store write %s 0x%x 0x%llx 0x%llx", partition,
+            DeltaScratchAddress, offset, len);
+        if (SendBulkCmd(rom, cmd) != 0) {
+            goto finish;
+        }
+        written += len;
+    }
+    aml_printf("[update]delta %s: %d of %d regions changed, 0x%llx of 0x%llx bytes written in %dms\n",
+        partition, changed, job.nRegions, written, job.size, (int)(timeGetTime() - start));
+    result = 0;
+
+finish:
+    if (host != (pthread_t)0) {
+        pthread_join(host, nullptr);
+    }
+    if (result == 1) {
+        aml_printf("[update]delta not possible, writing all of %s\n", filename);
+    }
+    AmlImageClose(job.image);
+    free(job.crcs);
+    free(job.buffer);
+    free(deviceCrcs);
+    return result;
+}
+
+// update tune: scratch DRAM the sweep writes and reads back, so DDR must be up (bl2 or u-boot)
+static unsigned int TuneAddress = 0x10000000;
+static unsigned int TuneBytes = 16 << 20;
+
+// Host controller, identify bytes (the stage is part of them) and, in bl1/bl2, the chip ID
+static int UsbProfileKeyOf (AmlUsbRomRW &rom, AmlUsbProfileKey *key) {
+    memset(key, 0, sizeof(*key));
+    AmlUsbDrv drv = {};
+    if (OpenUsbDevice(&drv, rom.device) != 1) {
+        return -1;
+    }
+    if (AmlUsbGetBackend()->hostController(drv.handle, key->controller,
+        sizeof(key->controller)) != 0) {
+        snprintf(key->controller, sizeof(key->controller), "host");
+    }
+    CloseUsbDevice(&drv);
+    char id[16] = {};
+    unsigned int dataLen = 0;
+    AmlUsbRomRW probe = rom;
+    probe.buffer = id;
+    probe.bufferLen = 4;
+    probe.pDataSize = &dataLen;
+    if (AmlUsbIdentifyHost(&probe) != 0) {
+        return -1;
+    }
+    snprintf(key->identify, sizeof(key->identify), "%d-%d-%d-%d", id[0], id[1], id[2], id[3]);
+    char chipID[16];
+    snprintf(key->chipId, sizeof(key->chipId), "-");
+    if ((id[3] == 0 || id[3] == 8) && ReadChipId(rom, id, chipID) == 0) {
+        for (int i = 0; i < AML_CHIP_ID_LEN; ++i) {
+            snprintf(key->chipId + 2 * i, sizeof(key->chipId) - 2 * i, "%02x", (unsigned char)chipID[i]);
+        }
+    }
+    return 0;
+}
+
+// Settings of an earlier `update tune` on this port and SoC, if there is a profile at all
+static void UseUsbProfile (AmlUsbRomRW &rom) {
+    AmlUsbProfileKey key;
+    AmlUsbProfile profile;
+    if (!AmlUsbProfileExists() || UsbProfileKeyOf(rom, &key) != 0 ||
+        !AmlUsbProfileLoad(&key, &profile)) {
+        return;
+    }
+    AmlUsbProfileApply(&profile);
+    aml_printf("[update]profile %s %s: wbulk 0x%x wdepth %d rseg 0x%x rdepth %d\n", key.controller,
+        key.identify, profile.writeBulkSize, profile.writeQueueDepth, profile.readSegmentSize,
+        profile.readQueueDepth);
+}
+
+static double MegabytesPerSecond (long long bytes, double ms) {
+    return ms > 0 ? bytes / ms * 1000 / (1 << 20) : 0;
+}
+
+static void TunePattern (char *pattern, unsigned int seed) {
+    for (unsigned int i = 0, x = seed; i < TuneBytes; i++) {
+        x = x * 1103515245 + 12345;
+        pattern[i] = (char)(x >> 16);
+    }
+}
+
+// MB/s of writing pattern to TuneAddress the way write/boot do (64KB large-mem calls), -1 on failure
+static double TuneWrite (AmlUsbRomRW &rom, const char *pattern) {
+    AmlUsbRomRW w = rom;
+    unsigned int dataSize = 0;
+    double start = time_in_milliseconds();
+    for (unsigned int offset = 0; offset < TuneBytes; offset += 0x10000) {
+        w.address = TuneAddress + offset;
+        w.buffer = (char *)pattern + offset;
+        w.bufferLen = min(TuneBytes - offset, 0x10000u);
+        w.pDataSize = &dataSize;
+        if (AmlUsbWriteLargeMem::AmlUsbWriteLargeMem(&w) != 0) {
+            return -1;
+        }
+    }
+    return MegabytesPerSecond(TuneBytes, time_in_milliseconds() - start);
+}
+
+struct TuneReadSink {
+    const char *expected;
+    unsigned int offset;
+    bool same;
+};
+
+static int tune_read_sink (void *that, char *data, unsigned int bytes) {
+    TuneReadSink *sink = (TuneReadSink *)that;
+    sink->same = sink->same && memcmp(data, sink->expected + sink->offset, bytes) == 0;
+    sink->offset += bytes;
+    return 0;
+}
+
+// MB/s of streaming TuneBytes back (dump, verify), -1 on failure or if it is not pattern
+static double TuneRead (AmlUsbRomRW &rom, const char *pattern) {
+    AmlUsbRomRW r = rom;
+    unsigned int dataSize = 0;
+    TuneReadSink sink = { pattern, 0, true };
+    r.address = TuneAddress;
+    r.buffer = nullptr;
+    r.bufferLen = TuneBytes;
+    r.pDataSize = &dataSize;
+    double start = time_in_milliseconds();
+    if (AmlUsbReadLargeMem::AmlUsbReadLargeMemStream(&r, tune_read_sink, &sink) != 0 || !sink.same) {
+        return -1;
+    }
+    return MegabytesPerSecond(TuneBytes, time_in_milliseconds() - start);
+}
+
+// Sweeps bulk transfer size and queue depth of large-mem writes, then segment size and queue depth
+// of streamed reads, and stores the fastest in the profile used by later runs. Every write setting
+// is read back (with the read settings in use) before it can win, every read setting compares.
+int update_sub_cmd_tune (AmlUsbRomRW &rom, int argc, const char **argv) {
+    static const unsigned int bulkSizes[] = { 0x200, 0x800, 0x1000 }; // the large-mem ioctl caps it at 4KB
+    static const int writeDepths[] = { 1, 2, 4, 8, 16, 32 };
+    static const unsigned int segmentSizes[] = { 0x100000, 0x400000, 0x1000000 };
+    static const int readDepths[] = { 4, 8, 16, 32, 64 };
+    int result = -1;
+    AmlUsbProfileKey key;
+    AmlUsbProfile defaults;
+    AmlUsbProfile best;
+    double bestWrite = 0;
+    double bestRead = 0;
+    char *pattern = nullptr;
+    if (argc > 0) {
+        TuneAddress = strtoul(argv[0], nullptr, 0);
+    }
+    if (argc > 1) {
+        TuneBytes = strtoul(argv[1], nullptr, 0) & ~0xFFFFu;
+    }
+    if (TuneBytes == 0 || UsbProfileKeyOf(rom, &key) != 0) {
+        aml_printf("[update]ERR: tune needs a device that answers identify and a size >= 64KB\n");
+        return -1;
+    }
+    AmlUsbProfileCurrent(&defaults);
+    best = defaults;
+    pattern = (char *)malloc(TuneBytes);
+    if (!pattern) {
+        goto finish;
+    }
+    printf("tune %s %s %s, 0x%x bytes at 0x%x\n", key.controller, key.identify, key.chipId,
+        TuneBytes, TuneAddress);
+    for (size_t i = 0; i < sizeof(bulkSizes) / sizeof(bulkSizes[0]); i++) {
+        for (size_t j = 0; j < sizeof(writeDepths) / sizeof(writeDepths[0]); j++) {
+            AmlUsbWriteLargeMem::BulkSize = bulkSizes[i];
+            AmlUsbWriteLargeMem::QueueDepth = writeDepths[j];
+            TunePattern(pattern, 0x12345678 + (unsigned int)(i * 64 + j)); // not what the last one left
+            double mbps = TuneWrite(rom, pattern);
+            bool same = mbps < 0 || TuneRead(rom, pattern) >= 0;
+            printf("  write bulk 0x%-5x depth %-2d %6.1fMB/s%s\n", bulkSizes[i], writeDepths[j],
+                max(mbps, 0.0), mbps < 0 ? " FAILED" : !same ? " READ BACK MISMATCH" : "");
+            mbps = same ? mbps : -1;
+            if (mbps > bestWrite) {
+                bestWrite = mbps;
+                best.writeBulkSize = bulkSizes[i];
+                best.writeQueueDepth = writeDepths[j];
+            }
+        }
+    }
+    AmlUsbProfileApply(&best);
+    TunePattern(pattern, 0x12345678);
+    if (bestWrite <= 0 || TuneWrite(rom, pattern) < 0) {
+        aml_printf("[update]ERR: no write setting worked, is DRAM at 0x%x up?\n", TuneAddress);
+        goto finish;
+    }
+    for (size_t i = 0; i < sizeof(segmentSizes) / sizeof(segmentSizes[0]); i++) {
+        for (size_t j = 0; j < sizeof(readDepths) / sizeof(readDepths[0]); j++) {
+            AmlUsbReadLargeMem::SegmentSize = segmentSizes[i];
+            AmlUsbReadLargeMem::QueueDepth = readDepths[j];
+            double mbps = TuneRead(rom, pattern);
+            printf("  read segment 0x%-7x depth %-2d %6.1fMB/s%s\n", segmentSizes[i], readDepths[j],
+                max(mbps, 0.0), mbps < 0 ? " FAILED" : "");
+            if (mbps > bestRead) {
+                bestRead = mbps;
+                best.readSegmentSize = segmentSizes[i];
+                best.readQueueDepth = readDepths[j];
+            }
+        }
+    }
+    if (bestRead <= 0) {
+        aml_printf("[update]ERR: nothing read back matched what was written\n");
+        goto finish;
+    }
+    printf("best: wbulk 0x%x wdepth %d (%.1fMB/s), rseg 0x%x rdepth %d (%.1fMB/s)\n",
+        best.writeBulkSize, best.writeQueueDepth, bestWrite, best.readSegmentSize,
+        best.readQueueDepth, bestRead);
+    result = AmlUsbProfileSave(&key, &best, bestWrite, bestRead);
+
+finish:
+    AmlUsbProfileApply(result == 0 ? &best : &defaults);
+    free(pattern);
+    return result;
+}
+
+// update bench: DRAM the data round trips use (DDR must be up, as for tune)
+static unsigned int BenchAddress = 0x10000000;
+static unsigned int BenchBytes = 16 << 20;
+static int BenchCount = 200; // control and tplcmd round trips
+static int BenchOpens = 20;  // session reopens
+static const char *BenchTplCmd = "echo bench";
+
+struct BenchStats {
+    const char *name;
+    double *ms; // one per successful round trip
+    int n;
+    int failed;
+    long long bytes;
+};
+
+static int compare_ms (const void *a, const void *b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void BenchSample (BenchStats *stats, double start, bool ok, unsigned int bytes) {
+    if (ok) {
+        stats->ms[stats->n++] = time_in_milliseconds() - start;
+        stats->bytes += bytes;
+    } else {
+        stats->failed++;
+    }
+}
+
+static void BenchReport (BenchStats *stats) {
+    if (stats->n == 0) {
+        printf("%-18s %6d %8s %9s %9s %6d\n", stats->name, 0, "-", "-", "-", stats->failed);
+        return;
+    }
+    double total = 0;
+    for (int i = 0; i < stats->n; i++) {
+        total += stats->ms[i];
+    }
+    qsort(stats->ms, (size_t)stats->n, sizeof(double), compare_ms);
+    char rate[16] = "-";
+    if (stats->bytes > 0) {
+        snprintf(rate, sizeof(rate), "%.1f", MegabytesPerSecond(stats->bytes, total));
+    }
+    printf("%-18s %6d %8s %9.3f %9.3f %6d\n", stats->name, stats->n, rate,
+        stats->ms[stats->n / 2], stats->ms[min(stats->n - 1, stats->n * 99 / 100)], stats->failed);
+}
+
+// Round trips against scratch DRAM: MB/s and p50/p99 latency of every primitive the transfer
+// paths are built from, and what a device session open costs. For qualifying flashing stations
+// (host, hub port, cable).
+int update_sub_cmd_bench (AmlUsbRomRW &rom, int argc, const char **argv) {
+    enum { OPS = 6 };
+    static const char *const names[OPS] = {
+        "ctrl write 64B", "ctrl read 64B", "largemem write 64K", "largemem read 64K", "tplcmd+status",
+        "session open",
+    };
+    BenchStats stats[OPS] = {};
+    bool allocated = true;
+    int result = -1;
+    char *data = nullptr;
+    char id[16] = {};
+    unsigned int dataLen = 0;
+    AmlUsbRomRW probe = rom;
+    if (argc > 0) {
+        BenchAddress = strtoul(argv[0], nullptr, 0);
+    }
+    if (argc > 1) {
+        BenchBytes = strtoul(argv[1], nullptr, 0) & ~0xFFFFu;
+    }
+    if (argc > 2) {
+        BenchCount = max(1, (int)strtol(argv[2], nullptr, 0));
+    }
+    int chunks = (int)(BenchBytes / 0x10000);
+    probe.buffer = id;
+    probe.bufferLen = 4;
+    probe.pDataSize = &dataLen;
+    if (chunks == 0 || AmlUsbIdentifyHost(&probe) != 0) {
+        aml_printf("[update]ERR: bench needs a device that answers identify and a size >= 64KB\n");
+        return -1;
+    }
+    bool uboot = id[3] != 0 && id[3] != 8;
+    data = (char *)malloc(0x10000);
+    for (int i = 0; i < OPS; i++) {
+        stats[i].name = names[i];
+        stats[i].ms = (double *)malloc(sizeof(double) *
+            (size_t)max(max(BenchCount, chunks), BenchOpens));
+        allocated = allocated && stats[i].ms;
+    }
+    if (!data || !allocated) {
         goto finish;
     }
+    for (int i = 0; i < 0x10000; i++) {
+        data[i] = (char)(i * 7);
+    }
+    printf("bench 0x%x bytes at 0x%x, %d round trips, stage %d\n", BenchBytes, BenchAddress,
+        BenchCount, id[3]);
+    for (int i = 0; i < BenchCount; i++) {
+        double start = time_in_milliseconds();
+        BenchSample(&stats[0], start, Aml_Libusb_Ctrl_RdWr(rom.device, BenchAddress, data, 64, 0,
+            5000) == 0, 64);
+        start = time_in_milliseconds();
+        BenchSample(&stats[1], start, Aml_Libusb_Ctrl_RdWr(rom.device, BenchAddress, data, 64, 1,
+            5000) == 0, 64);
+    }
+    for (int i = 0; i < chunks; i++) {
+        AmlUsbRomRW w = rom;
+        unsigned int dataSize = 0;
+        w.address = BenchAddress + (unsigned int)i * 0x10000;
+        w.buffer = data;
+        w.bufferLen = 0x10000;
+        w.pDataSize = &dataSize;
+        double start = time_in_milliseconds();
+        BenchSample(&stats[2], start, AmlUsbWriteLargeMem::AmlUsbWriteLargeMem(&w) == 0, 0x10000);
+    }
+    for (int i = 0; i < chunks; i++) {
+        AmlUsbRomRW r = rom;
+        unsigned int dataSize = 0;
+        r.address = BenchAddress + (unsigned int)i * 0x10000;
+        r.buffer = data;
+        r.bufferLen = 0x10000;
+        r.pDataSize = &dataSize;
+        double start = time_in_milliseconds();
+        BenchSample(&stats[3], start, AmlUsbReadLargeMem::AmlUsbReadLargeMem(&r) == 0, 0x10000);
+    }
+    for (int i = 0; uboot && i < BenchCount; i++) { // bl1/bl2 have no tpl commands
+        char cmd[128] = {};
+        char reply[64] = {};
+        unsigned int dataSize = 0;
+        AmlUsbRomRW t = {};
+        snprintf(cmd, sizeof(cmd), "%s", BenchTplCmd);
+        cmd[66] = 1;
+        t.device = rom.device;
+        t.buffer = cmd;
+        t.bufferLen = 68;
+        t.pDataSize = &dataSize;
+        double start = time_in_milliseconds();
+        bool ok = AmlUsbTplCmd(&t) == 0;
+        t.buffer = reply;
+        t.bufferLen = 64;
+        BenchSample(&stats[4], start, ok && AmlUsbReadStatus(&t) == 0, 0);
+    }
+    // last: the session is dropped and opened again, as a new `update` process would
+    for (int i = 0; i < BenchOpens; i++) {
+        AmlUsbDrv drv = {};
+        if (rom.device->handle >= 0) {
+            AmlUsbGetBackend()->close(rom.device->handle);
+            rom.device->handle = -1;
+        }
+        double start = time_in_milliseconds();
+        bool ok = OpenUsbDevice(&drv, rom.device) == 1;
+        BenchSample(&stats[5], start, ok, 0);
+        if (!ok || rom.device->handle < 0) { // nothing after this may run against a closed session
+            aml_printf("[update]ERR: device did not open again after %d sessions, bench stopped\n", i);
+            goto finish;
+        }
+    }
+    printf("%-18s %6s %8s %9s %9s %6s\n", "op", "count", "MB/s", "p50 ms", "p99 ms", "failed");
+    result = 0;
+    for (int i = 0; i < OPS; i++) {
+        BenchReport(&stats[i]);
+        result = stats[i].failed ? -1 : result;
+    }
+
+finish:
+    for (int i = 0; i < OPS; i++) {
+        free(stats[i].ms);
+    }
+    free(data);
+    return result;
+}
+
+// Commands that talk to one already opened device. They are the ones `devall` can run in parallel.
+static const char *const update_device_cmds[] = {
+    "run", "rreg", "password", "chipinfo", "chipid", "write", "read", "wreg", "dump", "boot",
+    "cwr", "write2", "identify", "reset", "tplcmd", "burn", "tplstat", "mwrite", "partition",
+    "bulkcmd", "mread", "gzpartition", "flash-plan",
+};
+
+bool update_is_device_cmd (const char *cmd) {
+    for (size_t i = 0; i < sizeof(update_device_cmds) / sizeof(update_device_cmds[0]); i++) {
+        if (!strcmp(cmd, update_device_cmds[i])) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// argv/argc are the command arguments after `cmd` and the optional devN/path-/devall argument
+int update_dispatch (AmlUsbRomRW &rom, const char *cmd, const char **argv, int argc,
+    AmlMediaRing *ring, int consumer) {
+    int result = -1015;
+    char buffer[128] = {};
     if (!strcmp(cmd, "run") || !strcmp(cmd, "rreg")) {
-        return update_sub_cmd_run_and_rreg(rom, cmd, cmdArgv, cmdArgc);
+        return update_sub_cmd_run_and_rreg(rom, cmd, argv, argc);
     }
     if (!strcmp("password", cmd)) {
-        result = update_sub_cmd_set_password(rom, cmdArgv, cmdArgc);
-        goto finish;
+        return update_sub_cmd_set_password(rom, argv, argc);
     }
     if (!strcmp("chipinfo", cmd)) {
-        if (cmdArgc <= 0) {
+        if (argc <= 0) {
             aml_printf("[update]ERR(L%d):", 1112);
             aml_printf("paraNum(%d) too small for chipinfo\n", argc);
-        } else {
-            result = update_sub_cmd_get_chipinfo(rom, cmdArgv, cmdArgc);
+            return result;
         }
-        goto finish;
+        return update_sub_cmd_get_chipinfo(rom, argv, argc);
     }
     if (!strcmp(cmd, "chipid")) {
-        result = update_sub_cmd_get_chipid(rom, cmdArgv);
-        goto finish;
+        return update_sub_cmd_get_chipid(rom, argv);
     }
     if (!strcmp(cmd, "write") || !strcmp(cmd, "read") || !strcmp(cmd, "wreg") ||
         !strcmp(cmd, "dump") || !strcmp(cmd, "boot") || !strcmp(cmd, "cwr") ||
         !strcmp(cmd, "write2")) {
-        result = update_sub_cmd_read_write(rom, cmd, cmdArgv, cmdArgc);
+        return update_sub_cmd_read_write(rom, cmd, argv, argc);
+    }
+    if (!strcmp(cmd, "identify")) {
+        return update_sub_cmd_identify_host(rom, argc ? atoi(argv[0]) : 4, nullptr);
+    }
+    if (!strcmp(cmd, "reset")) {
+        if (AmlResetDev(&rom)) {
+            aml_printf("[update]ERR(L%d):", 1216);
+            aml_printf("ERR: get info from device failed\n");
+            return result;
+        }
+        aml_printf("[update]reset succesful\n");
+        return 0;
+    }
+    if (!strcmp(cmd, "tplcmd")) {
+        return argc > 0 ? update_sub_cmd_tplcmd(rom, argv[argc - 1]) : result;
+    }
+    if (!strcmp(cmd, "burn")) {
+        if (AmlUsbburn(rom.device, "d:/u-boot.bin", 0x49000000, "nand", 0x12345678, 0x2000,
+            0) < 0) {
+            puts("ERR: get info from device failed");
+            return result;
+        }
+        return 0;
+    }
+    if (!strcmp(cmd, "tplstat")) {
+        rom.bufferLen = 64;
+        rom.buffer = buffer;
+        if (AmlUsbReadStatus(&rom) != 0) {
+            puts("ERR: AmlUsbReadStatus failed!");
+            return result;
+        }
+        printf("reply %s \n", buffer);
+        return 0;
+    }
+    if (!strcmp(cmd, "mwrite")) {
+        if (argc <= 3) {
+            update_help();
+            return result;
+        }
+        return do_cmd_mwrtie(argv, argc, rom, ring, consumer);
+    }
+    if (!strcmp(cmd, "partition")) {
+        bool resume = argc > 0 && !strcmp(argv[argc - 1], "--resume");
+        argc -= resume ? 1 : 0;
+        if (argc <= 1) {
+            update_help();
+            return result;
+        }
+        bool delta = argc > 2 && !strcmp(argv[2], "delta");
+        if (delta) {
+            int deltaResult = update_sub_cmd_partition_delta(rom, argv[0], argv[1]);
+            if (deltaResult != 1) {
+                return deltaResult;
+            }
+        }
+        int mwriteArgc = 4;
+        const char *mwriteArgv[8] = { argv[1], "store", argv[0],
+                                     argc <= 2 || delta ? is_file_format_sparse(argv[1])
+                                                 ? "sparse" : "normal" : argv[2] };
+        if (argc > 3) {
+            mwriteArgv[4] = argv[3];
+            ++mwriteArgc;
+        }
+        if (resume) {
+            mwriteArgv[mwriteArgc++] = "--resume";
+        }
+        return do_cmd_mwrtie(mwriteArgv, mwriteArgc, rom, ring, consumer);
+    }
+    if (!strcmp(cmd, "bulkcmd")) {
+        if (argc <= 0) {
+            update_help();
+            return result;
+        }
+        const char *s1 = argv[argc - 1];
+        memcpy(buffer, s1, min(strlen(s1), (size_t)64));
+        buffer[66] = 1;
+        unsigned int dataSize;
+        rom.bufferLen = 68;
+        rom.buffer = buffer;
+        rom.pDataSize = &dataSize;
+        if (AmlUsbBulkCmd(&rom) != 0) {
+            puts("ERR: AmlUsbBulkCmd failed!");
+            return -1363;
+        }
+        return 0;
+    }
+    if (!strcmp(cmd, "mread")) {
+        return update_sub_cmd_mread(rom, argc, argv);
+    }
+    if (!strcmp(cmd, "gzpartition")) {
+        return update_sub_cmd_gzpartition(rom, argc, argv);
+    }
+    if (!strcmp(cmd, "flash-plan")) {
+        if (argc <= 0) {
+            update_help();
+            return result;
+        }
+        return update_flash_plan(rom, argv[0]);
+    }
+    return result;
+}
+
+// Device of a script session. After a step that makes the board re-enumerate (e.g. `run` of
+// u-boot) the script says `reopen [seconds]` and the same devN / path- is looked up again.
+static int ReopenDevice (AmlUsbRomRW &rom, int dev_no, const char *devPath, int seconds) {
+    AmlReleaseDeviceHandle(rom.device);
+    rom.device = nullptr;
+    time_t start = timeGetTime();
+    while (!rom.device) {
+        int success = 0;
+        if (devPath) {
+            rom.device = AmlGetDeviceHandle("WorldCup Device", (char *)devPath);
+        } else if (update_scan((void **)&rom.device, 0, dev_no, &success, nullptr) != 0) {
+            rom.device = nullptr;
+        }
+        if (!rom.device && (int)(timeGetTime() - start) >= seconds * 1000) {
+            return -1;
+        }
+        if (!rom.device) {
+            usleep(200000);
+        }
+    }
+    return 0;
+}
+
+// Splits line in place into whitespace separated words, "..." keeps spaces. Returns word count.
+static int SplitScriptLine (char *line, const char **words, int maxWords) {
+    int n = 0;
+    char *p = line;
+    line[strcspn(line, "\r\n")] = '\0';
+    while (n < maxWords) {
+        while (*p == ' ' || *p == '\t') {
+            p++;
+        }
+        if (*p == '\0' || *p == '#') {
+            break;
+        }
+        char end = *p == '"' ? '"' : ' ';
+        p += end == '"';
+        words[n++] = p;
+        while (*p && *p != end && !(end == ' ' && *p == '\t')) {
+            p++;
+        }
+        if (*p) {
+            *p++ = '\0';
+        }
+    }
+    return n;
+}
+
+// update script [devN|path-xxx] <file|->: one sub-command per line (an optional leading "update"
+// is ignored, # starts a comment) run in order over one device session, stopping at the first
+// failure. Saves a process start, a scan and a device open per step.
+int update_script (AmlUsbRomRW &rom, const char *filename, int dev_no, const char *devPath) {
+    FILE *fp = strcmp(filename, "-") ? fopen(filename, "r") : stdin;
+    if (!fp) {
+        aml_printf("[update]ERR: can not open script %s\n", filename);
+        return -1;
+    }
+    int result = 0;
+    int step = 0;
+    char line[1024];
+    time_t start = timeGetTime();
+    for (int lineNo = 1; result == 0 && fgets(line, sizeof(line), fp); lineNo++) {
+        const char *words[16] = {};
+        int nWords = SplitScriptLine(line, words, 16);
+        int first = nWords > 0 && !strcmp(words[0], "update") ? 1 : 0;
+        if (nWords <= first) {
+            continue;
+        }
+        const char *cmd = words[first];
+        const char **argv = words + first + 1;
+        int argc = nWords - first - 1;
+        time_t stepStart = timeGetTime();
+        step++;
+        aml_printf("[update]script step %d (line %d): %s\n", step, lineNo, cmd);
+        if (!strcmp(cmd, "reopen")) {
+            result = ReopenDevice(rom, dev_no, devPath, argc > 0 ? atoi(argv[0]) : 10);
+            if (result != 0) {
+                aml_printf("[update]ERR: device did not come back\n");
+            }
+        } else if (update_is_device_cmd(cmd)) {
+            result = update_dispatch(rom, cmd, argv, argc);
+        } else {
+            aml_printf("[update]ERR: %s can not be used in a script\n", cmd);
+            result = -1;
+        }
+        aml_printf("[update]script step %d %s: result %d in %dms\n", step, cmd, result,
+            (int)(timeGetTime() - stepStart));
+    }
+    if (fp != stdin) {
+        fclose(fp);
+    }
+    aml_printf("[update]script %s: %d steps in %dms%s\n", filename, step,
+        (int)(timeGetTime() - start), result == 0 ? "" : ", stopped at the failed step");
+    return result;
+}
+
+// 64KB chunks of the next image read (decompressed, hashed, checksummed) while a plan step transfers
+static int PlanPrefetchSlots = 256;
+
+struct FlashPlanStep {
+    char line[1024];
+    const char *words[8];   // partName imagePath [format] [verify]
+    int nWords;
+    const char *format;
+    AmlMediaRing *ring;
+    AmlSparseCheck *sparseCheck;
+    int result;             // of the preparation
+    time_t prepared;        // ms spent preparing
+};
+
+static void PrepareFlashPlanStep (void *that) {
+    FlashPlanStep *step = (FlashPlanStep *)that;
+    const char *image = step->words[1];
+    const char *verify = step->nWords > 3 ? step->words[3] : nullptr;
+    time_t start = timeGetTime();
+    step->format = step->nWords > 2 ? step->words[2]
+        : is_file_format_sparse(image) ? "sparse" : "normal";
+    AmlImage *source = OpenMediaImage(image, step->format);
+    step->ring = source ? AmlMediaRingOpenImage(source, 1, PlanPrefetchSlots,
+        verify && !strcmp(verify, "auto")) : nullptr;
+    step->result = !step->ring ? -1
+        : StartSparseCheck(image, step->format, step->ring, &step->sparseCheck);
+    step->prepared = timeGetTime() - start;
+}
+
+// update flash-plan <manifest>: one "partName imagePath [format] [verify]" per line, written in
+// order like `partition`. The next image is opened, probed, sized (sparse encoding,
+// decompression), hashed and prefetched on another thread while the current one is on the bus.
+int update_flash_plan (AmlUsbRomRW &rom, const char *manifest) {
+    FILE *fp = fopen(manifest, "r");
+    if (!fp) {
+        aml_printf("[update]ERR: can not open flash plan %s\n", manifest);
+        return -1;
+    }
+    enum { MAX_STEPS = 64 };
+    FlashPlanStep *steps = new FlashPlanStep[MAX_STEPS]();
+    int nSteps = 0;
+    int result = 0;
+    char line[1024];
+    while (result == 0 && fgets(line, sizeof(line), fp)) {
+        if (nSteps == MAX_STEPS) {
+            aml_printf("[update]ERR: flash plan has more than %d partitions\n", MAX_STEPS);
+            result = -1;
+            break;
+        }
+        FlashPlanStep *step = &steps[nSteps];
+        line[strcspn(line, "\r\n")] = '\0';
+        strcpy(step->line, line);
+        step->nWords = SplitScriptLine(step->line, step->words, 8);
+        if (step->nWords == 0) {
+            continue;
+        }
+        if (step->nWords < 2 || step->nWords > 4) {
+            aml_printf("[update]ERR: flash plan line [%s] is not partName imagePath [format] [verify]\n",
+                line);
+            result = -1;
+            break;
+        }
+        nSteps++;
+    }
+    fclose(fp);
+
+    time_t start = timeGetTime();
+    pthread_t preparing = (pthread_t)0;
+    if (result == 0 && nSteps > 0) {
+        preparing = pthread_start_np(PrepareFlashPlanStep, &steps[0]);
+    }
+    for (int i = 0; result == 0 && i < nSteps; i++) {
+        FlashPlanStep *step = &steps[i];
+        time_t waited = timeGetTime();
+        if (preparing != (pthread_t)0) {
+            pthread_join(preparing, nullptr);
+            preparing = (pthread_t)0;
+        } else {
+            PrepareFlashPlanStep(step);
+        }
+        waited = timeGetTime() - waited;
+        if (i + 1 < nSteps) {
+            preparing = pthread_start_np(PrepareFlashPlanStep, &steps[i + 1]);
+        }
+        if (step->result != 0) {
+            aml_printf("[update]ERR: flash plan can not use %s\n", step->words[1]);
+            result = -2;
+            break;
+        }
+        const char *mwriteArgv[5] = { step->words[1], "store", step->words[0], step->format,
+            step->nWords > 3 ? step->words[3] : nullptr };
+        time_t stepStart = timeGetTime();
+        result = do_cmd_mwrtie(mwriteArgv, step->nWords > 3 ? 5 : 4, rom, step->ring, 0);
+        if (AmlSparseCheckFinish(step->sparseCheck) != 0 && result == 0) {
+            aml_printf("[update]ERR: %s failed CRC32 validation\n", step->words[1]);
+            result = -3;
+        }
+        step->sparseCheck = nullptr;
+        AmlMediaRingClose(step->ring);
+        step->ring = nullptr;
+        aml_printf("[update]flash plan %d/%d %s: result %d, prepared in %dms (device waited %dms),"
+            " written in %dms\n", i + 1, nSteps, step->words[0], result, (int)step->prepared,
+            (int)waited, (int)(timeGetTime() - stepStart));
+    }
+    if (preparing != (pthread_t)0) {
+        pthread_join(preparing, nullptr);
+    }
+    for (int i = 0; i < nSteps; i++) {
+        AmlSparseCheckFinish(steps[i].sparseCheck);
+        AmlMediaRingClose(steps[i].ring);
+    }
+    delete[] steps;
+    aml_printf("[update]flash plan %s: %d partitions in %dms%s\n", manifest, nSteps,
+        (int)(timeGetTime() - start), result == 0 ? "" : ", stopped at the failed one");
+    return result;
+}
+
+// 64KB chunks the fastest device may run ahead of the slowest one in broadcast mode
+static int BroadcastSlots = 256;
+
+struct UpdateParallelJob {
+    const char *cmd;
+    const char **argv;
+    int argc;
+    struct usb_device **devices;
+    AmlMediaRing *ring; // mwrite/partition: image read once for all devices
+    int results[AML_MAX_DEVICES];
+    unsigned int elapsed[AML_MAX_DEVICES]; // ms
+};
+
+static void update_parallel_proc (void *that, int index) {
+    UpdateParallelJob *job = (UpdateParallelJob *)that;
+    AmlUsbRomRW rom = {};
+    rom.device = job->devices[index];
+    time_t start = timeGetTime();
+    aml_printf("[update]dev%d: %s started\n", index, job->cmd);
+    job->results[index] = update_dispatch(rom, job->cmd, job->argv, job->argc, job->ring, index);
+    if (job->ring) {
+        AmlMediaRingDetach(job->ring, index); // failed before or during download: stop holding back the others
+    }
+    job->elapsed[index] = (unsigned int)(timeGetTime() - start);
+    aml_printf("[update]dev%d: %s %s\n", index, job->cmd,
+        job->results[index] == 0 ? "OK" : "FAILED");
+}
+
+// `update <cmd> devall ...`: runs the same device command on every attached WorldCup device,
+// one worker per device. mwrite/partition images are read and checksummed once and broadcast
+// to all devices. Returns 0 when all devices succeeded, else the first device's error.
+int update_parallel (const char *cmd, const char **argv, int argc) {
+    struct usb_device *devices[AML_MAX_DEVICES] = {};
+    int nDevices = AmlOpenDeviceHandles(devices, AML_MAX_DEVICES);
+    if (nDevices <= 0) {
+        aml_printf("[update]ERR(L%d):", 1660);
+        aml_printf("can not find device\n");
+        return -1661;
+    }
+    UpdateParallelJob *job = new UpdateParallelJob();
+    job->cmd = cmd;
+    job->argv = argv;
+    job->argc = argc;
+    job->devices = devices;
+    const char *image = !strcmp(cmd, "mwrite") && argc > 3 ? argv[0]
+        : !strcmp(cmd, "partition") && argc > 1 ? argv[1] : nullptr;
+    const char *verify = !strcmp(cmd, "mwrite") && argc > 4 ? argv[4]
+        : !strcmp(cmd, "partition") && argc > 3 ? argv[3] : nullptr;
+    const char *format = !strcmp(cmd, "mwrite") && argc > 3 ? argv[3]
+        : !strcmp(cmd, "partition") && argc > 2 ? argv[2] : nullptr;
+    AmlSparseCheck *sparseCheck = nullptr;
+    int result = 0;
+    int nStarted = nDevices;
+    if (image && nDevices > 1 && !(format && !strcmp(format, "delta"))) { // delta reads per device
+        AmlImage *source = OpenMediaImage(image, format);
+        job->ring = source ? AmlMediaRingOpenImage(source, nDevices, BroadcastSlots,
+            verify && !strcmp(verify, "auto")) : nullptr;
+        if (job->ring && StartSparseCheck(image, format, job->ring, &sparseCheck) != 0) {
+            result = -1662;
+            nStarted = 0; // rejected before any device was touched
+        }
+    }
+    time_t start = timeGetTime();
+    AmlParallelFor(nStarted, nStarted, update_parallel_proc, job);
+    if (AmlSparseCheckFinish(sparseCheck) != 0) {
+        aml_printf("[update]ERR: %s failed CRC32 validation\n", image);
+        result = -1663;
+    }
+    AmlMediaRingClose(job->ring);
+    int failed = 0;
+    aml_printf("[update]%s on %d devices in %d ms\n", cmd, nDevices, (int)(timeGetTime() - start));
+    for (int i = 0; i < nDevices; i++) {
+        aml_printf("[update]dev%d: result=%d %u ms\n", i, job->results[i], job->elapsed[i]);
+        if (job->results[i] != 0) {
+            result = result != 0 ? result : job->results[i];
+            ++failed;
+        }
+        AmlReleaseDeviceHandle(devices[i]);
+    }
+    if (failed) {
+        aml_printf("[update]ERR: %d of %d devices failed\n", failed, nDevices);
+    }
+    delete job;
+    return result;
+}
+
+// scan
+// update mread mem 0x1080000 normal c:\mem_2M.dump
+
+int main (int argc, const char **argv) {
+    aml_init();
+    if (argc == 1) {
+        update_help();
+        return 0;
+    }
+    const char *cmd = argv[1];
+    const char **cmdArgv = argv + 3;
+    int cmdArgc = argc - 3;
+    if (!strcmp(cmd, "help")) {
+        update_help();
+        return 0;
+    }
+    int dev_no;
+    int result;
+    int v24;
+    const char *s1 = null;
+    const char *str_dev_no = null;
+    const char *devPath = nullptr;
+    AmlUsbRomRW rom = {};
+    char scan_mass_storage[4] = {};
+    char dest[512] = {};
+    dev_no = -2;
+    str_dev_no = nullptr;
+    FILE *fp = nullptr;
+    char *buffer = nullptr;
+    int  success = 0;
+    result = -1015;
+    if (!strcmp(cmd, "replay")) {
+        if (argc < 3) {
+            update_help();
+            return -1;
+        }
+        return AmlUsbReplay(argv[2], argc > 3 ? atof(argv[3]) : 1) == 0 ? 0 : -1;
+    }
+    if (!strcmp(cmd, "scan")) {
+        if (argc == 2) {
+            update_scan(nullptr, 1, -2, &success, nullptr);
+        } else if (argc == 3) {
+            str_dev_no = argv[2];
+            if (!strncmp(str_dev_no, "mptool", 7)) {
+                update_scan(nullptr, 1, -2, &success, nullptr);
+            } else if (!strncmp(str_dev_no, "msdev", 6) &&
+                update_scan(nullptr, 1, -2, &success, scan_mass_storage) != 0) {
+                puts("can not find device");
+            }
+        }
+        return 0;
+    }
+    // find dev no
+    if (argc > 2) {
+        const char* strArgDev = argv[2];
+        if (!strcmp(strArgDev, "devall")) {
+            if (!update_is_device_cmd(cmd)) {
+                aml_printf("[update]ERR(L%d):", 1058);
+                aml_printf("cmd(%s) can not run on all devices\n", cmd);
+                goto finish;
+            }
+            result = update_parallel(cmd, argv + 3, argc - 3);
+            goto finish;
+        }
+        if (memcmp(strArgDev, "dev", 3) == 0) {
+            if (strlen(strArgDev) > 5) {
+                aml_printf("[update]ERR(L%d):", 1062);
+                aml_printf("devPara(%s) err\n", strArgDev);
+                goto finish;
+            }
+            dev_no = strtol(strArgDev + 3, nullptr, 10);
+            if (dev_no > 16) {
+                aml_printf("[update]ERR(L%d):", 1068);
+                aml_printf("dev_no(%d) too large\n", dev_no);
+                goto finish;
+            }
+            cmdArgv = argv + 3;
+        } else if (memcmp(strArgDev, "path-", 5) == 0) {
+            aml_printf("[update]devPath is [%s]\n", strArgDev + 5);
+            devPath = strArgDev + 5;
+            rom.device = AmlGetDeviceHandle("WorldCup Device", (char*)strArgDev + 5);
+        } else {
+            dev_no = 0;
+            cmdArgv = argv + 2;
+            ++cmdArgc;
+        }
+    } else {
+        dev_no = 0;
+        cmdArgc = 0;
+    }
+    if (!rom.device && update_scan((void **)&rom.device, 0, dev_no, &success, nullptr) != 0) {
+        aml_printf("[update]ERR(L%d):", 1090);
+        aml_printf("can not find device\n");
+        goto finish;
+    }
+    if (!rom.device) {
+        aml_printf("[update]ERR(L%d):", 1094);
+        aml_printf("can not open dev[%d] device, maybe it not exist!\n", dev_no);
+        goto finish;
+    }
+    if (!strcmp(cmd, "tune")) {
+        result = update_sub_cmd_tune(rom, cmdArgc, cmdArgv);
+        goto finish;
+    }
+    if (!strcmp(cmd, "bench")) {
+        result = update_sub_cmd_bench(rom, cmdArgc, cmdArgv);
+        goto finish;
+    }
+    UseUsbProfile(rom);
+    if (update_is_device_cmd(cmd)) {
+        result = update_dispatch(rom, cmd, cmdArgv, cmdArgc);
+        goto finish;
+    }
+    if (!strcmp(cmd, "script")) {
+        result = update_script(rom, cmdArgc > 0 ? cmdArgv[0] : "-", dev_no, devPath);
         goto finish;
     }
     if (!strcmp(cmd, "msdev") || !strcmp(cmd, "msget") || !strcmp(cmd, "msset")) {
@@ -1005,41 +2510,6 @@ int main (int argc, const char **argv) {
         }
         goto finish;
     }
-    if (!strcmp(cmd, "identify")) {
-        update_sub_cmd_identify_host(rom, cmdArgc ? atoi(cmdArgv[0]) : 4, nullptr);
-        goto finish;
-    }
-    if (!strcmp(cmd, "reset")) {
-        if (AmlResetDev(&rom)) {
-            aml_printf("[update]ERR(L%d):", 1216);
-            aml_printf("ERR: get info from device failed\n");
-        } else {
-            aml_printf("[update]reset succesful\n");
-        }
-        goto finish;
-    }
-    if (!strcmp(cmd, "tplcmd")) {
-        update_sub_cmd_tplcmd(rom, argv[argc - 1]);
-        goto finish;
-    }
-    if (!strcmp(cmd, "burn")) {
-        if (AmlUsbburn(rom.device, "d:/u-boot.bin", 0x49000000, "nand", 0x12345678, 0x2000,
-            0) < 0) {
-            puts("ERR: get info from device failed");
-        }
-        goto finish;
-    }
-    if (!strcmp(cmd, "tplstat")) {
-        rom.device = rom.device;
-        rom.bufferLen = 64;
-        rom.buffer = buffer;
-        if (AmlUsbReadStatus(&rom) == 0) {
-            printf("reply %s \n", buffer);
-        } else {
-            puts("ERR: AmlUsbReadStatus failed!");
-        }
-        goto finish;
-    }
     if (!strcmp(cmd, "skscan") || !strcmp(cmd, "skgsn") || !strcmp(cmd, "skssn")) {
         char *v38[8] = {};
         aml_scan_init();
@@ -1081,48 +2551,6 @@ int main (int argc, const char **argv) {
         aml_scan_close();
         goto finish;
     }
-    if (!strcmp(cmd, "mwrite")) {
-        if (argc > 5) {
-            result = do_cmd_mwrtie(cmdArgv, cmdArgc, rom);
-        } else {
-            update_help();
-        }
-        goto finish;
-    }
-    if (!strcmp(cmd, "partition")) {
-        if (argc > 3) {
-            int mwriteArgc = 4;
-            const char *mwriteArgv[8] = { cmdArgv[1], "store", cmdArgv[0],
-                                         cmdArgc <= 2 ? is_file_format_sparse(cmdArgv[1])
-                                                        ? "sparse" : "normal" : cmdArgv[2] };
-            if (cmdArgc > 3) {
-                mwriteArgv[4] = cmdArgv[3];
-                ++mwriteArgc;
-            }
-            result = do_cmd_mwrtie(mwriteArgv, mwriteArgc, rom);
-        } else {
-            update_help();
-        }
-        goto finish;
-    }
-    if (!strcmp(cmd, "bulkcmd")) {
-        s1 = argv[argc - 1];
-        memcpy(dest, s1, strlen(s1));
-        //v32 = nullptr;
-        memcpy(buffer, dest, strlen(dest));
-        buffer[66] = 1;
-        unsigned int v25;
-        rom.device = rom.device;
-        rom.bufferLen = 68;
-        rom.buffer = buffer;
-        rom.pDataSize = &v25;
-        result = 0;
-        if (AmlUsbBulkCmd(&rom) != 0) {
-            puts("ERR: AmlUsbBulkCmd failed!");
-            result = -1363;
-        }
-        goto finish;
-    }
 
     if (!strcmp(cmd, "down")) {
         if (argc == 4) {
@@ -1141,6 +2569,8 @@ int main (int argc, const char **argv) {
         }
 
         str_dev_no = argv[3];
+        AmlReleaseDeviceHandle(rom.device);
+        rom.device = nullptr;
         if (update_scan((void **)&rom.device, 0, 0, &success, nullptr) <= 0) {
             puts("can not find device");
         } else if (rom.device) {
@@ -1153,11 +2583,6 @@ int main (int argc, const char **argv) {
         goto finish;
     }
 
-    if (!strcmp(cmd, "mread")) {
-        result = update_sub_cmd_mread(rom, cmdArgc, cmdArgv);
-        goto finish;
-    }
-
     update_help();
 
 finish:
@@ -1167,71 +2592,89 @@ finish:
     if (buffer) {
         free(buffer);
     }
-    if (rom.device) {
-        rom.device = nullptr;
-    }
+    AmlReleaseDeviceHandle(rom.device);
+    rom.device = nullptr;
+    AmlPollReport();
     aml_uninit();
     return result;
 }
 
-int WriteMediaFile (AmlUsbRomRW *rom, const char *filename) {
-    int transferPercentage; // ST2C_4
-    int address; // [rsp+14h] [rbp-6Ch]
-    int startTime; // [rsp+24h] [rbp-5Ch]
-    unsigned int v13; // [rsp+28h] [rbp-58h]
-    unsigned int v14; // [rsp+30h] [rbp-50h]
-    long long transferSize; // [rsp+40h] [rbp-40h]
-    long long v17; // [rsp+48h] [rbp-38h]
-    char *buffer; // [rsp+58h] [rbp-28h]
-
-    transferSize = 0;
-    buffer = nullptr;
-    v14 = 0;
-    address = 0;
-
-    FILE *fp = fopen(filename, "rb");
-    if (!fp) {
-        aml_printf("Open file %s failed\n", filename);
-        return -1;
-    }
-
-    fseeko64(fp, 0, 2);
-    off_t fileSize = ftello(fp);
-    v17 = 0;
-    int v3 = max((int)fileSize * 41 / 1600, 0x400000l);
-    fseek(fp, 0, 0);
-    startTime = (int)timeGetTime();
-    buffer = (char *)malloc(0x10000);
-    while (fileSize) {
-        int bulkSize = min((int)fileSize, 0x10000l);
-        fread(buffer, 1, bulkSize, fp);
-        rom->buffer = buffer;
-        rom->bufferLen = bulkSize;
-        rom->pDataSize = &v14;
-        rom->address = address;
-        if (AmlWriteMedia(rom) != 0) {
-            aml_printf("AmlWriteMedia failed\n");
+static int WriteMediaChunks (AmlUsbRomRW *rom, AmlMediaRing *ring, int consumer, bool progress,
+    WriteMediaCheckpoint *checkpoint) {
+    long long transferSize = 0;
+    long long end = checkpoint ? (long long)checkpoint->nextChunk * AML_MEDIA_CHUNK_SIZE : 0;
+    long long fileSize = AmlMediaRingSize(ring);
+    long long reported = 0;
+    long long step = max(fileSize * 41 / 1600, 0x400000ll);
+    int startTime = (int)timeGetTime();
+    for (const AmlMediaChunk *chunk = AmlMediaRingNext(ring, consumer); chunk != nullptr;
+        chunk = AmlMediaRingNext(ring, consumer)) {
+        unsigned int dataSize = 0;
+        rom->buffer = chunk->data;
+        rom->bufferLen = chunk->len;
+        rom->pDataSize = &dataSize;
+        rom->address = chunk->index;
+        if (AmlWriteMediaEx(rom, chunk->checksum) != 0) {
+            aml_printf("[update]dev%d: AmlWriteMedia failed at 0x%llx\n", consumer, chunk->offset);
             break;
         }
-        transferSize += bulkSize;
-        fileSize -= bulkSize;
-        ++address;
-        v13 = (int)(transferSize - v17);
-        if (address == 1) {
+        if (checkpoint) {
+            checkpoint->nextChunk = chunk->index + 1;
+            checkpoint->crc = AmlCrc32(checkpoint->crc, chunk->data, chunk->len);
+        }
+        end = chunk->offset + chunk->len;
+        transferSize += chunk->len;
+        if (progress && transferSize == chunk->len) {
             puts("Downloading....");
         }
-        if (v13 >= v3) {
-            transferPercentage = 100 * (int)transferSize / (int)fileSize;
-            printf("[%3d%%/%5uMB]\r", transferPercentage, (unsigned int)(transferSize >> 20));
+        if (progress && transferSize - reported >= step) {
+            printf("[%3d%%/%5uMB]\r", (int)(100 * end / fileSize),
+                (unsigned int)(transferSize >> 20));
             fflush(stdout);
-            v17 = v3 * transferPercentage;
+            reported = transferSize;
         }
     }
-    aml_printf("[update]Cost time %dSec            \n", (timeGetTime() - startTime) / 1000);
-    aml_printf("[update]Transfer size 0x%llxB(%lluMB)\n", transferSize, transferSize >> 20);
-    free(buffer);
-    fclose(fp);
-    return fileSize ? -1 : 0;
+    AmlMediaRingDetach(ring, consumer);
+    if (AmlMediaRingError(ring) != 0) {
+        aml_printf("[update]dev%d: read image failed\n", consumer);
+    }
+    if (progress) {
+        aml_printf("[update]Cost time %dSec            \n", ((int)timeGetTime() - startTime) / 1000);
+        aml_printf("[update]Transfer size 0x%llxB(%lluMB)\n", transferSize, transferSize >> 20);
+    } else {
+        aml_printf("[update]dev%d: Cost time %dSec, transfer size 0x%llxB(%lluMB)\n", consumer,
+            ((int)timeGetTime() - startTime) / 1000, transferSize, transferSize >> 20);
+    }
+    return end == fileSize ? 0 : -1;
+}
+
+// The image is read by the AmlMediaRing thread, PrefetchSlots chunks ahead of the USB transfer,
+// so disk (or network share) latency overlaps with the device writing the previous chunk.
+// A compressed image adds a stage in front: the decompressor process feeding that thread.
+// With sha1 the image digest is computed by the same thread and returned there (for `verify`).
+int WriteMediaFile (AmlUsbRomRW *rom, const char *filename, unsigned char *sha1) {
+    AmlImage *image = AmlImageOpenDecompressed(filename);
+    return image ? WriteMediaImage(rom, image, sha1) : -1;
+}
+
+// WriteMediaFile for an opened (e.g. sparse encoded) image, which is closed when done
+int WriteMediaImage (AmlUsbRomRW *rom, AmlImage *image, unsigned char *sha1) {
+    AmlMediaRing *ring = AmlMediaRingOpenImage(image, 1, PrefetchSlots, sha1 != nullptr);
+    if (ring == nullptr) {
+        return -1;
+    }
+    int result = WriteMediaChunks(rom, ring, 0, true, nullptr);
+    if (result == 0 && sha1 != nullptr && !AmlMediaRingDigest(ring, sha1)) {
+        result = -1;
+    }
+    AmlMediaRingClose(ring);
+    return result;
+}
+
+// WriteMediaFile for one consumer of an AmlMediaRing (shared by several devices or prefetching for one)
+int WriteMediaRing (AmlUsbRomRW *rom, AmlMediaRing *ring, int consumer, bool progress,
+    WriteMediaCheckpoint *checkpoint) {
+    return WriteMediaChunks(rom, ring, consumer, progress, checkpoint);
 }
 
 //----- (000000000040D0B1) ----------------------------------------------------
@@ -1288,7 +2731,7 @@ DownloadProgressInfo::DownloadProgressInfo (long long total_, const char *prompt
     nBytesDownloaded = 0;
     percentage_100_remain = percentage_100 - percentage_0;
     memset(prompt, 0, sizeof(prompt));
-    memcpy(prompt, prompt_, sizeof(prompt) - 1);
+    strncpy(prompt, prompt_, sizeof(prompt) - 1);
     if (nBytes < percentage_100_remain) {
         nBytes = percentage_100_remain;
     }
@@ -1,4 +1,5 @@
 #include "UsbRomDrv.h"
+#include "AmlMediaRing.h"
 
 #define AML_CHIP_ID_LEN 12
 
@@ -21,7 +22,8 @@ struct DownloadProgressInfo {
 int _print_memory_view(char *buf, unsigned int size, unsigned int offset);
 int update_help();
 int update_scan(void **resultDevices, int print_dev_list, int dev_no, int *success, char *scan_mass_storage);
-int do_cmd_mwrtie (const char **argv, signed int argc, AmlUsbRomRW &rom);
+int do_cmd_mwrtie (const char **argv, signed int argc, AmlUsbRomRW &rom,
+    AmlMediaRing *ring = nullptr, int consumer = 0);
 int update_sub_cmd_run_and_rreg (AmlUsbRomRW &rom, const char *cmd, const char **argv, signed int argc);
 int update_sub_cmd_set_password (AmlUsbRomRW &rom, const char **argv, int argc);
 int update_sub_cmd_get_chipinfo (AmlUsbRomRW &rom, const char **argv, signed int argc);
@@ -30,6 +32,25 @@ int update_sub_cmd_identify_host (AmlUsbRomRW &rom, int idLen, char *id);
 int update_sub_cmd_get_chipid (AmlUsbRomRW &rom, const char **argv);
 int update_sub_cmd_tplcmd (AmlUsbRomRW &rom, const char *tplCmd);
 int update_sub_cmd_mread (AmlUsbRomRW &rom, int argc, const char **argv);
+int update_sub_cmd_gzpartition (AmlUsbRomRW &rom, int argc, const char **argv);
+int update_sub_cmd_partition_delta (AmlUsbRomRW &rom, const char *partition, const char *filename);
+int update_sub_cmd_tune (AmlUsbRomRW &rom, int argc, const char **argv);
+int update_sub_cmd_bench (AmlUsbRomRW &rom, int argc, const char **argv);
+bool update_is_device_cmd (const char *cmd);
+int update_dispatch (AmlUsbRomRW &rom, const char *cmd, const char **argv, int argc,
+    AmlMediaRing *ring = nullptr, int consumer = 0);
+int update_parallel (const char *cmd, const char **argv, int argc);
+int update_script (AmlUsbRomRW &rom, const char *filename, int dev_no, const char *devPath);
+int update_flash_plan (AmlUsbRomRW &rom, const char *manifest);
 int main (int argc, const char **argv);
-int WriteMediaFile(AmlUsbRomRW *rom, const char *filename);
+int WriteMediaFile(AmlUsbRomRW *rom, const char *filename, unsigned char *sha1 = nullptr);
+int WriteMediaImage(AmlUsbRomRW *rom, struct AmlImage *image, unsigned char *sha1 = nullptr);
+// Progress of a WriteMedia transfer in acknowledged ("OK!!") chunks, for mwrite --resume
+struct WriteMediaCheckpoint {
+    unsigned int nextChunk; // first chunk the device has not acknowledged
+    unsigned int crc;       // CRC32 of the image before it
+};
+
+int WriteMediaRing (AmlUsbRomRW *rom, AmlMediaRing *ring, int consumer, bool progress = false,
+    WriteMediaCheckpoint *checkpoint = nullptr);
 int ReadMediaFile (AmlUsbRomRW *rom, const char *filename, long size);
\ No newline at end of file
@@ -17,6 +17,8 @@ BEGIN_C
        It allows to schedule several (e.g. USBIO_BULK_REQUEST_QUEUE_SIZE) USB async 64KB bulk read transfers in advance,
        and reap resulting URBs when they are ready in order. The actual size of reaped URBs may be less then 64KB.
        This mode works well with Tracking Controller because it sends zero length packet on packet boundaries (512 bytes).
+       The same queue also accepts bulk OUT URBs (any size up to USBIO_BULK_REQUEST_SIZE) to keep several writes in flight.
+       Do not mix IN and OUT URBs in the queue at the same time: they are reaped in completion order.
        This mode absolutely does NOT work with "adbd" daemon on Android via function fs (f_fs.c) that does NOT send
        zero length packets on packet boundaries. (Ironically everything works with transfers not exactly multiples on
        packet size but gets stack on 512, 1024 etc).
@@ -92,6 +94,8 @@ typedef struct usbio_buffer_s {
 #endif
 
 int usbio_open(int vid, int pid, usbio_file_t* files, int count); // returns number of opened files in fd[count] array or -1
+int usbio_count(int vid, int pid); // number of attached vid:pid devices, none of them is kept open, locked or claimed
+int usbio_open_at(int vid, int pid, int index, usbio_file_t* file); // opens and claims only the index-th (enumeration order) vid:pid device, returns 1 or -1 and errno
 
 int  usbio_ep_count(usbio_file_t file); // returns number of endpoints or -1 and errno
 byte usbio_pipe_bulk_in1(usbio_file_t file);   // end point 0x81: cameras mipi stream and other data 
@@ -108,7 +112,14 @@ int usbio_control(usbio_file_t file, usbio_ctrl_setup_t* setup, void* data, int*
 
 int usbio_ctrl(usbio_file_t file, usbio_buffer_t* b, void* data, int bytes); // data must point to usbio_ctrl_setup_t possibly following for data buffer
 
-int usbio_submit_urb(usbio_file_t file, int pipe, usbio_buffer_t* urb); // urb->bytes MUST BE == USBIO_BULK_REQUEST_SIZE
+// URB payload memory. Linux: carved out of an mmap() of the usbfs fd (kernel >= 4.6) so the kernel
+// transfers straight from/to it instead of allocating and copying through its own buffer per URB;
+// *dma tells the caller that it got such memory. Falls back to heap memory (*dma = false) when
+// the kernel has no usbfs mmap or usbfs_memory_mb is exhausted, and always on Windows.
+void* usbio_alloc_buffer(usbio_file_t file, int bytes, bool* dma); // null and errno on failure
+void  usbio_free_buffer(void* data, int bytes, bool dma);
+
+int usbio_submit_urb(usbio_file_t file, int pipe, usbio_buffer_t* urb); // IN: urb->bytes MUST BE == USBIO_BULK_REQUEST_SIZE, OUT: 0 < urb->bytes <= USBIO_BULK_REQUEST_SIZE
 int usbio_discard_urb(usbio_file_t file, usbio_buffer_t* urb);
 int usbio_reap_urb(usbio_file_t file, usbio_buffer_t** urb); // returns dequeued urb previously submitted by usbio_submit_urb
 
@@ -123,6 +134,8 @@ int usbio_clear_halt(usbio_file_t file); // avoid = see warnings in implementati
 
 int usbio_set_timeout(usbio_file_t file, int pipe, int milliseconds); // 0 no timeout
 
+int usbio_host_controller(usbio_file_t file, char* name, int bytes); // 0 and the name of the host controller the device is attached to (Linux: its PCI/platform device)
+
 int usbio_set_raw(usbio_file_t file, bool raw); // Linux: always raw
 
 int usbio_close(usbio_file_t file);
@@ -4,6 +4,7 @@
 #include <linux/usbdevice_fs.h>
 #include <linux/usb/ch9.h>
 #include <asm/ioctl.h>
+#include <sys/mman.h>
 
 BEGIN_C
 
@@ -33,6 +34,9 @@ typedef struct usbio_open_ctx_s {
     usbio_file_t* files;
     int i;
     int n;
+    int first;   // matching devices skipped (neither kept open nor claimed) before files[0]
+    int matches; // matching devices seen so far
+    bool count;  // only count matching devices
 } usbio_open_ctx_t;
 
 
@@ -336,9 +340,10 @@ int usbio_ctrl(usbio_file_t file, usbio_buffer_t* b, void* data, int bytes) {
 
 int usbio_submit_urb(usbio_file_t file, int pipe, usbio_buffer_t* b) {
     if (file < 0) { return EBADF; }
-    assert(pipe == PIPE_BULK_IN1 || pipe == PIPE_BULK_IN2);
+    assert(pipe == PIPE_BULK_IN1 || pipe == PIPE_BULK_IN2 || pipe == PIPE_BULK_OUT1 || pipe == PIPE_BULK_OUT2);
     if (pipe == PIPE_BULK_IN1) { assert(b->bytes == USBIO_BULK_REQUEST_SIZE); }
     if (pipe == PIPE_BULK_IN2) { assert(b->bytes == USBIO_CTRL_RESPONSE_SIZE); }
+    if ((pipe & USB_DIR_IN) == 0) { assert(b->bytes > 0 && b->bytes <= USBIO_BULK_REQUEST_SIZE); } // OUT urbs carry payload of any size
     memset(&b->urb, 0, sizeof(b->urb)); // just in case more fields are added by the kernel
     b->urb.type = USBDEVFS_URB_TYPE_BULK;
     b->urb.endpoint = pipe;
@@ -436,6 +441,51 @@ int usbio_clear_halt(usbio_file_t file) { return ioctl(file, USBDEVFS_CLEAR_HALT
 
 int usbio_set_timeout(usbio_file_t file, int pipe, int milliseconds)  { return 0; } // TODO: implement for all pipes (most meaningful got ep0)
 
+// /proc/self/fd/N -> /dev/bus/usb/BBB/DDD, /sys/bus/usb/devices/usbB -> ../../../devices/pci0000:00/0000:00:14.0/usbB
+
+int usbio_host_controller(usbio_file_t file, char* name, int bytes) {
+    char path[64];
+    char link[256];
+    snprintf(path, sizeof(path), "/proc/self/fd/%d", file);
+    ssize_t n = readlink(path, link, sizeof(link) - 1);
+    int bus = 0;
+    if (n <= 0) { return errno; }
+    link[n] = 0;
+    if (sscanf(link, "/dev/bus/usb/%d/", &bus) != 1) { return ENODEV; }
+    snprintf(path, sizeof(path), "/sys/bus/usb/devices/usb%d", bus);
+    n = readlink(path, link, sizeof(link) - 1);
+    if (n <= 0) { return errno; }
+    link[n] = 0;
+    char* root_hub = strrchr(link, '/');
+    if (root_hub == null) { return ENODEV; }
+    *root_hub = 0;
+    char* controller = strrchr(link, '/');
+    snprintf(name, bytes, "%s", controller != null ? controller + 1 : link);
+    return 0;
+}
+
+void* usbio_alloc_buffer(usbio_file_t file, int bytes, bool* dma) {
+    *dma = false;
+    if (file >= 0) {
+        // every mmap() of usbfs fd is a separate coherent DMA region accounted against usbfs_memory_mb
+        void* a = mmap(null, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, file, 0);
+        if (a != MAP_FAILED) {
+            *dma = true;
+            return a;
+        }
+        if (log_ioctl) { trace("usbfs mmap(%d) failed %s, using heap", bytes, strerr(errno)); }
+    }
+    void* a = malloc(bytes);
+    if (a == null) { errno = ENOMEM; }
+    return a;
+}
+
+void usbio_free_buffer(void* data, int bytes, bool dma) {
+    if (data != null) {
+        if (dma) { munmap(data, bytes); } else { free(data); }
+    }
+}
+
 int usbio_set_raw(usbio_file_t usb_file, bool raw) { // Linux: always raw
     return 0;
 }
@@ -450,7 +500,10 @@ static int usbio_open_callback(void* that, usbio_file_t file, const char* name,
     const int id_product = desc->id_product;
 //  trace("%04X:%04X", id_vendor, id_product);
     if (id_vendor == ctx->vid && id_product == ctx->pid) {
-        if (ctx->i < ctx->n) {
+        ctx->matches++;
+        if (ctx->count || ctx->matches <= ctx->first) {
+            return 0;
+        } else if (ctx->i < ctx->n) {
             ctx->files[ctx->i] = file;
 //          trace("%04X:%04X files[%d]=%d", id_vendor, id_product, ctx->i, ctx->files[ctx->i]);
             ctx->i++;
@@ -486,6 +539,34 @@ int usbio_open(int vid, int pid, usbio_file_t* files, int count) { // returns nu
     return ctx.i;
 }
 
+int usbio_count(int vid, int pid) {
+    usbio_open_ctx_t ctx = {};
+    ctx.vid = vid;
+    ctx.pid = pid;
+    ctx.count = true;
+    errno = 0;
+    usb_enumerate(&ctx, &ctx, usbio_open_callback);
+    return ctx.matches;
+}
+
+int usbio_open_at(int vid, int pid, int index, usbio_file_t* file) {
+    assertion(index >= 0, "index=%d must be >= 0", index);
+    *file = (usbio_file_t)0;
+    usbio_open_ctx_t ctx = {};
+    ctx.vid = vid;
+    ctx.pid = pid;
+    ctx.files = file;
+    ctx.n = 1;
+    ctx.first = index;
+    errno = 0;
+    usb_enumerate(&ctx, &ctx, usbio_open_callback);
+    if (ctx.i == 0) {
+        ctx.i = -1;
+        errno = ENODEV;
+    }
+    return ctx.i;
+}
+
 bool usbio_is_device_present(int vid, int pid) {
     usbio_file_t file = (usbio_file_t)0;
     int count = usbio_open(vid, pid, &file, 1);
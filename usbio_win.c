@@ -88,6 +88,7 @@ typedef struct usbio_file_s {
     byte pipe_bulk_out1;
     byte pipe_bulk_out2;
     int  endpoint_count; // 1 or 3 - only support control endpoint + 1 or 2 pipe_bulk_out/pipe_bulk_in
+    char instance[MAX_DEVICE_ID_LEN]; // device instance id "USB\VID_xxxx&PID_xxxx\<serial>" (usbio_host_controller)
     mutex_t lock;               // usbio_file lock
     volatile int32_t locked;    // protection against recursive mutexes
     pthread_cond_t   signal;    // signalled to all waiting threads on each overlapped I/O completion
@@ -132,6 +133,9 @@ typedef struct usbio_open_ctx_s {
     usbio_file_t* files;
     int i;
     int n;
+    int first;   // matching devices skipped (neither kept open nor claimed) before files[0]
+    int matches; // matching devices seen so far
+    bool count;  // only count matching devices
 } usbio_open_ctx_t;
 
 enum { // usb_enumerate_callback return value is a set of:
@@ -142,8 +146,8 @@ enum { // usb_enumerate_callback return value is a set of:
 // Thus, return value of 0 is "close fd and keep going"
 typedef int (*usbio_enumerate_callback_t)(void* that, usbio_file_t file, const char* name, usbio_device_descriptor_t* desc);
 
-static int winusb_create(usbio_file_t* file, const char* name, usbio_open_ctx_t* ctx, usbio_device_descriptor_t* dd,
-                         void* that, usbio_enumerate_callback_t cb, bool* stop_iteration);
+static int winusb_create(usbio_file_t* file, const char* name, const char* instance, usbio_open_ctx_t* ctx,
+                         usbio_device_descriptor_t* dd, void* that, usbio_enumerate_callback_t cb, bool* stop_iteration);
 
 static int usb_enumerate(void* that, usbio_open_ctx_t* ctx, usbio_enumerate_callback_t cb) {
     const char* SYSTEM_CURRENTCONTROLSET_ENUM_USB = "SYSTEM\\CurrentControlSet\\Enum\\USB";
@@ -205,8 +209,10 @@ static int usb_enumerate(void* that, usbio_open_ctx_t* ctx, usbio_enumerate_call
                                         DWORD symbolic_bytes = countof(symbolic);
                                         r = RegQueryValueExA(skey, "SymbolicName", null, null, (byte*)symbolic, &symbolic_bytes);
                                         usbio_file_t usb_file = usbio_file_invalid;
+                                        char instance[MAX_DEVICE_ID_LEN];
+                                        snprintf0(instance, countof(instance), "USB\\%s\\%s", subkey_name, sn);
                                         if (r == 0) {
-                                            r = winusb_create(&usb_file, symbolic, ctx, &dd, that, cb, &stop_iteration);
+                                            r = winusb_create(&usb_file, symbolic, instance, ctx, &dd, that, cb, &stop_iteration);
                                         }
                                         RegCloseKey(skey);
                                     }
@@ -338,6 +344,10 @@ static int schedule_io(usbio_file_t fd, int op, WINUSB_SETUP_PACKET* control_ep_
                     if (r != 0 && r != ERROR_IO_PENDING) { trace("WinUsb_ControlTransfer(%d) failed %s", fd, strerr(r)); }
                 }
 //              dtrace("WinUsb_ControlTransfer(u=%p o=%p bytes=%d xid=%d) r=%d", urb, &urb->o.overlapped, urb->bytes, urb->xid, r);
+            } else if (op == USB_REAP && (urb->endpoint & 0x80) == 0) { // queued bulk OUT see usbio_submit_urb()
+                urb->xid = atomics_increment_int32(&usb_file->xid_read);
+                assert(urb->bytes > 0 && urb->bytes <= USBIO_BULK_REQUEST_SIZE);
+                r = WinUsb_WritePipe(usb_file->usb, (byte)usb_file->pipe_bulk_out1, (byte*)urb->data, urb->bytes, null, &urb->o.overlapped) ? 0 : GetLastError();
             } else if (op == USB_READ || op == USB_REAP) {
                 urb->xid = atomics_increment_int32(&usb_file->xid_read);
                 if (op == USB_REAP) {
@@ -381,9 +391,10 @@ static int submit_urb(usbio_file_t fd, int pipe, usbio_buffer_t* urb) {
         assert(urb->data != null && urb->bytes > 0);
         assert(urb->prev == null && urb->next == null);
         urb->error = 0;
+        urb->endpoint = pipe;
         lock(usb_file);
 //      dtrace("urb=%p overlapped=%p", urb, &urb->o.overlapped);
-        urb->bytes = USBIO_BULK_REQUEST_SIZE;
+        if ((pipe & 0x80) != 0) { urb->bytes = USBIO_BULK_REQUEST_SIZE; } // OUT urbs keep their payload size
         r = usb_file->closing ? ERROR_FILE_HANDLE_REVOKED : schedule_io(fd, USB_REAP, null, urb);
         unlock(usb_file);
     }
@@ -396,7 +407,7 @@ static int submit_urb(usbio_file_t fd, int pipe, usbio_buffer_t* urb) {
 int usbio_submit_urb(usbio_file_t fd, int pipe, usbio_buffer_t* urb) {
     int r = check_urb_parameter(urb);
     if (r == 0) {
-        assert(urb->data != null && urb->bytes == USBIO_BULK_REQUEST_SIZE);
+        assert(urb->data != null && (urb->bytes == USBIO_BULK_REQUEST_SIZE || (pipe & 0x80) == 0));
         r = submit_urb(fd, pipe, urb);
     }
     if (r != 0) {
@@ -662,7 +673,10 @@ static int usbio_open_callback(void* that, usbio_file_t file, const char* name,
     const int id_product = desc->idProduct;
 //  dtrace("%04X:%04X", id_vendor, id_product);
     if (id_vendor == ctx->vid && id_product == ctx->pid) {
-        if (ctx->i < ctx->n) {
+        ctx->matches++;
+        if (ctx->count || ctx->matches <= ctx->first) {
+            return 0;
+        } else if (ctx->i < ctx->n) {
             ctx->files[ctx->i] = file;
 //          dtrace("%04X:%04X files[%d]=%d", id_vendor, id_product, ctx->i, ctx->files[ctx->i]);
             ctx->i++;
@@ -697,6 +711,34 @@ int usbio_open(int vid, int pid, usbio_file_t* files, int count) { // returns nu
     return ctx.i;
 }
 
+int usbio_count(int vid, int pid) {
+    usbio_open_ctx_t ctx = {};
+    ctx.vid = vid;
+    ctx.pid = pid;
+    ctx.count = true;
+    errno = 0;
+    usb_enumerate(&ctx, &ctx, usbio_open_callback);
+    return ctx.matches;
+}
+
+int usbio_open_at(int vid, int pid, int index, usbio_file_t* file) {
+    assertion(index >= 0, "index=%d must be >= 0", index);
+    *file = usbio_file_invalid;
+    usbio_open_ctx_t ctx = {};
+    ctx.vid = vid;
+    ctx.pid = pid;
+    ctx.files = file;
+    ctx.n = 1;
+    ctx.first = index;
+    errno = 0;
+    usb_enumerate(&ctx, &ctx, usbio_open_callback);
+    if (ctx.i == 0) {
+        ctx.i = -1;
+        errno = ENODEV;
+    }
+    return ctx.i;
+}
+
 byte usbio_pipe_bulk_in1(usbio_file_t fd) {
     assertion(valid_fd(fd), "fd=%d", fd);
     usbio_file_t_* usb_file = valid_fd(fd) ? &usbio_files[fd] : null;
@@ -927,6 +969,19 @@ static int winusb_configure_endpoints(usbio_file_t fd) {
     return r;
 }
 
+void* usbio_alloc_buffer(usbio_file_t file, int bytes, bool* dma) { // WinUSB has no usbfs mmap equivalent
+    (void)file;
+    *dma = false;
+    void* a = malloc(bytes);
+    if (a == null) { errno = ENOMEM; }
+    return a;
+}
+
+void usbio_free_buffer(void* data, int bytes, bool dma) {
+    (void)bytes; (void)dma;
+    free(data);
+}
+
 int usbio_set_raw(usbio_file_t fd, bool raw) { // Linux: always raw
     assertion(valid_fd(fd), "fd=%d", fd);
     usbio_file_t_* usb_file = valid_fd(fd) ? &usbio_files[fd] : null;
@@ -1105,8 +1160,8 @@ static int winusb_init(usbio_file_t fd, usbio_open_ctx_t* ctx, usbio_device_desc
     return r;
 }
 
-static int winusb_create(usbio_file_t* file, const char* name, usbio_open_ctx_t* ctx, usbio_device_descriptor_t* dd,
-                         void* that, usbio_enumerate_callback_t cb, bool* stop_iteration) {
+static int winusb_create(usbio_file_t* file, const char* name, const char* instance, usbio_open_ctx_t* ctx,
+                         usbio_device_descriptor_t* dd, void* that, usbio_enumerate_callback_t cb, bool* stop_iteration) {
     mutex_lock(&usbio_files_mutex);
     int fd = usbio_file_invalid;
     // file descriptor usbio_files[0] is not used intentionally - it reduces number of mistakes with index zero
@@ -1123,6 +1178,7 @@ static int winusb_create(usbio_file_t* file, const char* name, usbio_open_ctx_t*
         mutex_init(&usb_file->lock, 0);
         usb_file->file = INVALID_HANDLE_VALUE;
         usb_file->usb  = null;
+        snprintf0(usb_file->instance, countof(usb_file->instance), "%s", instance);
         usb_file->file = CreateFileA(name, GENERIC_READ | GENERIC_WRITE, 0, null, OPEN_EXISTING, FILE_FLAG_OVERLAPPED, null);
         r = usb_file->file == INVALID_HANDLE_VALUE ? GetLastError() : 0;
     }
@@ -1153,6 +1209,25 @@ int usbio_reset(usbio_file_t file) { return E_NOTIMPL; } // meaningless on Windo
 
 int usbio_clear_halt(usbio_file_t file) { return E_NOTIMPL; } // meaningless on Windows
 
+int usbio_host_controller(usbio_file_t fd, char* name, int bytes) {
+    // the first ancestor that is not on the USB bus (hubs, root hub) e.g. "PCI\VEN_8086&DEV_A36D&..."
+    assertion(valid_fd(fd), "fd=%d", fd);
+    usbio_file_t_* usb_file = valid_fd(fd) ? &usbio_files[fd] : null;
+    if (usb_file == null) { return ERR_INVALID_HANDLE; }
+    DEVINST inst = 0;
+    int r = CM_Locate_DevNodeA(&inst, usb_file->instance, CM_LOCATE_DEVNODE_NORMAL) == CR_SUCCESS ? 0 : ERROR_NOT_FOUND;
+    char id[MAX_DEVICE_ID_LEN] = {};
+    while (r == 0) {
+        DEVINST parent = 0;
+        r = CM_Get_Parent(&parent, inst, 0) == CR_SUCCESS && CM_Get_Device_IDA(parent, id, countof(id), 0) == CR_SUCCESS ?
+            0 : ERROR_NOT_FOUND;
+        if (r == 0 && _strnicmp(id, "USB\\", 4) != 0) { break; }
+        inst = parent;
+    }
+    if (r == 0) { snprintf0(name, bytes, "%s", id); }
+    return r;
+}
+
 int usbio_abort_pipe(usbio_file_t fd, int pipe) {
     assertion(valid_fd(fd), "fd=%d", fd);
     usbio_file_t_* usb_file = valid_fd(fd) ? &usbio_files[fd] : null;